@@ -0,0 +1,55 @@
+#include "BufferPool.hpp"
+
+#include <cstdlib>
+#include <new>
+
+std::shared_ptr<BufferPool> BufferPool::Create(size_t buffer_size,
+                                               size_t max_free_buffers) {
+  return std::shared_ptr<BufferPool>(
+      new BufferPool(buffer_size, max_free_buffers));
+}
+
+BufferPool::BufferPool(size_t buffer_size, size_t max_free_buffers)
+    : buffer_size_(buffer_size), max_free_buffers_(max_free_buffers) {}
+
+BufferPool::~BufferPool() {
+  for (char *buffer : free_) {
+    std::free(buffer);
+  }
+}
+
+std::shared_ptr<char> BufferPool::Acquire() {
+  char *buffer = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!free_.empty()) {
+      buffer = free_.back();
+      free_.pop_back();
+    }
+  }
+  if (buffer == nullptr) {
+    buffer = static_cast<char *>(std::aligned_alloc(buffer_size_, buffer_size_));
+    if (buffer == nullptr) {
+      throw std::bad_alloc();
+    }
+  }
+  std::shared_ptr<BufferPool> self = shared_from_this();
+  return std::shared_ptr<char>(
+      buffer, [self](char *buffer) { self->Release(buffer); });
+}
+
+size_t BufferPool::free_buffers() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return free_.size();
+}
+
+void BufferPool::Release(char *buffer) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (free_.size() < max_free_buffers_) {
+      free_.push_back(buffer);
+      return;
+    }
+  }
+  std::free(buffer);
+}
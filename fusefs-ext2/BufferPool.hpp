@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+/**
+ * Hands out fixed-size buffers aligned to their size (the block size), for
+ * the blocks kept in the block cache. A buffer whose last reference goes
+ * away returns to a free list instead of the heap, so the steady churn of a
+ * full cache reuses memory rather than allocating it. The pool lives as long
+ * as any of its buffers.
+ */
+class BufferPool : public std::enable_shared_from_this<BufferPool> {
+public:
+  static std::shared_ptr<BufferPool> Create(size_t buffer_size,
+                                            size_t max_free_buffers);
+  ~BufferPool();
+
+  BufferPool(const BufferPool &) = delete;
+  BufferPool &operator=(const BufferPool &) = delete;
+
+  std::shared_ptr<char> Acquire();
+
+  size_t buffer_size() const { return buffer_size_; }
+  size_t free_buffers() const;
+
+private:
+  BufferPool(size_t buffer_size, size_t max_free_buffers);
+
+  void Release(char *buffer);
+
+  size_t buffer_size_;
+  size_t max_free_buffers_;
+  mutable std::mutex mutex_;
+  std::vector<char *> free_;
+};
@@ -0,0 +1,170 @@
+#include "DirectoryHash.hpp"
+
+#include <cstddef>
+
+#include <ext2fs/ext2_fs.h>
+
+namespace {
+
+const uint32_t kHtreeEof = 0x7fffffff;
+
+uint32_t Rotl(uint32_t value, int shift) {
+  return (value << shift) | (value >> (32 - shift));
+}
+
+uint32_t DxHackHash(std::string_view name, bool is_unsigned) {
+  uint32_t hash;
+  uint32_t hash0 = 0x12a3fe2d;
+  uint32_t hash1 = 0x37abe8f9;
+  for (char ch : name) {
+    int c = is_unsigned ? static_cast<int>(static_cast<unsigned char>(ch))
+                        : static_cast<int>(static_cast<signed char>(ch));
+    hash = hash1 + (hash0 ^ static_cast<uint32_t>(c * 7152373));
+    if (hash & 0x80000000) {
+      hash -= 0x7fffffff;
+    }
+    hash1 = hash0;
+    hash0 = hash;
+  }
+  return hash0 << 1;
+}
+
+/**
+ * Packs up to `num` 32-bit words of the name into `buf`, padding the rest with
+ * a value derived from the name length.
+ */
+void StrToHashBuf(const char *msg, size_t len, uint32_t *buf, int num,
+                  bool is_unsigned) {
+  uint32_t pad = static_cast<uint32_t>(len) | (static_cast<uint32_t>(len) << 8);
+  pad |= pad << 16;
+  uint32_t val = pad;
+  if (len > static_cast<size_t>(num) * 4) {
+    len = num * 4;
+  }
+  for (size_t i = 0; i < len; ++i) {
+    int c = is_unsigned ? static_cast<int>(static_cast<unsigned char>(msg[i]))
+                        : static_cast<int>(static_cast<signed char>(msg[i]));
+    val = static_cast<uint32_t>(c) + (val << 8);
+    if (i % 4 == 3) {
+      *buf++ = val;
+      val = pad;
+      num--;
+    }
+  }
+  if (--num >= 0) {
+    *buf++ = val;
+  }
+  while (--num >= 0) {
+    *buf++ = pad;
+  }
+}
+
+void HalfMd4Transform(uint32_t buf[4], const uint32_t in[8]) {
+  const uint32_t k2 = 013240474631UL;
+  const uint32_t k3 = 015666365641UL;
+  uint32_t a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+  auto f = [](uint32_t x, uint32_t y, uint32_t z) { return z ^ (x & (y ^ z)); };
+  auto g = [](uint32_t x, uint32_t y, uint32_t z) {
+    return (x & y) + ((x ^ y) & z);
+  };
+  auto h = [](uint32_t x, uint32_t y, uint32_t z) { return x ^ y ^ z; };
+  auto round = [](auto fn, uint32_t &a, uint32_t b, uint32_t c, uint32_t d,
+                  uint32_t x, int s) { a = Rotl(a + fn(b, c, d) + x, s); };
+
+  round(f, a, b, c, d, in[0], 3);
+  round(f, d, a, b, c, in[1], 7);
+  round(f, c, d, a, b, in[2], 11);
+  round(f, b, c, d, a, in[3], 19);
+  round(f, a, b, c, d, in[4], 3);
+  round(f, d, a, b, c, in[5], 7);
+  round(f, c, d, a, b, in[6], 11);
+  round(f, b, c, d, a, in[7], 19);
+
+  round(g, a, b, c, d, in[1] + k2, 3);
+  round(g, d, a, b, c, in[3] + k2, 5);
+  round(g, c, d, a, b, in[5] + k2, 9);
+  round(g, b, c, d, a, in[7] + k2, 13);
+  round(g, a, b, c, d, in[0] + k2, 3);
+  round(g, d, a, b, c, in[2] + k2, 5);
+  round(g, c, d, a, b, in[4] + k2, 9);
+  round(g, b, c, d, a, in[6] + k2, 13);
+
+  round(h, a, b, c, d, in[3] + k3, 3);
+  round(h, d, a, b, c, in[7] + k3, 9);
+  round(h, c, d, a, b, in[2] + k3, 11);
+  round(h, b, c, d, a, in[6] + k3, 15);
+  round(h, a, b, c, d, in[1] + k3, 3);
+  round(h, d, a, b, c, in[5] + k3, 9);
+  round(h, c, d, a, b, in[0] + k3, 11);
+  round(h, b, c, d, a, in[4] + k3, 15);
+
+  buf[0] += a;
+  buf[1] += b;
+  buf[2] += c;
+  buf[3] += d;
+}
+
+void TeaTransform(uint32_t buf[4], const uint32_t in[4]) {
+  const uint32_t delta = 0x9E3779B9;
+  uint32_t sum = 0;
+  uint32_t b0 = buf[0], b1 = buf[1];
+  for (int n = 0; n < 16; ++n) {
+    sum += delta;
+    b0 += ((b1 << 4) + in[0]) ^ (b1 + sum) ^ ((b1 >> 5) + in[1]);
+    b1 += ((b0 << 4) + in[2]) ^ (b0 + sum) ^ ((b0 >> 5) + in[3]);
+  }
+  buf[0] += b0;
+  buf[1] += b1;
+}
+
+} // namespace
+
+uint32_t DirectoryHash(std::string_view name, int version,
+                       const uint32_t seed[4], uint32_t *minor_hash) {
+  uint32_t buf[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+  if (seed != nullptr && (seed[0] | seed[1] | seed[2] | seed[3]) != 0) {
+    for (int i = 0; i < 4; ++i) {
+      buf[i] = seed[i];
+    }
+  }
+
+  uint32_t hash = 0;
+  uint32_t minor = 0;
+  uint32_t in[8];
+  const char *p = name.data();
+  switch (version) {
+  case EXT2_HASH_LEGACY_UNSIGNED:
+  case EXT2_HASH_LEGACY:
+    hash = DxHackHash(name, version == EXT2_HASH_LEGACY_UNSIGNED);
+    break;
+  case EXT2_HASH_HALF_MD4_UNSIGNED:
+  case EXT2_HASH_HALF_MD4:
+    for (ptrdiff_t len = name.size(); len > 0; len -= 32, p += 32) {
+      StrToHashBuf(p, len, in, 8, version == EXT2_HASH_HALF_MD4_UNSIGNED);
+      HalfMd4Transform(buf, in);
+    }
+    hash = buf[1];
+    minor = buf[2];
+    break;
+  case EXT2_HASH_TEA_UNSIGNED:
+  case EXT2_HASH_TEA:
+    for (ptrdiff_t len = name.size(); len > 0; len -= 16, p += 16) {
+      StrToHashBuf(p, len, in, 4, version == EXT2_HASH_TEA_UNSIGNED);
+      TeaTransform(buf, in);
+    }
+    hash = buf[0];
+    minor = buf[1];
+    break;
+  default:
+    return 0;
+  }
+  hash &= ~1u;
+  if (hash == (kHtreeEof << 1)) {
+    hash = (kHtreeEof - 1) << 1;
+  }
+  if (minor_hash != nullptr) {
+    *minor_hash = minor;
+  }
+  return hash;
+}
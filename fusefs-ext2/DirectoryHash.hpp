@@ -0,0 +1,15 @@
+#pragma once
+
+#include <cstdint>
+#include <string_view>
+
+/**
+ * Name hashes used by hashed (dir_index) directories, as implemented by the
+ * kernel in fs/ext4/hash.c. `version` is one of the EXT2_HASH_* constants,
+ * including the *_UNSIGNED variants. A zero seed selects the default one.
+ *
+ * Returns the major hash with its low bit cleared, exactly as it is stored in
+ * htree index entries. The minor hash is stored into `minor_hash` if given.
+ */
+uint32_t DirectoryHash(std::string_view name, int version,
+                       const uint32_t seed[4], uint32_t *minor_hash = nullptr);
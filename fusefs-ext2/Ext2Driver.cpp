@@ -1,10 +1,19 @@
 #include "Ext2Driver.hpp"
 
+#include <algorithm>
+#include <exception>
 #include <system_error>
 
+#include "DirectoryHash.hpp"
+#include "Extents.hpp"
+#include "MetadataSnapshot.hpp"
+
 #include <cstring>
 
 #include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 const int kBaseOffset = 1024;
@@ -12,7 +21,32 @@ const size_t kIndirectBlockPointer = 12;
 const size_t kDoublyIndirectPointer = 13;
 const size_t kTriplyIndirectPointer = 14;
 const size_t kRootInode = 2;
-const uint64_t kMaxFD = 2048;
+// Reads at least this long bypass the block cache and go straight into the
+// caller's buffer.
+const size_t kDirectReadBytes = 64 << 10;
+const size_t kMaxReadaheadInFlight = 64;
+const size_t kMaxIovecs = 1024;
+// Inode tables are scanned in reads of up to this size.
+const size_t kScanChunkBytes = 1 << 20;
+// Released block buffers kept around for reuse.
+const size_t kMaxFreeBuffers = 1024;
+// Layout of hashed directory index blocks: the root block starts with fake
+// "." and ".." entries followed by ext2_dx_root_info, interior nodes with
+// one fake empty entry.
+const size_t kDxRootInfoOffset = 24;
+const size_t kDxNodeOffset = 8;
+const size_t kMaxDxLevels = 2;
+const uint32_t kDxBlockMask = 0x0fffffff;
+
+// Deepest extent tree the driver follows; ext4 itself stops at 5.
+const size_t kMaxExtentDepth = 5;
+
+// Size of ext2_dir_entry_2 without the name.
+const size_t kDirEntryHeader = 8;
+// Mode bits for the ext2_dir_entry_2::file_type values.
+const mode_t kFileTypeModes[EXT2_FT_MAX] = {
+    0, S_IFREG, S_IFDIR, S_IFCHR, S_IFBLK, S_IFIFO, S_IFSOCK, S_IFLNK,
+};
 
 enum class InodeType {
   FIFO = 0x1000,
@@ -24,124 +58,341 @@ enum class InodeType {
   UnixSocket = 0xC000,
 };
 
-bool IsDirectory(const OpenFile &file) {
-    return (file.inode.i_mode & static_cast<size_t>(InodeType::Directory)) ==
-        static_cast<size_t>(InodeType::Directory);
-}
+// Image block number of holes in the block map; block 0 never holds data.
+const size_t kHole = 0;
+
+const char kStatsFileName[] = ".ext2fuse-stats";
 
-bool Ext2Driver::IsDirectBlock(size_t file_block_idx) {
-  return file_block_idx < DirectBlockPointers();
+void AppendStat(std::string &text, const std::string &name, uint64_t value) {
+  text += name + " " + std::to_string(value) + "\n";
 }
 
-bool Ext2Driver::IsIndirectBlock(size_t file_block_idx) {
-  return (DirectBlockPointers() <= file_block_idx) &&
-         (file_block_idx < DirectBlockPointers() + IndirectBlockPointers());
+void AppendStat(std::string &text, const std::string &name, double value) {
+  char formatted[32];
+  snprintf(formatted, sizeof(formatted), "%.3f", value);
+  text += name + " " + formatted + "\n";
 }
 
-bool Ext2Driver::IsDoublyIndirectBlock(size_t file_block_idx) {
-  return (DirectBlockPointers() + IndirectBlockPointers() <= file_block_idx) &&
-         (file_block_idx < DirectBlockPointers() + IndirectBlockPointers() +
-                               DoublyIndirectBlockPointers());
+void AppendStat(std::string &text, const std::string &name,
+                const CacheStats &stats) {
+  AppendStat(text, name + ".hits", stats.hits);
+  AppendStat(text, name + ".misses", stats.misses);
+  AppendStat(text, name + ".evictions", stats.evictions);
 }
 
-bool Ext2Driver::IsTriplyIndirectBlock(size_t file_block_idx) {
-  return (DirectBlockPointers() + IndirectBlockPointers() +
-              DoublyIndirectBlockPointers() <=
-          file_block_idx) &&
-         (file_block_idx < DirectBlockPointers() + IndirectBlockPointers() +
-                               DoublyIndirectBlockPointers() +
-                               TriplyIndirectBlockPointers());
+BlockMap::const_iterator FindRun(const BlockMap &map, size_t file_block) {
+  auto run = std::upper_bound(
+      map.begin(), map.end(), file_block,
+      [](size_t block, const BlockRun &run) { return block < run.file_block; });
+  if (run == map.begin()) {
+    return map.end();
+  }
+  --run;
+  if (file_block >= run->file_block + run->length) {
+    return map.end();
+  }
+  return run;
 }
 
-size_t Ext2Driver::DirectBlockPointers() const {
-  return 12;
+// Appends `length` blocks at `file_block`, first filling any gap since the
+// end of the map with a hole. Holes only merge with holes.
+void AppendToBlockMap(BlockMap &map, size_t file_block, size_t image_block,
+                      size_t length = 1) {
+  size_t map_end = map.empty() ? 0 : map.back().file_block + map.back().length;
+  if (map_end < file_block) {
+    AppendToBlockMap(map, map_end, kHole, file_block - map_end);
+  }
+  if (length == 0) {
+    return;
+  }
+  if (!map.empty()) {
+    BlockRun &last = map.back();
+    bool last_is_hole = last.image_block == kHole;
+    if (last.file_block + last.length == file_block &&
+        last_is_hole == (image_block == kHole) &&
+        (last_is_hole || last.image_block + last.length == image_block)) {
+      last.length += length;
+      return;
+    }
+  }
+  map.push_back({file_block, image_block, length});
 }
 
-size_t Ext2Driver::IndirectBlockPointers() const {
-  return block_size_ / sizeof(BlockIdxType);
+// Regular files keep the upper half of their size in i_size_high, which
+// older revisions called i_dir_acl and only used for directories.
+uint64_t InodeSize(const ext2_inode &inode) {
+  uint64_t size = inode.i_size;
+  if (S_ISREG(inode.i_mode)) {
+    size |= static_cast<uint64_t>(inode.i_size_high) << 32;
+  }
+  return size;
 }
 
-size_t Ext2Driver::DoublyIndirectBlockPointers() const {
-  return IndirectBlockPointers() * IndirectBlockPointers();
+// Descriptors without the 64bit feature leave the upper halves zero.
+uint64_t InodeTableBlock(const ext4_group_desc &gd) {
+  return (static_cast<uint64_t>(gd.bg_inode_table_hi) << 32) |
+         gd.bg_inode_table;
 }
 
-size_t Ext2Driver::TriplyIndirectBlockPointers() const {
-  return IndirectBlockPointers() * DoublyIndirectBlockPointers();
+uint64_t InodeBitmapBlock(const ext4_group_desc &gd) {
+  return (static_cast<uint64_t>(gd.bg_inode_bitmap_hi) << 32) |
+         gd.bg_inode_bitmap;
 }
 
-size_t Ext2Driver::GetBlockOffset(size_t block_idx) const {
-  return block_idx * block_size_;
+// An inode that lives elsewhere for as long as the driver, e.g. in the
+// snapshot mapping, handed out without an owner.
+std::shared_ptr<const ext2_inode> Unowned(const ext2_inode *inode) {
+  return std::shared_ptr<const ext2_inode>(std::shared_ptr<const ext2_inode>(),
+                                           inode);
 }
 
-size_t Ext2Driver::GetGroupOffset(size_t group_idx) const {
-  return block_size_ * (group_idx * sb_.s_blocks_per_group + 1);
+bool IsDirectory(const OpenFile &file) {
+    return (file.inode->i_mode & static_cast<size_t>(InodeType::Directory)) ==
+        static_cast<size_t>(InodeType::Directory);
 }
 
+size_t Ext2Driver::DirectBlockPointers() const {
+  return 12;
+}
 
-size_t Ext2Driver::IndirectBlockAddress(size_t file_block_idx) {
-  if (!IsIndirectBlock(file_block_idx)) {
-    return IndirectBlockPointers();
-  }
-  file_block_idx -= DirectBlockPointers();
-  return file_block_idx;
+size_t Ext2Driver::IndirectBlockPointers() const {
+  return block_size_ / sizeof(BlockIdxType);
 }
 
-std::array<size_t, 2> Ext2Driver::DoublyIndirectBlockAddress(size_t file_block_idx) {
-  if (!IsDoublyIndirectBlock(file_block_idx)) {
-    return {IndirectBlockPointers(), IndirectBlockPointers()};
+const void *Ext2Driver::ReadImage(size_t offset, size_t len,
+                                  void *scratch) const {
+  if (mapping_ != nullptr) {
+    if (offset > mapping_size_ || len > mapping_size_ - offset) {
+      errno = EIO;
+      return nullptr;
+    }
+    metrics_.Add(Counter::kImageReads);
+    metrics_.Add(Counter::kImageBytesRead, len);
+    return mapping_ + offset;
+  }
+  ssize_t bytes_read = pread(fd_, scratch, len, offset);
+  if (bytes_read < 0) {
+    return nullptr;
+  }
+  metrics_.Add(Counter::kImageReads);
+  metrics_.Add(Counter::kImageBytesRead, bytes_read);
+  if (static_cast<size_t>(bytes_read) != len) {
+    errno = EIO;
+    return nullptr;
   }
-  file_block_idx -= DirectBlockPointers();
-  file_block_idx -= IndirectBlockPointers();
-  return {file_block_idx / IndirectBlockPointers(), file_block_idx % IndirectBlockPointers()};
+  return scratch;
 }
 
-std::array<size_t, 3> Ext2Driver::TriplyIndirectBlockAddress(size_t file_block_idx) {
-  if (!IsTriplyIndirectBlock(file_block_idx)) {
-    return {IndirectBlockPointers(), IndirectBlockPointers(), IndirectBlockPointers()};
-  }
-  file_block_idx -= DirectBlockPointers();
-  file_block_idx -= IndirectBlockPointers();
-  file_block_idx -= DoublyIndirectBlockPointers();
-  size_t double_address = file_block_idx / DoublyIndirectBlockPointers();
-  size_t single_address = (file_block_idx % DoublyIndirectBlockPointers()) / IndirectBlockPointers();
-  size_t direct_address = file_block_idx % IndirectBlockPointers(); // One modulo is redundant
-  return {double_address, single_address, direct_address};
+uint64_t Ext2Driver::GetBlockOffset(uint64_t block_idx) const {
+  return block_idx * static_cast<uint64_t>(block_size_);
 }
 
-Ext2Driver::Ext2Driver(const std::string &image) : image_(image) {}
+
+Ext2Driver::Ext2Driver(const std::string &image)
+    : image_(image) {}
 
 Ext2Driver::~Ext2Driver() {
+  if (mapping_ != nullptr) {
+    munmap(const_cast<char *>(mapping_), mapping_size_);
+  }
   if (fd_ > 0) {
     close(fd_);
   }
 }
 
-void Ext2Driver::Initialize() {
+void Ext2Driver::Initialize(const DriverOptions &options) {
   fd_ = open(image_.c_str(), O_RDONLY);
   if (fd_ < 0) {
     throw std::system_error(errno, std::generic_category(),
                             "Could not open image");
   }
-  if (lseek(fd_, kBaseOffset, SEEK_SET) < 0) {
-    throw std::system_error(errno, std::generic_category(),
-                            "Error seeking a superblock");
+  if (options.use_mmap) {
+    struct stat image_stat;
+    if (fstat(fd_, &image_stat) < 0) {
+      throw std::system_error(errno, std::generic_category(),
+                              "Could not stat image");
+    }
+    void *mapping =
+        mmap(nullptr, image_stat.st_size, PROT_READ, MAP_SHARED, fd_, 0);
+    if (mapping == MAP_FAILED) {
+      throw std::system_error(errno, std::generic_category(),
+                              "Could not map image");
+    }
+    mapping_ = static_cast<const char *>(mapping);
+    mapping_size_ = image_stat.st_size;
   }
-  if (read(fd_, &this->sb_, sizeof(this->sb_)) < 0) {
+  const void *sb = ReadImage(kBaseOffset, sizeof(this->sb_), &this->sb_);
+  if (sb == nullptr) {
     throw std::system_error(errno, std::generic_category(),
                             "Error reading first superblock in an image");
   }
+  if (sb != &this->sb_) {
+    memcpy(&this->sb_, sb, sizeof(this->sb_));
+  }
   block_size_ = 1024 << sb_.s_log_block_size;
+  inode_size_ = sb_.s_rev_level == EXT2_GOOD_OLD_REV ? EXT2_GOOD_OLD_INODE_SIZE
+                                                     : sb_.s_inode_size;
+
+  // The group descriptor table follows the superblock's block and is small
+  // enough to keep in memory for the lifetime of the mount.
+  // With the 64bit feature block numbers grow to 64 bits and descriptors to
+  // s_desc_size bytes, the upper halves following the 32-bit fields.
+  bool is_64bit = sb_.s_feature_incompat & EXT4_FEATURE_INCOMPAT_64BIT;
+  uint64_t blocks_count = sb_.s_blocks_count;
+  size_t desc_size = sizeof(ext2_group_desc);
+  if (is_64bit) {
+    blocks_count |= static_cast<uint64_t>(sb_.s_blocks_count_hi) << 32;
+    desc_size = std::max<size_t>(desc_size, sb_.s_desc_size);
+  }
+  size_t group_count =
+      (blocks_count - sb_.s_first_data_block + sb_.s_blocks_per_group - 1) /
+      sb_.s_blocks_per_group;
+  groups_.assign(group_count, ext4_group_desc{});
+  std::vector<char> table_buf(group_count * desc_size);
+  const char *table = static_cast<const char *>(
+      ReadImage(GetBlockOffset(sb_.s_first_data_block + 1), table_buf.size(),
+                table_buf.data()));
+  if (table == nullptr) {
+    throw std::system_error(errno, std::generic_category(),
+                            "Error reading group descriptor table");
+  }
+  for (size_t i = 0; i < group_count; ++i) {
+    memcpy(&groups_[i], table + i * desc_size,
+           std::min(desc_size, sizeof(ext4_group_desc)));
+  }
+  inode_bitmaps_.reset(new InodeBitmap[group_count]);
+  buffers_ = BufferPool::Create(block_size_, kMaxFreeBuffers);
+  if (mapping_ == nullptr) {
+    io_ = IoEngine::Create(fd_, options.use_io_uring, options.io_queue_depth);
+  }
+  block_cache_ = ShardedLruCache<size_t, BlockRef>(options.block_cache_bytes / block_size_);
+  inode_cache_ = ShardedLruCache<size_t, std::shared_ptr<const ext2_inode>>(
+      options.inode_cache_entries);
+  block_map_cache_ = ShardedLruCache<size_t, std::shared_ptr<const BlockMap>>(
+      options.block_map_cache_entries);
+  dentry_cache_ = ShardedLruCache<DentryKey, size_t, DentryKeyHash>(
+      options.dentry_cache_entries);
+  options_ = options;
+  // Prefetched blocks land in the block cache; a mapped image is read ahead
+  // by the kernel instead.
+  if (options.readahead_threads != 0 && block_cache_.capacity() != 0 &&
+      mapping_ == nullptr) {
+    readahead_pool_.reset(new ThreadPool(options.readahead_threads));
+  }
+  if (!options.snapshot_path.empty()) {
+    snapshot_ = MetadataSnapshot::Open(options.snapshot_path, sb_);
+    if (!snapshot_ && options.write_snapshot) {
+      // Without a snapshot the image is still served, only more slowly.
+      try {
+        WriteSnapshot(options.snapshot_path);
+        snapshot_ = MetadataSnapshot::Open(options.snapshot_path, sb_);
+      } catch (const std::exception &err) {
+        metrics_.Add(Counter::kSnapshotWriteErrors);
+        fprintf(stderr, "Could not write snapshot %s: %s\n",
+                options.snapshot_path.c_str(), err.what());
+      }
+    }
+  }
+}
+
+CacheStats Ext2Driver::BlockCacheStats() const {
+  return block_cache_.stats();
+}
+
+CacheStats Ext2Driver::InodeCacheStats() const {
+  return inode_cache_.stats();
+}
+
+CacheStats Ext2Driver::BlockMapCacheStats() const {
+  return block_map_cache_.stats();
+}
+
+CacheStats Ext2Driver::DentryCacheStats() const {
+  return dentry_cache_.stats();
+}
+
+PrefetchStats Ext2Driver::ReadaheadStats() const {
+  PrefetchStats stats;
+  stats.windows = readahead_windows_;
+  stats.blocks = readahead_blocks_;
+  return stats;
+}
+
+size_t Ext2Driver::StatsInode() const {
+  return static_cast<size_t>(sb_.s_inodes_count) + 1;
+}
+
+std::string Ext2Driver::StatsText() const {
+  std::string text;
+  for (size_t i = 0; i < static_cast<size_t>(Op::kCount); ++i) {
+    Metrics::OpStats stats = metrics_.Get(static_cast<Op>(i));
+    std::string name = Metrics::Name(static_cast<Op>(i));
+    AppendStat(text, name + ".calls", stats.calls);
+    AppendStat(text, name + ".errors", stats.errors);
+    AppendStat(text, name + ".avg_us",
+               stats.calls == 0 ? 0.0 : stats.total_ns / 1000.0 / stats.calls);
+    AppendStat(text, name + ".p50_us", stats.PercentileNs(0.5) / 1000.0);
+    AppendStat(text, name + ".p90_us", stats.PercentileNs(0.9) / 1000.0);
+    AppendStat(text, name + ".p99_us", stats.PercentileNs(0.99) / 1000.0);
+  }
+  for (size_t i = 0; i < static_cast<size_t>(Counter::kCount); ++i) {
+    AppendStat(text, Metrics::Name(static_cast<Counter>(i)),
+               metrics_.Get(static_cast<Counter>(i)));
+  }
+  AppendStat(text, "block_cache", BlockCacheStats());
+  AppendStat(text, "inode_cache", InodeCacheStats());
+  AppendStat(text, "block_map_cache", BlockMapCacheStats());
+  AppendStat(text, "dentry_cache", DentryCacheStats());
+  PrefetchStats readahead = ReadaheadStats();
+  AppendStat(text, "readahead.windows", readahead.windows);
+  AppendStat(text, "readahead.blocks", readahead.blocks);
+  AppendStat(text, "snapshot", static_cast<uint64_t>(snapshot_ != nullptr));
+  return text;
+}
+
+size_t Ext2Driver::RootInode() const {
+  return kRootInode;
+}
+
+size_t Ext2Driver::Lookup(size_t parent_inode, std::string_view name) {
+  OpTimer timer(metrics_, Op::kLookup);
+  return LookupInDirectory(parent_inode, name);
 }
 
 void Ext2Driver::Getattr(const char *path, struct stat *stat) {
-  size_t inode_idx = GetInodeIdxByPath(path);
-  ext2_inode inode;
-  GetInodeByNumber(inode_idx, &inode);
+  OpTimer timer(metrics_, Op::kGetattr);
+  FillStat(GetInodeIdxByPath(path), stat);
+}
+
+void Ext2Driver::GetattrByInode(size_t inode_idx, struct stat *stat) {
+  OpTimer timer(metrics_, Op::kGetattr);
+  FillStat(inode_idx, stat);
+}
+
+void Ext2Driver::FillStat(size_t inode_idx, struct stat *stat) {
+  if (inode_idx == StatsInode()) {
+    stat->st_ino = inode_idx;
+    stat->st_mode = S_IFREG | 0444;
+    stat->st_nlink = 1;
+    stat->st_uid = 0;
+    stat->st_gid = 0;
+    // Rendering the text on every getattr would cost as much as reading it;
+    // the file is opened with direct_io, so reads do not stop at st_size.
+    stat->st_size = 0;
+    stat->st_atime = sb_.s_wtime;
+    stat->st_ctime = sb_.s_wtime;
+    stat->st_mtime = sb_.s_wtime;
+    stat->st_blocks = 0;
+    return;
+  }
+  std::shared_ptr<const ext2_inode> cached = GetInodeByNumber(inode_idx);
+  const ext2_inode &inode = *cached;
+  stat->st_ino = inode_idx;
   stat->st_mode = inode.i_mode;
   stat->st_nlink = inode.i_links_count;
   stat->st_uid = inode.i_uid;
   stat->st_gid = inode.i_gid;
-  stat->st_size = inode.i_size;
+  stat->st_size = InodeSize(inode);
   stat->st_atime = inode.i_atime;
   stat->st_ctime = inode.i_ctime;
   stat->st_mtime = inode.i_mtime;
@@ -149,318 +400,1040 @@ void Ext2Driver::Getattr(const char *path, struct stat *stat) {
 }
 
 int Ext2Driver::Readlink(const char *path, char *buf, size_t len) {
-    size_t inode_idx = GetInodeIdxByPath(path);
-    OpenFile file = OpenFileByInodeNumber(inode_idx);
-    return ReadFile(file, buf, len, 0);
+  OpTimer timer(metrics_, Op::kReadlink);
+  return ReadSymlink(GetInodeIdxByPath(path), buf, len);
 }
 
-uint64_t Ext2Driver::Open(const char *path) {
-  size_t inode_idx = GetInodeIdxByPath(path);
-  for (int i = 0; i < kMaxFD; ++i) {
-    if (open_files_.find(i) == open_files_.end()) {
-      OpenFile new_file;
-      new_file.inode_idx = inode_idx;
-      GetInodeByNumber(inode_idx, &new_file.inode);
-      open_files_.emplace(i, new_file);
-      return i;
-    }
+int Ext2Driver::ReadlinkInode(size_t inode_idx, char *buf, size_t len) {
+  OpTimer timer(metrics_, Op::kReadlink);
+  return ReadSymlink(inode_idx, buf, len);
+}
+
+int Ext2Driver::ReadSymlink(size_t inode_idx, char *buf, size_t len) {
+  OpenFile file = OpenFileByInodeNumber(inode_idx);
+  if ((file.inode->i_mode & S_IFMT) != S_IFLNK) {
+    throw std::system_error(EINVAL, std::generic_category());
   }
-  throw std::system_error(ENFILE, std::generic_category());
+  return ReadFile(file, buf, len, 0);
+}
+
+bool Ext2Driver::IsFastSymlink(const ext2_inode &inode) const {
+  // i_blocks counts 512-byte sectors, including an extended attribute block.
+  size_t xattr_sectors = inode.i_file_acl != 0 ? block_size_ / 512 : 0;
+  return inode.i_blocks == xattr_sectors;
+}
+
+uint64_t Ext2Driver::Open(const char *path) {
+  OpTimer timer(metrics_, Op::kOpen);
+  return open_files_.Insert(OpenFileByInodeNumber(GetInodeIdxByPath(path)));
+}
+
+uint64_t Ext2Driver::OpenInode(size_t inode_idx) {
+  OpTimer timer(metrics_, Op::kOpen);
+  return open_files_.Insert(OpenFileByInodeNumber(inode_idx));
 }
 
 int Ext2Driver::Read(uint64_t fd, char *buf, size_t len, off_t off) {
-  auto it = open_files_.find(fd);
-  if (it == open_files_.end()) {
+  OpTimer timer(metrics_, Op::kRead);
+  std::shared_ptr<FileHandle> handle = open_files_.Find(fd);
+  if (!handle) {
     throw std::system_error(EBADF, std::generic_category());
   }
-  return ReadFile(it->second, buf, len, off);
+  int result = ReadFile(HandleFile(*handle), buf, len, off);
+  metrics_.Add(Counter::kBytesRead, result);
+  UpdateReadahead(*handle, off, result);
+  return result;
 }
 
 int Ext2Driver::ReadFile(OpenFile &file, char *buf, size_t len, off_t off) {
-  if (off >= file.inode.i_size) {
+  if (file.contents) {
+    const std::string &contents = *file.contents;
+    if (static_cast<size_t>(off) >= contents.size()) {
+      return 0;
+    }
+    len = std::min(len, contents.size() - off);
+    memcpy(buf, contents.data() + off, len);
+    return len;
+  }
+  uint64_t size = InodeSize(*file.inode);
+  if (static_cast<uint64_t>(off) >= size) {
     return 0;
   }
-  if (off + len >= file.inode.i_size) {
-    len = file.inode.i_size - off;
+  len = std::min<uint64_t>(len, size - off);
+  const BlockMap &map = GetBlockMap(file);
+  // Large contiguous pieces are read straight into `buf`, all of them in one
+  // batch once the whole request has been mapped.
+  std::vector<IoRequest> direct_reads;
+  size_t done = 0;
+  while (done < len) {
+    size_t position = off + done;
+    size_t file_block = position / block_size_;
+    size_t block_offset = position % block_size_;
+    BlockMap::const_iterator run = FindRun(map, file_block);
+    if (run == map.end()) {
+      throw std::system_error(EIO, std::generic_category());
+    }
+    size_t image_block = run->image_block + (file_block - run->file_block);
+    size_t run_bytes =
+        (run->file_block + run->length - file_block) * block_size_ - block_offset;
+    size_t chunk = std::min(run_bytes, len - done);
+    if (run->image_block == kHole) {
+      memset(buf + done, 0, chunk);
+      done += chunk;
+      continue;
+    }
+    BlockRef block;
+    if (block_cache_.capacity() != 0 && mapping_ == nullptr) {
+      // Small pieces go through the block cache so hot files stay in memory.
+      // Large ones only use blocks that are already there, e.g. read ahead.
+      if (chunk < kDirectReadBytes) {
+        block = ReadBlock(image_block);
+      } else {
+        block = block_cache_.Get(image_block).value_or(BlockRef());
+      }
+    }
+    if (block) {
+      chunk = std::min(chunk, block_size_ - block_offset);
+      memcpy(buf + done, block.get() + block_offset, chunk);
+    } else if (mapping_ != nullptr) {
+      const void *data = ReadImage(GetBlockOffset(image_block) + block_offset,
+                                   chunk, nullptr);
+      if (data == nullptr) {
+        char error_msg[1024];
+        snprintf(error_msg, sizeof(error_msg),
+                 "Couldn't read %lu bytes at block %lu", chunk, image_block);
+        throw std::system_error(errno, std::generic_category(), error_msg);
+      }
+      memcpy(buf + done, data, chunk);
+    } else {
+      direct_reads.emplace_back(buf + done, chunk,
+                                GetBlockOffset(image_block) + block_offset);
+    }
+    done += chunk;
   }
-  size_t block_start = off / block_size_;
-  size_t block_end = (off + len - 1) / block_size_;
-  size_t block_start_offset = off % block_size_;
-  const char* src_buf = buf;
-  ReadFileBlock(file, block_start);
-  if (block_start == block_end) {
-    memcpy(buf, file.FileData.data() + block_start_offset, len);
-    return len;
+  if (!direct_reads.empty()) {
+    Submit(direct_reads);
+  }
+  for (const IoRequest &request : direct_reads) {
+    if (request.result != static_cast<ssize_t>(request.length())) {
+      char error_msg[1024];
+      snprintf(error_msg, sizeof(error_msg),
+               "Couldn't read %lu bytes at offset %lu", request.length(),
+               request.offset);
+      throw std::system_error(request.result < 0 ? -request.result : EIO,
+                              std::generic_category(), error_msg);
+    }
+  }
+  return done;
+}
+
+std::vector<ReadSegment> Ext2Driver::ReadSegments(uint64_t fd, size_t len,
+                                                 off_t off) {
+  OpTimer timer(metrics_, Op::kRead);
+  std::shared_ptr<FileHandle> handle = open_files_.Find(fd);
+  if (!handle) {
+    throw std::system_error(EBADF, std::generic_category());
+  }
+  std::vector<ReadSegment> segments =
+      MapFileRange(HandleFile(*handle), len, off);
+  size_t done = 0;
+  for (const ReadSegment &segment : segments) {
+    done += segment.length;
+  }
+  metrics_.Add(Counter::kBytesRead, done);
+  // No readahead: image pieces never touch the block cache, and the kernel
+  // reads ahead on the image when they are spliced.
+  return segments;
+}
+
+bool Ext2Driver::ShouldSplice(size_t len, off_t off) const {
+  return mapping_ == nullptr && !options_.use_io_uring &&
+         len >= kDirectReadBytes && off % block_size_ == 0;
+}
+
+int Ext2Driver::ImageFd() const {
+  return fd_;
+}
+
+std::vector<ReadSegment> Ext2Driver::MapFileRange(OpenFile &file, size_t len,
+                                                  off_t off) {
+  std::vector<ReadSegment> segments;
+  if (file.contents) {
+    const std::string &contents = *file.contents;
+    if (static_cast<size_t>(off) < contents.size()) {
+      segments.push_back({std::min(len, contents.size() - off), 0,
+                          BlockRef(file.contents, contents.data() + off)});
+    }
+    return segments;
+  }
+  uint64_t size = InodeSize(*file.inode);
+  if (static_cast<uint64_t>(off) >= size) {
+    return segments;
+  }
+  len = std::min<uint64_t>(len, size - off);
+  const BlockMap &map = GetBlockMap(file);
+  size_t done = 0;
+  while (done < len) {
+    size_t position = off + done;
+    size_t file_block = position / block_size_;
+    size_t block_offset = position % block_size_;
+    BlockMap::const_iterator run = FindRun(map, file_block);
+    if (run == map.end()) {
+      throw std::system_error(EIO, std::generic_category());
+    }
+    size_t image_block = run->image_block + (file_block - run->file_block);
+    size_t run_bytes =
+        (run->file_block + run->length - file_block) * block_size_ - block_offset;
+    size_t chunk = std::min(run_bytes, len - done);
+    if (run->image_block == kHole) {
+      segments.push_back({chunk, 0, BlockRef()});
+    } else if (block_offset != 0 || chunk < static_cast<size_t>(block_size_)) {
+      chunk = std::min(chunk, block_size_ - block_offset);
+      BlockRef block = ReadBlock(image_block);
+      segments.push_back({chunk, 0, BlockRef(block, block.get() + block_offset)});
+    } else {
+      chunk -= chunk % block_size_;
+      segments.push_back({chunk, GetBlockOffset(image_block), BlockRef()});
+    }
+    done += chunk;
+  }
+  return segments;
+}
+
+void Ext2Driver::UpdateReadahead(FileHandle &handle, size_t off, size_t len) {
+  const OpenFile &file = handle.file;
+  if (!readahead_pool_ || len == 0 || file.contents) {
+    return;
+  }
+  size_t end = off + len;
+  size_t start, stop;
+  {
+    std::lock_guard<std::mutex> lock(handle.mutex);
+    if (off != handle.last_read_end) {
+      handle.last_read_end = end;
+      handle.readahead_window = 0;
+      handle.readahead_end = 0;
+      return;
+    }
+    handle.last_read_end = end;
+    // Start the next window once the reader is within half a window of the
+    // end of the prefetched data, so it arrives before it is needed.
+    if (handle.readahead_window != 0 &&
+        end + handle.readahead_window / 2 < handle.readahead_end) {
+      return;
+    }
+    handle.readahead_window =
+        handle.readahead_window == 0
+            ? options_.readahead_min_bytes
+            : std::min(handle.readahead_window * 2, options_.readahead_max_bytes);
+    start = std::max(end, handle.readahead_end);
+    stop = std::min<uint64_t>(start + handle.readahead_window,
+                              InodeSize(*file.inode));
+    if (start >= stop || readahead_in_flight_ >= kMaxReadaheadInFlight) {
+      return;
+    }
+    handle.readahead_end = stop;
+  }
+  readahead_in_flight_++;
+  readahead_windows_++;
+  std::shared_ptr<const BlockMap> map = file.block_map;
+  size_t first = start / block_size_;
+  size_t last = (stop + block_size_ - 1) / block_size_;
+  readahead_pool_->Submit([this, map, first, last] {
+    try {
+      Prefetch(*map, first, last);
+    } catch (const std::exception &) {
+      // Readahead is best effort, the reader will retry and report errors.
+    }
+    readahead_in_flight_--;
+  });
+}
+
+void Ext2Driver::Prefetch(const BlockMap &map, size_t first, size_t end) {
+  // One vectored read per run of missing blocks, each block into its own
+  // buffer so that the cache can evict them independently. All runs of the
+  // window are submitted together.
+  std::vector<BlockRef> blocks;
+  std::vector<size_t> block_idxs;
+  std::vector<iovec> iovecs;
+  blocks.reserve(end - first);
+  block_idxs.reserve(end - first);
+  iovecs.reserve(end - first);
+  std::vector<std::pair<size_t, size_t>> runs;  // first iovec, iovec count
+  size_t file_block = first;
+  while (file_block < end) {
+    BlockMap::const_iterator run = FindRun(map, file_block);
+    if (run == map.end()) {
+      break;
+    }
+    if (run->image_block == kHole) {
+      file_block = run->file_block + run->length;
+      continue;
+    }
+    size_t image_block = run->image_block + (file_block - run->file_block);
+    if (block_cache_.Contains(image_block)) {
+      file_block++;
+      continue;
+    }
+    size_t count = std::min({run->file_block + run->length, end,
+                             file_block + kMaxIovecs}) -
+                   file_block;
+    runs.emplace_back(iovecs.size(), count);
+    for (size_t i = 0; i < count; ++i) {
+      std::shared_ptr<char> buf = buffers_->Acquire();
+      iovecs.push_back({buf.get(), static_cast<size_t>(block_size_)});
+      blocks.push_back(std::move(buf));
+      block_idxs.push_back(image_block + i);
+    }
+    file_block += count;
+  }
+  std::vector<IoRequest> requests;
+  for (const auto &run : runs) {
+    requests.emplace_back(&iovecs[run.first], run.second,
+                          GetBlockOffset(block_idxs[run.first]));
+  }
+  Submit(requests);
+  for (size_t r = 0; r < requests.size(); ++r) {
+    if (requests[r].result != static_cast<ssize_t>(requests[r].length())) {
+      continue;
+    }
+    for (size_t i = runs[r].first; i < runs[r].first + runs[r].second; ++i) {
+      block_cache_.Put(block_idxs[i], blocks[i]);
+    }
+    readahead_blocks_ += runs[r].second;
+  }
+}
+
+off_t Ext2Driver::Lseek(uint64_t fd, off_t off, int whence) {
+  std::shared_ptr<FileHandle> handle = open_files_.Find(fd);
+  if (!handle) {
+    throw std::system_error(EBADF, std::generic_category());
+  }
+  if (whence != SEEK_DATA && whence != SEEK_HOLE) {
+    throw std::system_error(EINVAL, std::generic_category());
+  }
+  OpenFile &file = HandleFile(*handle);
+  uint64_t size = InodeSize(*file.inode);
+  if (off < 0 || static_cast<size_t>(off) >= size) {
+    throw std::system_error(ENXIO, std::generic_category());
+  }
+  if (file.contents) {
+    return whence == SEEK_DATA ? off : size;
+  }
+  const BlockMap &map = GetBlockMap(file);
+  size_t position = off;
+  while (position < size) {
+    BlockMap::const_iterator run = FindRun(map, position / block_size_);
+    if (run == map.end()) {
+      throw std::system_error(EIO, std::generic_category());
+    }
+    if ((run->image_block == kHole) == (whence == SEEK_HOLE)) {
+      return position;
+    }
+    position = (run->file_block + run->length) * block_size_;
+  }
+  if (whence == SEEK_HOLE) {
+    return size;
+  }
+  throw std::system_error(ENXIO, std::generic_category());
+}
+
+std::shared_ptr<const BlockMap> Ext2Driver::FileBlockMap(uint64_t fd) {
+  std::shared_ptr<FileHandle> handle = open_files_.Find(fd);
+  if (!handle) {
+    throw std::system_error(EBADF, std::generic_category());
+  }
+  const OpenFile &file = HandleFile(*handle);
+  if (!file.block_map) {
+    return std::make_shared<const BlockMap>();
+  }
+  return file.block_map;
+}
+
+size_t Ext2Driver::BlockSize() const {
+  return block_size_;
+}
+
+void Ext2Driver::ScanInodes(const InodeVisitor &visitor, size_t threads,
+                            std::unordered_map<size_t, size_t> *parents) {
+  std::mutex mutex;
+  std::exception_ptr error;
+  auto scan = [&](size_t group_number) {
+    std::vector<std::pair<size_t, size_t>> links;
+    try {
+      ScanGroup(group_number, visitor, parents ? &links : nullptr);
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (!error) {
+        error = std::current_exception();
+      }
+      return;
+    }
+    if (parents == nullptr) {
+      return;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    for (const auto &link : links) {
+      auto inserted = parents->emplace(link.first, link.second);
+      if (!inserted.second) {
+        inserted.first->second = std::min(inserted.first->second, link.second);
+      }
+    }
+  };
+  if (threads <= 1) {
+    for (size_t group_number = 0; group_number < groups_.size() && !error;
+         ++group_number) {
+      scan(group_number);
+    }
+  } else {
+    ThreadPool pool(threads);
+    for (size_t group_number = 0; group_number < groups_.size();
+         ++group_number) {
+      pool.Submit([&scan, group_number] { scan(group_number); });
+    }
+    pool.Wait();
   }
-  size_t copy_length = block_size_ - block_start_offset;
-  memcpy(buf, file.FileData.data() + block_start_offset, copy_length);
-  buf += copy_length;
-  len -= copy_length;
-  for (size_t block = block_start + 1; block < block_end; ++block) {
-    copy_length = block_size_;
-    ReadFileBlock(file, block);
-    memcpy(buf, file.FileData.data(), copy_length);
-    buf += copy_length;
-    len -= copy_length;
+  if (error) {
+    std::rethrow_exception(error);
   }
-  ReadFileBlock(file, block_end);
-  memcpy(buf, file.FileData.data(), len);
-  buf += len;
-  len -= len;
-  return buf - src_buf;
+}
+
+void Ext2Driver::WriteSnapshot(const std::string &path) {
+  MetadataSnapshot::Contents contents;
+  // A single thread visits groups in order, so inodes come sorted.
+  ScanInodes([&contents](size_t inode_idx, const ext2_inode &inode) {
+    SnapshotInode record = {};
+    record.inode_idx = inode_idx;
+    record.inode = inode;
+    contents.inodes.push_back(record);
+  });
+  std::vector<std::pair<std::string, size_t>> entries;
+  for (SnapshotInode &record : contents.inodes) {
+    mode_t mode = record.inode.i_mode;
+    if (!S_ISREG(mode) && !S_ISDIR(mode) &&
+        !(S_ISLNK(mode) && !IsFastSymlink(record.inode))) {
+      continue;
+    }
+    OpenFile file;
+    file.inode_idx = record.inode_idx;
+    file.inode = Unowned(&record.inode);
+    const BlockMap &map = GetBlockMap(file);
+    record.has_runs = 1;
+    record.first_run = contents.runs.size();
+    record.run_count = map.size();
+    for (const BlockRun &run : map) {
+      contents.runs.push_back({run.file_block, run.image_block, run.length});
+    }
+    if (!S_ISDIR(mode)) {
+      continue;
+    }
+    entries.clear();
+    ListDirectory(file, 0, [&entries](const DirEntry &entry) {
+      entries.emplace_back(std::string(entry.name), entry.inode_idx);
+      return true;
+    }, false);
+    // Lookups binary search by name; the first of duplicate names wins, as
+    // it does in a linear scan of the directory.
+    std::stable_sort(entries.begin(), entries.end(),
+                     [](const auto &a, const auto &b) {
+                       return a.first < b.first;
+                     });
+    record.first_entry = contents.entries.size();
+    record.entry_count = entries.size();
+    for (const auto &entry : entries) {
+      SnapshotEntry record_entry = {};
+      record_entry.name_offset = contents.names.size();
+      record_entry.inode_idx = entry.second;
+      record_entry.name_len = entry.first.size();
+      contents.entries.push_back(record_entry);
+      contents.names += entry.first;
+    }
+  }
+  MetadataSnapshot::Write(path, sb_, contents);
 }
 
 void Ext2Driver::Close(uint64_t fd) {
-  auto it = open_files_.find(fd);
-  if (it == open_files_.end()) {
+  if (!open_files_.Erase(fd)) {
     throw std::system_error(EBADF, std::generic_category());
   }
-  open_files_.erase(it);
 }
 
 uint64_t Ext2Driver::Opendir(const char *path) {
-  int fd = Open(path);
-  if (!IsDirectory(open_files_[fd])) {
+  OpTimer timer(metrics_, Op::kOpendir);
+  return OpenDirectory(GetInodeIdxByPath(path));
+}
+
+uint64_t Ext2Driver::OpendirInode(size_t inode_idx) {
+  OpTimer timer(metrics_, Op::kOpendir);
+  return OpenDirectory(inode_idx);
+}
+
+uint64_t Ext2Driver::OpenDirectory(size_t inode_idx) {
+  OpenFile dir = OpenFileByInodeNumber(inode_idx);
+  if (!IsDirectory(dir)) {
     throw std::system_error(ENOTDIR, std::generic_category());
   }
-  return fd;
+  return open_files_.Insert(dir);
 }
 
-std::optional<std::string> Ext2Driver::Readdir(uint64_t fd) {
-  auto it = open_files_.find(fd);
-  if (it == open_files_.end()) {
+std::optional<std::string> Ext2Driver::Readdir(uint64_t fd, size_t *inode_idx) {
+  OpTimer timer(metrics_, Op::kReaddir);
+  std::shared_ptr<FileHandle> handle = open_files_.Find(fd);
+  if (!handle) {
     throw std::system_error(EINVAL, std::generic_category());
   }
-  return ReaddirFile(it->second);
+  std::lock_guard<std::mutex> lock(handle->mutex);
+  std::optional<std::string> name;
+  OpenFile &dir = handle->file;
+  dir.offset = ListDirectory(dir, dir.offset, [&](const DirEntry &entry) {
+    if (name.has_value()) {
+      return false;
+    }
+    name = std::string(entry.name);
+    if (inode_idx != nullptr) {
+      *inode_idx = entry.inode_idx;
+    }
+    return true;
+  }, false);
+  return name;
 }
 
-std::optional<std::string> Ext2Driver::ReaddirFile(OpenFile &file) {
-  if (file.file_block_idx * block_size_ >= file.inode.i_size) {
-    return {};
+void Ext2Driver::Readdir(uint64_t fd, uint64_t cookie, const DirFiller &filler,
+                         bool plus) {
+  OpTimer timer(metrics_, Op::kReaddir);
+  std::shared_ptr<FileHandle> handle = open_files_.Find(fd);
+  if (!handle) {
+    throw std::system_error(EINVAL, std::generic_category());
   }
-  ReadFileBlock(file, file.file_block_idx);
-  ext2_dir_entry_2 *direntry =
-      reinterpret_cast<ext2_dir_entry_2 *>(file.FileData.data() + file.offset);
-  file.offset += direntry->rec_len;
-  if (file.offset > block_size_) {
-    throw std::system_error(EIO, std::generic_category());
-  } else if (file.offset == block_size_) {
-    file.file_block_idx += 1;
+  ListDirectory(HandleFile(*handle), cookie, filler, plus);
+}
+
+uint64_t Ext2Driver::ListDirectory(OpenFile &dir, uint64_t cookie,
+                                   const DirFiller &filler, bool plus) {
+  bool has_types = sb_.s_feature_incompat & EXT2_FEATURE_INCOMPAT_FILETYPE;
+  while (cookie < dir.inode->i_size) {
+    size_t file_block = cookie / block_size_;
+    size_t offset = cookie % block_size_;
+    BlockRef block = ReadFileBlock(dir, file_block);
+    const size_t block_size = block_size_;
+    while (offset < block_size) {
+      const ext2_dir_entry_2 *dirent =
+          reinterpret_cast<const ext2_dir_entry_2 *>(block.get() + offset);
+      if (block_size - offset < kDirEntryHeader ||
+          dirent->rec_len < kDirEntryHeader + dirent->name_len ||
+          dirent->rec_len > block_size - offset) {
+        char error_msg[1024];
+        snprintf(error_msg, sizeof(error_msg),
+                 "Bad directory entry at %lu in inode %lu", cookie,
+                 dir.inode_idx);
+        throw std::system_error(EIO, std::generic_category(), error_msg);
+      }
+      // Unused entries (inode 0) fill deleted slots and htree index blocks.
+      if (dirent->inode != 0) {
+        DirEntry entry;
+        entry.name = std::string_view(dirent->name, dirent->name_len);
+        entry.inode_idx = dirent->inode;
+        entry.type = has_types && dirent->file_type < EXT2_FT_MAX
+                         ? kFileTypeModes[dirent->file_type]
+                         : 0;
+        entry.next = cookie + dirent->rec_len;
+        entry.attr = nullptr;
+        struct stat attr;
+        if (plus) {
+          FillStat(dirent->inode, &attr);
+          entry.type = attr.st_mode & S_IFMT;
+          entry.attr = &attr;
+          dentry_cache_.Put({dir.inode_idx, std::string(entry.name)},
+                            dirent->inode);
+        }
+        if (!filler(entry)) {
+          return cookie;
+        }
+      }
+      offset += dirent->rec_len;
+      cookie += dirent->rec_len;
+    }
   }
-  char entry_filename[EXT2_NAME_LEN + 1];
-  entry_filename[EXT2_NAME_LEN] = '\0';
-  memcpy(entry_filename, direntry->name, direntry->name_len);
-  entry_filename[direntry->name_len] = '\0';
-  return {entry_filename};
+  return cookie;
 }
 
 void Ext2Driver::Releasedir(uint64_t fd) {
   Close(fd);
 }
 
-void Ext2Driver::GetInodeByNumber(size_t inode_idx, ext2_inode *buf) {
+std::shared_ptr<const ext2_inode>
+Ext2Driver::GetInodeByNumber(size_t inode_idx) {
+  if (inode_idx == 0) {
+    throw std::system_error(ENOENT, std::generic_category(),
+                            "Inode 0 is out of range");
+  }
+  if (snapshot_) {
+    const ext2_inode *inode = snapshot_->Inode(inode_idx);
+    if (inode != nullptr) {
+      metrics_.Add(Counter::kSnapshotHits);
+      return Unowned(inode);
+    }
+  }
+  std::optional<std::shared_ptr<const ext2_inode>> cached =
+      inode_cache_.Get(inode_idx);
+  if (cached.has_value()) {
+    return std::move(cached.value());
+  }
   inode_idx--;
   size_t group_number = inode_idx / sb_.s_inodes_per_group;
   size_t inode_idx_in_block = inode_idx % sb_.s_inodes_per_group;
-  size_t group_offset = GetGroupOffset(group_number);
-  size_t group_desc_offset = group_offset + block_size_;
-
-  if (lseek(fd_, group_desc_offset, SEEK_SET) < 0) {
-    char error_msg[1024];
-    snprintf(error_msg, sizeof(error_msg), "Error seeking block group %lu",
-             group_number);
-    throw std::system_error(errno, std::generic_category(), error_msg);
-  }
-
-  struct ext2_group_desc gd {};
-  if (read(fd_, &gd, sizeof(gd)) != sizeof(gd)) {
+  if (group_number >= groups_.size()) {
     char error_msg[1024];
-    snprintf(error_msg, sizeof(error_msg),
-             "Error reading group description of %lu", group_number);
-    throw std::system_error(errno, std::generic_category(), error_msg);
+    snprintf(error_msg, sizeof(error_msg), "Inode %lu is out of range",
+             inode_idx + 1);
+    throw std::system_error(ENOENT, std::generic_category(), error_msg);
   }
+  const ext4_group_desc &gd = groups_[group_number];
+  metrics_.Add(Counter::kInodeFetches);
 
-  size_t inode_bitmap_offset =
-      GetBlockOffset(gd.bg_inode_bitmap) + inode_idx_in_block / 8;
-  if (lseek(fd_, inode_bitmap_offset, SEEK_SET) < 0) {
+  const std::vector<uint8_t> &bitmap = GetInodeBitmap(group_number);
+  if (((bitmap[inode_idx_in_block / 8] >> (inode_idx_in_block % 8)) & 1) == 0) {
     char error_msg[1024];
-    snprintf(error_msg, sizeof(error_msg),
-             "Error seeking inode bitmap for block %lu", group_number);
-    throw std::system_error(errno, std::generic_category(), error_msg);
+    snprintf(error_msg, sizeof(error_msg), "Inode %lu is free",
+             inode_idx + 1);
+    // Frontends get inode numbers back from the kernel, which may still
+    // hold ones the image no longer uses.
+    throw std::system_error(ESTALE, std::generic_category(), error_msg);
   }
 
-  char bm;
-  if (read(fd_, &bm, 1) != 1) {
-    char error_msg[1024];
-    snprintf(error_msg, sizeof(error_msg),
-             "Error reading inode bitmap for inode %lu", inode_idx);
-    throw std::system_error(errno, std::generic_category(), error_msg);
-  }
-  if (((bm >> (inode_idx_in_block % 8)) & 1) == 0) {
-    char error_msg[1024];
-    snprintf(error_msg, sizeof(error_msg), "Inode %lu is free", inode_idx);
-    throw std::runtime_error(error_msg);
+  auto buf = std::make_shared<ext2_inode>();
+  if (inode_cache_.capacity() != 0) {
+    size_t inodes_per_block = block_size_ / inode_size_;
+    size_t first_in_block =
+        inode_idx_in_block - inode_idx_in_block % inodes_per_block;
+    BlockRef block =
+        ReadBlock(InodeTableBlock(gd) + first_in_block / inodes_per_block);
+    for (size_t i = 0; i < inodes_per_block; ++i) {
+      size_t neighbour = first_in_block + i;
+      if (neighbour >= sb_.s_inodes_per_group) {
+        break;
+      }
+      if (((bitmap[neighbour / 8] >> (neighbour % 8)) & 1) == 0) {
+        continue;
+      }
+      std::shared_ptr<ext2_inode> record =
+          neighbour == inode_idx_in_block ? buf
+                                          : std::make_shared<ext2_inode>();
+      memcpy(record.get(), block.get() + i * inode_size_, sizeof(*record));
+      inode_cache_.Put(group_number * sb_.s_inodes_per_group + neighbour + 1,
+                       std::move(record));
+    }
+    return buf;
   }
 
-  size_t inode_table_offset = gd.bg_inode_table * block_size_;
+  uint64_t inode_table_offset = GetBlockOffset(InodeTableBlock(gd));
 
-  size_t inode_offset =
-      inode_table_offset + inode_idx_in_block * sizeof(ext2_inode);
-  if (lseek(fd_, inode_offset, SEEK_SET) < 0) {
-    char error_msg[1024];
-    snprintf(error_msg, sizeof(error_msg), "Error seeking inode record for %lu",
-             inode_idx);
-    throw std::system_error(errno, std::generic_category(), error_msg);
-  }
-
-  if (read(fd_, buf, sizeof(*buf)) != sizeof(*buf)) {
+  uint64_t inode_offset = inode_table_offset + inode_idx_in_block * inode_size_;
+  const void *inode = ReadImage(inode_offset, sizeof(*buf), buf.get());
+  if (inode == nullptr) {
     char error_msg[1024];
     snprintf(error_msg, sizeof(error_msg), "Failure reading inode %lu",
-             inode_idx);
+             inode_idx + 1);
     throw std::system_error(errno, std::generic_category(), error_msg);
   }
-}
-
-void Ext2Driver::ReadFileBlock(OpenFile &file, size_t file_block_idx) {
-  if (file.FileData.empty()) {
-    file.file_block_idx = -1;
+  if (inode != buf.get()) {
+    memcpy(buf.get(), inode, sizeof(*buf));
   }
+  return buf;
+}
 
-  if (file_block_idx == file.file_block_idx) {
+void Ext2Driver::ScanGroup(size_t group_number, const InodeVisitor &visitor,
+                           std::vector<std::pair<size_t, size_t>> *links) {
+  const ext4_group_desc &gd = groups_[group_number];
+  // Neither the bitmap nor the table of such a group has been written.
+  if (gd.bg_flags & EXT2_BG_INODE_UNINIT) {
     return;
   }
-
-  if (IsDirectBlock(file_block_idx)) {
-    size_t block_idx = file.inode.i_block[file_block_idx];
-    ReadBlock(block_idx, file.FileData);
-    file.IndirectBlock.clear();
-    file.DoublyIndirectBlock.clear();
-    file.TriplyIndirectBlock.clear();
-    file.file_block_idx = file_block_idx;
+  const std::vector<uint8_t> &bitmap = GetInodeBitmap(group_number);
+  auto allocated = [&bitmap](size_t i) {
+    return ((bitmap[i / 8] >> (i % 8)) & 1) != 0;
+  };
+  size_t used = sb_.s_inodes_per_group;
+  while (used > 0 && !allocated(used - 1)) {
+    used--;
   }
-
-  if (IsIndirectBlock(file_block_idx)) {
-    if (!IsIndirectBlock(file.file_block_idx)) {
-      ReadBlock(file.inode.i_block[kIndirectBlockPointer], file.IndirectBlock);
+  size_t chunk_inodes = kScanChunkBytes / inode_size_;
+  std::vector<char> scratch(std::min(used, chunk_inodes) * inode_size_);
+  uint64_t table_offset = GetBlockOffset(InodeTableBlock(gd));
+  std::vector<OpenFile> directories;
+  for (size_t first = 0; first < used; first += chunk_inodes) {
+    size_t end = std::min(used, first + chunk_inodes);
+    size_t i = first;
+    while (i < end && !allocated(i)) {
+      i++;
+    }
+    if (i == end) {
+      continue;
+    }
+    const char *table = static_cast<const char *>(
+        ReadImage(table_offset + first * inode_size_,
+                  (end - first) * inode_size_, scratch.data()));
+    if (table == nullptr) {
+      char error_msg[1024];
+      snprintf(error_msg, sizeof(error_msg),
+               "Error reading inode table of group %lu", group_number);
+      throw std::system_error(errno, std::generic_category(), error_msg);
     }
-    size_t block_addr = IndirectBlockAddress(file_block_idx);
-    size_t block_idx = reinterpret_cast<BlockIdxType *>(file.IndirectBlock.data())[block_addr];
-    ReadBlock(block_idx, file.FileData);
-    file.DoublyIndirectBlock.clear();
-    file.TriplyIndirectBlock.clear();
-    file.file_block_idx = file_block_idx;
+    for (; i < end; ++i) {
+      if (!allocated(i)) {
+        continue;
+      }
+      size_t inode_idx = group_number * sb_.s_inodes_per_group + i + 1;
+      ext2_inode inode;
+      memcpy(&inode, table + (i - first) * inode_size_, sizeof(inode));
+      visitor(inode_idx, inode);
+      if (links != nullptr && S_ISDIR(inode.i_mode)) {
+        OpenFile dir;
+        dir.inode_idx = inode_idx;
+        dir.inode = std::make_shared<const ext2_inode>(inode);
+        directories.push_back(std::move(dir));
+      }
+    }
+  }
+  if (links == nullptr) {
+    return;
   }
+  // List the directories in the order their first blocks are laid out, so
+  // their reads move forward through the image.
+  std::vector<std::pair<size_t, size_t>> order;
+  for (size_t d = 0; d < directories.size(); ++d) {
+    const BlockMap &map = GetBlockMap(directories[d]);
+    order.emplace_back(map.empty() ? 0 : map.front().image_block, d);
+  }
+  std::sort(order.begin(), order.end());
+  for (const auto &entry : order) {
+    OpenFile &dir = directories[entry.second];
+    ListDirectory(dir, 0, [&](const DirEntry &child) {
+      if (child.name != "." && child.name != "..") {
+        links->emplace_back(child.inode_idx, dir.inode_idx);
+      }
+      return true;
+    }, false);
+  }
+}
 
-  if (IsDoublyIndirectBlock(file_block_idx)) {
-    if (!IsDoublyIndirectBlock(file.file_block_idx)) {
-      ReadBlock(file.inode.i_block[kDoublyIndirectPointer],
-                file.DoublyIndirectBlock);
+const std::vector<uint8_t> &Ext2Driver::GetInodeBitmap(size_t group_number) {
+  InodeBitmap &bitmap = inode_bitmaps_[group_number];
+  std::call_once(bitmap.loaded, [this, group_number, &bitmap] {
+    std::vector<uint8_t> bits((sb_.s_inodes_per_group + 7) / 8);
+    // The bitmap of such a group was never written: all its inodes are free.
+    if (groups_[group_number].bg_flags & EXT2_BG_INODE_UNINIT) {
+      bitmap.bits = std::move(bits);
+      return;
     }
-    std::array<size_t, 2> block_addr =
-        DoublyIndirectBlockAddress(file_block_idx);
-    std::array<size_t, 2> file_block_addr =
-        DoublyIndirectBlockAddress(file.file_block_idx);
-
-    bool equal = true;
-
-    if (block_addr[0] != file_block_addr[0]) {
-      size_t indirect_block_idx = reinterpret_cast<BlockIdxType *>(
-          file.DoublyIndirectBlock.data())[block_addr[0]];
-      ReadBlock(indirect_block_idx, file.IndirectBlock);
-      equal = false;
+    const void *data =
+        ReadImage(GetBlockOffset(InodeBitmapBlock(groups_[group_number])),
+                  bits.size(), bits.data());
+    if (data == nullptr) {
+      char error_msg[1024];
+      snprintf(error_msg, sizeof(error_msg),
+               "Error reading inode bitmap of group %lu", group_number);
+      throw std::system_error(errno, std::generic_category(), error_msg);
+    }
+    if (data != bits.data()) {
+      memcpy(bits.data(), data, bits.size());
     }
+    bitmap.bits = std::move(bits);
+  });
+  return bitmap.bits;
+}
 
-    size_t block_idx = reinterpret_cast<BlockIdxType *>(
-        file.IndirectBlock.data())[block_addr[1]];
-    ReadBlock(block_idx, file.FileData);
+BlockRef Ext2Driver::ReadFileBlock(OpenFile &file, size_t file_block_idx) {
+  const BlockMap &map = GetBlockMap(file);
+  BlockMap::const_iterator run = FindRun(map, file_block_idx);
+  // Directories have no holes.
+  if (run == map.end() || run->image_block == kHole) {
+    throw std::system_error(EIO, std::generic_category());
   }
+  return ReadBlock(run->image_block + (file_block_idx - run->file_block));
+}
 
-  if (IsTriplyIndirectBlock(file_block_idx)) {
-    if (!IsTriplyIndirectBlock(file.file_block_idx)) {
-      ReadBlock(file.inode.i_block[kTriplyIndirectPointer],
-                file.TriplyIndirectBlock);
+const BlockMap &Ext2Driver::GetBlockMap(OpenFile &file) {
+  if (file.block_map) {
+    return *file.block_map;
+  }
+  std::optional<std::shared_ptr<const BlockMap>> cached =
+      block_map_cache_.Get(file.inode_idx);
+  if (cached.has_value()) {
+    file.block_map = std::move(cached.value());
+    return *file.block_map;
+  }
+  if (snapshot_) {
+    file.block_map = snapshot_->Map(file.inode_idx);
+    if (file.block_map) {
+      metrics_.Add(Counter::kSnapshotHits);
     }
-    std::array<size_t, 3> block_addr =
-        TriplyIndirectBlockAddress(file_block_idx);
-    std::array<size_t, 3> file_block_addr =
-        TriplyIndirectBlockAddress(file.file_block_idx);
+  }
+  if (!file.block_map) {
+    file.block_map = BuildBlockMap(*file.inode);
+  }
+  block_map_cache_.Put(file.inode_idx, file.block_map);
+  return *file.block_map;
+}
 
-    bool equal = true;
+OpenFile &Ext2Driver::HandleFile(FileHandle &handle) {
+  std::lock_guard<std::mutex> lock(handle.mutex);
+  OpenFile &file = handle.file;
+  if (!file.block_map && !file.contents) {
+    GetBlockMap(file);
+  }
+  return file;
+}
 
-    if (block_addr[0] != file_block_addr[0]) {
-      size_t doubly_indirect_block_idx = reinterpret_cast<BlockIdxType *>(
-          file.TriplyIndirectBlock.data())[block_addr[0]];
-      ReadBlock(doubly_indirect_block_idx, file.DoublyIndirectBlock);
-      equal = false;
-    }
+std::shared_ptr<const BlockMap> Ext2Driver::BuildBlockMap(const ext2_inode &inode) {
+  auto map = std::make_shared<BlockMap>();
+  uint64_t size = InodeSize(inode);
+  size_t blocks = size / block_size_ + (size % block_size_ != 0);
+  if (inode.i_flags & EXT4_EXTENTS_FL) {
+    MapExtentTree(*map, inode, blocks);
+    return map;
+  }
+  size_t file_block = 0;
+  for (size_t i = 0; i < DirectBlockPointers() && file_block < blocks; ++i) {
+    AppendToBlockMap(*map, file_block++, inode.i_block[i]);
+  }
+  const size_t indirect_pointers[] = {kIndirectBlockPointer,
+                                      kDoublyIndirectPointer,
+                                      kTriplyIndirectPointer};
+  for (size_t depth = 1; depth <= 3 && file_block < blocks; ++depth) {
+    MapIndirectTree(*map, inode.i_block[indirect_pointers[depth - 1]], depth,
+                    &file_block, blocks);
+  }
+  if (file_block < blocks) {
+    throw std::system_error(EFBIG, std::generic_category());
+  }
+  return map;
+}
 
-    if (!equal || block_addr[1] != file_block_addr[1]) {
-      size_t indirect_block_idx = reinterpret_cast<BlockIdxType *>(
-          file.DoublyIndirectBlock.data())[block_addr[1]];
-      ReadBlock(indirect_block_idx, file.IndirectBlock);
-      equal = false;
+void Ext2Driver::MapIndirectTree(BlockMap &map, size_t block_idx, size_t depth,
+                                 size_t *file_block, size_t end) {
+  // Number of file blocks behind every pointer of the current level.
+  size_t span = 1;
+  for (size_t i = 1; i < depth; ++i) {
+    span *= IndirectBlockPointers();
+  }
+  size_t tree_end = std::min(end, *file_block + span * IndirectBlockPointers());
+  // Blocks of the current level with the first file block behind each. Zero
+  // pointers are holes: they are left out and their range is filled in as a
+  // hole when the next data block (or the end of the tree) is appended.
+  std::vector<std::pair<size_t, size_t>> level;
+  if (block_idx != kHole) {
+    level.emplace_back(block_idx, *file_block);
+  }
+  for (; depth > 0 && !level.empty(); --depth, span /= IndirectBlockPointers()) {
+    std::vector<size_t> block_idxs;
+    for (const auto &entry : level) {
+      block_idxs.push_back(entry.first);
     }
-
-    size_t block_idx = reinterpret_cast<BlockIdxType *>(
-        file.DoublyIndirectBlock.data())[block_addr[2]];
-    ReadBlock(block_idx, file.FileData);
+    std::vector<BlockRef> blocks = ReadBlocks(block_idxs);
+    std::vector<std::pair<size_t, size_t>> next;
+    for (size_t b = 0; b < blocks.size(); ++b) {
+      const BlockIdxType *pointers =
+          reinterpret_cast<const BlockIdxType *>(blocks[b].get());
+      size_t covered = level[b].second;
+      for (size_t i = 0; i < IndirectBlockPointers() && covered < tree_end; ++i) {
+        if (depth == 1) {
+          AppendToBlockMap(map, covered, pointers[i]);
+        } else if (pointers[i] != kHole) {
+          next.emplace_back(pointers[i], covered);
+        }
+        covered += span;
+      }
+    }
+    level = std::move(next);
   }
+  AppendToBlockMap(map, tree_end, kHole, 0);
+  *file_block = tree_end;
+}
 
-  file.file_block_idx = file_block_idx;
+void Ext2Driver::MapExtentTree(BlockMap &map, const ext2_inode &inode,
+                               size_t end) {
+  auto bad_tree = []() {
+    return std::system_error(EIO, std::generic_category(), "Bad extent tree");
+  };
+  // Nodes of the current level, in file order. `blocks` keeps those read
+  // from the image alive.
+  std::vector<const char *> nodes{reinterpret_cast<const char *>(inode.i_block)};
+  std::vector<size_t> node_sizes{sizeof(inode.i_block)};
+  std::vector<BlockRef> blocks;
+  size_t depth = reinterpret_cast<const ExtentHeader *>(nodes[0])->depth;
+  if (depth > kMaxExtentDepth) {
+    throw bad_tree();
+  }
+  while (true) {
+    std::vector<size_t> children;
+    for (size_t n = 0; n < nodes.size(); ++n) {
+      const ExtentHeader *header =
+          reinterpret_cast<const ExtentHeader *>(nodes[n]);
+      if (header->magic != kExtentMagic || header->depth != depth ||
+          header->entries > header->max ||
+          sizeof(ExtentHeader) + header->max * sizeof(Extent) > node_sizes[n]) {
+        throw bad_tree();
+      }
+      if (depth == 0) {
+        const Extent *extents = reinterpret_cast<const Extent *>(header + 1);
+        for (size_t i = 0; i < header->entries; ++i) {
+          const Extent &extent = extents[i];
+          size_t map_end =
+              map.empty() ? 0 : map.back().file_block + map.back().length;
+          if (extent.file_block < map_end) {
+            throw bad_tree();
+          }
+          if (extent.file_block >= end) {
+            break;
+          }
+          bool initialized = extent.length <= kMaxInitializedExtent;
+          size_t length = initialized ? extent.length
+                                      : extent.length - kMaxInitializedExtent;
+          size_t start =
+              (static_cast<size_t>(extent.start_hi) << 32) | extent.start_lo;
+          AppendToBlockMap(map, extent.file_block, initialized ? start : kHole,
+                           std::min(length, end - extent.file_block));
+        }
+        continue;
+      }
+      // All children of the level are read in one batch.
+      const ExtentIndex *indexes =
+          reinterpret_cast<const ExtentIndex *>(header + 1);
+      for (size_t i = 0; i < header->entries; ++i) {
+        if (indexes[i].file_block >= end) {
+          break;
+        }
+        children.push_back((static_cast<size_t>(indexes[i].leaf_hi) << 32) |
+                           indexes[i].leaf_lo);
+      }
+    }
+    if (depth == 0) {
+      break;
+    }
+    blocks = ReadBlocks(children);
+    nodes.clear();
+    for (const BlockRef &block : blocks) {
+      nodes.push_back(block.get());
+    }
+    node_sizes.assign(nodes.size(), block_size_);
+    depth--;
+  }
+  // Blocks past the last extent are a hole.
+  AppendToBlockMap(map, end, kHole, 0);
 }
 
-void Ext2Driver::ReadBlock(size_t block_idx, std::vector<char> &buf) {
-  if (buf.size() != block_size_) {
-    buf.resize(block_size_);
+BlockRef Ext2Driver::ReadBlock(size_t block_idx) {
+  metrics_.Add(Counter::kReadBlockCalls);
+  if (mapping_ != nullptr) {
+    // Blocks of a mapped image are used in place, they need no owner.
+    const void *block = ReadImage(GetBlockOffset(block_idx), block_size_, nullptr);
+    if (block == nullptr) {
+      char error_msg[1024];
+      snprintf(error_msg, sizeof(error_msg), "Couldn't read block %lu",
+               block_idx);
+      throw std::system_error(errno, std::generic_category(), error_msg);
+    }
+    return BlockRef(BlockRef(), static_cast<const char *>(block));
   }
-  size_t offset = GetBlockOffset(block_idx);
-  if (lseek(fd_, offset, SEEK_SET) < 0) {
-    char error_msg[1024];
-    snprintf(error_msg, sizeof(error_msg), "Couldn't seek block %lu",
-             block_idx);
-    throw std::system_error(errno, std::generic_category(), error_msg);
+  std::optional<BlockRef> cached = block_cache_.Get(block_idx);
+  if (cached.has_value()) {
+    return cached.value();
   }
-  if (read(fd_, buf.data(), block_size_) != block_size_) {
+  std::shared_ptr<char> buf = buffers_->Acquire();
+  size_t offset = GetBlockOffset(block_idx);
+  if (ReadImage(offset, block_size_, buf.get()) == nullptr) {
     char error_msg[1024];
     snprintf(error_msg, sizeof(error_msg), "Couldn't read block %lu",
              block_idx);
     throw std::system_error(errno, std::generic_category(), error_msg);
   }
+  block_cache_.Put(block_idx, buf);
+  return buf;
+}
+
+std::vector<BlockRef> Ext2Driver::ReadBlocks(const std::vector<size_t> &block_idxs) {
+  std::vector<BlockRef> blocks(block_idxs.size());
+  if (mapping_ != nullptr) {
+    for (size_t i = 0; i < block_idxs.size(); ++i) {
+      blocks[i] = ReadBlock(block_idxs[i]);
+    }
+    return blocks;
+  }
+  std::vector<IoRequest> requests;
+  std::vector<size_t> missing;
+  for (size_t i = 0; i < block_idxs.size(); ++i) {
+    std::optional<BlockRef> cached = block_cache_.Get(block_idxs[i]);
+    if (cached.has_value()) {
+      blocks[i] = cached.value();
+      continue;
+    }
+    std::shared_ptr<char> buf = buffers_->Acquire();
+    requests.emplace_back(buf.get(), block_size_, GetBlockOffset(block_idxs[i]));
+    blocks[i] = std::move(buf);
+    missing.push_back(i);
+  }
+  Submit(requests);
+  for (size_t r = 0; r < requests.size(); ++r) {
+    size_t block_idx = block_idxs[missing[r]];
+    if (requests[r].result != block_size_) {
+      char error_msg[1024];
+      snprintf(error_msg, sizeof(error_msg), "Couldn't read block %lu",
+               block_idx);
+      throw std::system_error(requests[r].result < 0 ? -requests[r].result : EIO,
+                              std::generic_category(), error_msg);
+    }
+    block_cache_.Put(block_idx, blocks[missing[r]]);
+  }
+  return blocks;
+}
+
+void Ext2Driver::Submit(std::vector<IoRequest> &requests) {
+  if (requests.empty()) {
+    return;
+  }
+  io_->Submit(requests.data(), requests.size());
+  uint64_t bytes = 0;
+  for (const IoRequest &request : requests) {
+    bytes += std::max<ssize_t>(request.result, 0);
+  }
+  metrics_.Add(Counter::kImageReads, requests.size());
+  metrics_.Add(Counter::kImageBytesRead, bytes);
 }
 
 size_t Ext2Driver::GetInodeIdxByPath(const char *path) {
   if (path[0] != '/') {
     throw std::system_error(ENOENT, std::generic_category());
   }
-  std::vector<std::string> tok_path = {""};
-  for (const char *str = path; *str; str++) {
-    if (*str != '/') {
-      tok_path.back() += *str;
-    } else if (*str == '/' && !tok_path.back().empty()) {
-      tok_path.emplace_back("");
+  size_t inode_idx = kRootInode;
+  std::string_view rest(path);
+  while (!rest.empty()) {
+    size_t start = rest.find_first_not_of('/');
+    if (start == std::string_view::npos) {
+      break;
     }
+    rest.remove_prefix(start);
+    std::string_view name = rest.substr(0, rest.find('/'));
+    rest.remove_prefix(name.size());
+    inode_idx = LookupInDirectory(inode_idx, name);
   }
-  if (tok_path.back().empty()) {
-    tok_path.pop_back();
-  }
-  if (tok_path.empty()) {
-    return kRootInode;
+  return inode_idx;
+}
+
+size_t Ext2Driver::LookupInDirectory(size_t dir_inode, std::string_view name) {
+  if (dir_inode == kRootInode && name == kStatsFileName) {
+    return StatsInode();
   }
-  std::string destination = tok_path.back();
-  tok_path.pop_back();
-  size_t dir_inode = kRootInode;
-  OpenFile dir = OpenFileByInodeNumber(dir_inode);
-  for (auto i : tok_path) {
-    if (!IsDirectory(dir)) {
-      throw std::system_error(ENOTDIR, std::generic_category());
-    }
-    dir_inode = FindInDirectory(i.c_str(), dir);
-    if (dir_inode == 0) {
-      throw std::system_error(ENOENT, std::generic_category());
-    }
-    dir = OpenFileByInodeNumber(dir_inode);
+  DentryKey key{dir_inode, std::string(name)};
+  std::optional<size_t> cached = dentry_cache_.Get(key);
+  size_t inode_idx = 0;
+  if (cached.has_value()) {
+    inode_idx = cached.value();
+  } else {
+    OpenFile dir = OpenFileByInodeNumber(dir_inode);
+    inode_idx = FindInDirectory(name, dir);
+    dentry_cache_.Put(key, inode_idx);
   }
-  size_t inode_idx = FindInDirectory(destination.c_str(), dir);
   if (inode_idx == 0) {
     throw std::system_error(ENOENT, std::generic_category());
   }
@@ -470,31 +1443,195 @@ size_t Ext2Driver::GetInodeIdxByPath(const char *path) {
 OpenFile Ext2Driver::OpenFileByInodeNumber(size_t inode_idx) {
   OpenFile file;
   file.inode_idx = inode_idx;
-  GetInodeByNumber(file.inode_idx, &file.inode);
+  if (inode_idx == StatsInode()) {
+    // A snapshot, so that reads at any offset agree with each other.
+    file.contents = std::make_shared<const std::string>(StatsText());
+    auto inode = std::make_shared<ext2_inode>();
+    inode->i_mode = S_IFREG | 0444;
+    inode->i_links_count = 1;
+    inode->i_size = file.contents->size();
+    file.inode = std::move(inode);
+    return file;
+  }
+  file.inode = GetInodeByNumber(file.inode_idx);
+  if (S_ISLNK(file.inode->i_mode) && IsFastSymlink(*file.inode)) {
+    // The target is stored in place of the block pointers, which must never
+    // be mapped as such.
+    size_t target_len =
+        std::min<size_t>(file.inode->i_size, sizeof(file.inode->i_block));
+    file.contents = std::make_shared<const std::string>(
+        reinterpret_cast<const char *>(file.inode->i_block), target_len);
+  }
   return file;
 }
 
-size_t Ext2Driver::FindInDirectory(const char *filename, OpenFile &directory) {
+size_t Ext2Driver::FindInDirectory(std::string_view filename,
+                                   OpenFile &directory) {
   if (!IsDirectory(directory)) {
     throw std::system_error(ENOTDIR, std::generic_category());
   }
+  if (snapshot_) {
+    std::optional<size_t> found =
+        snapshot_->Lookup(directory.inode_idx, filename);
+    if (found.has_value()) {
+      metrics_.Add(Counter::kSnapshotHits);
+      return found.value();
+    }
+  }
+  if ((sb_.s_feature_compat & EXT2_FEATURE_COMPAT_DIR_INDEX) &&
+      (directory.inode->i_flags & EXT2_INDEX_FL)) {
+    std::optional<size_t> found = FindInIndexedDirectory(filename, directory);
+    if (found.has_value()) {
+      return found.value();
+    }
+  }
   size_t block = 0;
   size_t bytes_read = 0;
-  char entry_filename[EXT2_NAME_LEN + 1];
-  while (bytes_read < directory.inode.i_size) {
-    ReadFileBlock(directory, block);
-    char *data = reinterpret_cast<char*>(directory.FileData.data());
-    for (size_t index = 0; index < block_size_;) {
-      ext2_dir_entry_2 *dirent = reinterpret_cast<ext2_dir_entry_2*>(data + index);
-      index += dirent->rec_len;
-      std::memcpy(entry_filename, dirent->name, dirent->name_len);      
-      entry_filename[dirent->name_len] = '\0';
-      if (std::strcmp(filename, entry_filename) == 0) {
-        return dirent->inode;
-      }
+  while (bytes_read < directory.inode->i_size) {
+    size_t inode_idx =
+        FindInBlock(filename, ReadFileBlock(directory, block).get());
+    if (inode_idx != 0) {
+      return inode_idx;
     }
     bytes_read += block_size_;
     block++;
   }
   return 0;
 }
+
+size_t Ext2Driver::FindInBlock(std::string_view filename,
+                               const char *data) const {
+  const size_t block_size = block_size_;
+  for (size_t index = 0; index < block_size;) {
+    const ext2_dir_entry_2 *dirent = reinterpret_cast<const ext2_dir_entry_2*>(data + index);
+    // Entries must hold their name and stay within the block.
+    if (block_size - index < kDirEntryHeader ||
+        dirent->rec_len < kDirEntryHeader + dirent->name_len ||
+        dirent->rec_len > block_size - index) {
+      throw std::system_error(EIO, std::generic_category());
+    }
+    index += dirent->rec_len;
+    // Deleted entries keep their names but point at inode 0.
+    if (dirent->inode != 0 && dirent->name_len == filename.size() &&
+        std::memcmp(dirent->name, filename.data(), filename.size()) == 0) {
+      return dirent->inode;
+    }
+  }
+  return 0;
+}
+
+bool Ext2Driver::ParseIndexNode(BlockRef block, size_t offset,
+                                IndexFrame *frame) const {
+  // The offset comes from the image, so it is checked before being used.
+  const size_t block_size = block_size_;
+  if (offset > block_size ||
+      block_size - offset < sizeof(ext2_dx_countlimit)) {
+    return false;
+  }
+  const ext2_dx_countlimit *countlimit =
+      reinterpret_cast<const ext2_dx_countlimit *>(block.get() + offset);
+  if (countlimit->count == 0 || countlimit->count > countlimit->limit ||
+      countlimit->limit > (block_size - offset) / sizeof(ext2_dx_entry)) {
+    return false;
+  }
+  frame->entries = reinterpret_cast<const ext2_dx_entry *>(block.get() + offset);
+  frame->count = countlimit->count;
+  frame->at = 0;
+  frame->block = std::move(block);
+  return true;
+}
+
+std::optional<size_t> Ext2Driver::FindInIndexedDirectory(
+    std::string_view filename, OpenFile &directory) {
+  BlockRef block = ReadFileBlock(directory, 0);
+  const ext2_dx_root_info *info = reinterpret_cast<const ext2_dx_root_info *>(
+      block.get() + kDxRootInfoOffset);
+  if (info->reserved_zero != 0 || info->indirect_levels >= kMaxDxLevels) {
+    return {};
+  }
+  int hash_version = info->hash_version;
+  if (hash_version <= EXT2_HASH_TEA &&
+      (sb_.s_flags & EXT2_FLAGS_UNSIGNED_HASH)) {
+    hash_version += EXT2_HASH_LEGACY_UNSIGNED;
+  }
+  if (hash_version > EXT2_HASH_TEA_UNSIGNED) {
+    return {};
+  }
+  uint32_t hash = DirectoryHash(filename, hash_version, sb_.s_hash_seed);
+
+  // A child block past the end of the directory is damage like a bad count,
+  // and also sends the lookup back to the linear scan.
+  const uint64_t directory_blocks = InodeSize(*directory.inode) / block_size_;
+  auto child = [directory_blocks](const IndexFrame &frame) -> std::optional<size_t> {
+    size_t block = frame.entries[frame.at].block & kDxBlockMask;
+    if (block >= directory_blocks) {
+      return {};
+    }
+    return block;
+  };
+
+  // Walk down the index, picking at every level the last entry whose hash
+  // does not exceed ours. The first entry has no hash and covers everything
+  // below the second one.
+  std::vector<IndexFrame> frames(info->indirect_levels + 1);
+  size_t offset = kDxRootInfoOffset + info->info_length;
+  for (size_t level = 0; level < frames.size(); ++level) {
+    IndexFrame &frame = frames[level];
+    if (!ParseIndexNode(std::move(block), offset, &frame)) {
+      return {};
+    }
+    size_t low = 1;
+    size_t high = frame.count;
+    while (low < high) {
+      size_t middle = low + (high - low) / 2;
+      if (frame.entries[middle].hash > hash) {
+        high = middle;
+      } else {
+        low = middle + 1;
+      }
+    }
+    frame.at = low - 1;
+    if (level + 1 < frames.size()) {
+      std::optional<size_t> node = child(frame);
+      if (!node.has_value()) {
+        return {};
+      }
+      block = ReadFileBlock(directory, node.value());
+      offset = kDxNodeOffset;
+    }
+  }
+
+  while (true) {
+    std::optional<size_t> leaf = child(frames.back());
+    if (!leaf.has_value()) {
+      return {};
+    }
+    BlockRef leaf_block = ReadFileBlock(directory, leaf.value());
+    size_t inode_idx = FindInBlock(filename, leaf_block.get());
+    if (inode_idx != 0) {
+      return inode_idx;
+    }
+    // Names whose hashes collide may spill into the following leaf, which is
+    // then marked by the low bit of its index hash.
+    size_t level = frames.size() - 1;
+    while (++frames[level].at == frames[level].count) {
+      if (level == 0) {
+        return 0;
+      }
+      level--;
+    }
+    if ((frames[level].entries[frames[level].at].hash & ~1u) != hash) {
+      return 0;
+    }
+    for (++level; level < frames.size(); ++level) {
+      std::optional<size_t> node_block = child(frames[level - 1]);
+      if (!node_block.has_value()) {
+        return {};
+      }
+      BlockRef node = ReadFileBlock(directory, node_block.value());
+      if (!ParseIndexNode(std::move(node), kDxNodeOffset, &frames[level])) {
+        return {};
+      }
+    }
+  }
+}
@@ -1,5 +1,11 @@
-#include <array>
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <unordered_map>
 #include <optional>
@@ -7,39 +13,269 @@
 #include <ext2fs/ext2_fs.h>
 #include <sys/stat.h>
 
+#include "BufferPool.hpp"
+#include "HandleTable.hpp"
+#include "IoEngine.hpp"
+#include "LruCache.hpp"
+#include "Metrics.hpp"
+#include "ThreadPool.hpp"
+
+class MetadataSnapshot;
+
+/**
+ * A block of the image. Blocks are shared between the block cache and every
+ * reader, so holding a BlockRef pins the buffer even if the cache evicts it.
+ */
+typedef std::shared_ptr<const char> BlockRef;
+
+struct DriverOptions {
+  // Upper bound on the memory used by the shared block cache, 0 disables it.
+  size_t block_cache_bytes{16 << 20};
+  // Map the whole image read-only and serve blocks and metadata straight out
+  // of the mapping, leaving caching to the kernel page cache.
+  bool use_mmap{false};
+  // Number of parsed inodes kept in memory, 0 disables the inode cache.
+  size_t inode_cache_entries{1 << 16};
+  // Number of block maps kept after their files are closed, so reopening a
+  // file does not walk its block tree again. 0 disables the cache.
+  size_t block_map_cache_entries{1 << 12};
+  // Number of (directory, name) lookups remembered, including misses.
+  size_t dentry_cache_entries{1 << 16};
+  // Threads prefetching ahead of sequential readers into the block cache,
+  // 0 disables readahead. Windows start at readahead_min_bytes and double
+  // on every sequential hit up to readahead_max_bytes.
+  size_t readahead_threads{2};
+  size_t readahead_min_bytes{128 << 10};
+  size_t readahead_max_bytes{2 << 20};
+  // Batches of block reads (large file reads, indirect blocks, readahead) go
+  // through io_uring when the driver is built with EXT2_WITH_URING and the
+  // kernel allows it, and through pread otherwise.
+  bool use_io_uring{false};
+  size_t io_queue_depth{64};
+  // Metadata snapshot of the image, see MetadataSnapshot. When set, one that
+  // matches the image answers inode, name and block map lookups; a missing
+  // or stale one is ignored.
+  std::string snapshot_path;
+  // Replace a missing or stale snapshot at mount, which scans the whole
+  // image first. Failing to is reported but does not fail the mount.
+  bool write_snapshot{false};
+};
+
+struct PrefetchStats {
+  uint64_t windows{0};
+  uint64_t blocks{0};
+};
+
+/**
+ * A run of consecutive file blocks stored in consecutive image blocks. A run
+ * with image_block 0 is a hole: it reads as zeros and has no blocks behind it.
+ */
+struct BlockRun {
+  size_t file_block;
+  size_t image_block;
+  size_t length;
+};
+
+// Runs of a file sorted by file_block, covering every block of the file.
+typedef std::vector<BlockRun> BlockMap;
+
+/**
+ * A piece of a read as described by Ext2Driver::ReadSegments: `length` bytes
+ * held in memory at `data` if it is set, else found in the image at
+ * `image_offset`. A piece with neither is a hole and reads as zeros.
+ */
+struct ReadSegment {
+  size_t length;
+  size_t image_offset;
+  BlockRef data;
+};
+
 struct OpenFile {
+  // Readdir cursor: byte offset of the next directory entry.
   size_t offset{0};
-  size_t file_block_idx{0};
   size_t inode_idx{0};
-  ext2_inode inode;
-  std::vector<char> FileData{};
-  std::vector<char> IndirectBlock{};
-  std::vector<char> DoublyIndirectBlock{};
-  std::vector<char> TriplyIndirectBlock{};
+  // Shared with the inode cache (or the snapshot) rather than copied.
+  std::shared_ptr<const ext2_inode> inode{};
+  // Built on first use and shared by all copies of the handle's state.
+  std::shared_ptr<const BlockMap> block_map{};
+  // Set for virtual files and fast symlinks, which are served from memory,
+  // not the image.
+  std::shared_ptr<const std::string> contents{};
 };
 
+/**
+ * A directory entry as handed to a DirFiller. `next` is the cookie to resume
+ * the listing from after this entry. `type` holds the S_IFMT bits of the
+ * entry's mode, 0 if the directory does not record types. `attr` is only
+ * set for readdirplus listings.
+ */
+struct DirEntry {
+  std::string_view name;
+  size_t inode_idx;
+  mode_t type;
+  uint64_t next;
+  const struct stat *attr;
+};
+
+// Takes one entry of a listing; returns false if it has no room for it.
+typedef std::function<bool(const DirEntry &)> DirFiller;
+
+/**
+ * Takes one allocated inode of Ext2Driver::ScanInodes. With several scan
+ * threads it is called from all of them at once.
+ */
+typedef std::function<void(size_t inode_idx, const ext2_inode &inode)>
+    InodeVisitor;
+
+/**
+ * Name of the read-only virtual file in the root directory that holds the
+ * driver's metrics, see Ext2Driver::StatsText. It is not listed by readdir
+ * and shadows a real file of the same name. Like a /proc file it reports a
+ * size of 0 and is read until EOF.
+ */
+extern const char kStatsFileName[];
+
+/**
+ * State behind a FUSE file handle. `file` only changes under the mutex, when
+ * its block map is built or the readdir cursor moves; reads use it unlocked
+ * once the map is there, so parallel reads on one handle do not wait on each
+ * other's I/O. The readahead fields are guarded by the mutex.
+ */
+struct FileHandle {
+  explicit FileHandle(const OpenFile &file) : file(file) {}
+
+  std::mutex mutex;
+  OpenFile file;
+  // Access pattern tracking: where the last read ended, the current
+  // readahead window and how far the file has been prefetched.
+  size_t last_read_end{0};
+  size_t readahead_window{0};
+  size_t readahead_end{0};
+};
+
+/**
+ * Read-only ext2 driver. After Initialize() it is safe to use from several
+ * threads at once: the image is only accessed with positional reads and all
+ * shared state is either immutable or internally locked.
+ */
 class Ext2Driver {
 public:
   Ext2Driver(const std::string &image);
 
   ~Ext2Driver();
 
-  void Initialize();
+  void Initialize(const DriverOptions &options = DriverOptions());
 
   void Getattr(const char *path, struct stat *stat);
   uint64_t Open(const char *path);
   int Read(uint64_t fd, char *buf, size_t len, off_t off);
+  /**
+   * Like Read, but tells where the bytes are instead of copying them, so a
+   * frontend can splice them from ImageFd() straight to the kernel. Whole
+   * blocks of the file are left in the image; partial blocks at the edges of
+   * the range go through the block cache. The pieces come in file order and
+   * add up to the number of bytes read.
+   */
+  std::vector<ReadSegment> ReadSegments(uint64_t fd, size_t len, off_t off);
+  /**
+   * Whether a read is better served by ReadSegments than by Read, given
+   * that the kernel accepts spliced replies: only large reads starting on a
+   * block boundary of an image read with pread. Everything else gains more
+   * from the block cache, readahead, the mapping or io_uring batches, all
+   * of which ReadSegments bypasses.
+   */
+  bool ShouldSplice(size_t len, off_t off) const;
+  // The image, opened read-only, for image pieces of ReadSegments.
+  int ImageFd() const;
   void Close(uint64_t fd);
   uint64_t Opendir(const char *path);
-  std::optional<std::string> Readdir(uint64_t fd);
+  // Returns the next entry's name, and its inode number if asked for.
+  std::optional<std::string> Readdir(uint64_t fd, size_t *inode_idx = nullptr);
+  /**
+   * Lists the directory from `cookie` on (0 for the start, otherwise an
+   * entry's `next`), feeding entries to `filler` until it is full. Resuming
+   * costs nothing, the cookie is the entry's byte offset in the directory.
+   * With `plus` every entry comes with its attributes, and the names are
+   * remembered in the dentry cache for the lookups that usually follow.
+   */
+  void Readdir(uint64_t fd, uint64_t cookie, const DirFiller &filler,
+               bool plus = false);
+  // Like readlink(2): copies up to `len` bytes of the target, without a
+  // terminating NUL, and returns how many.
   int Readlink(const char *path, char *buf, size_t len);
   void Releasedir(uint64_t fd);
 
+  /**
+   * Same operations keyed by inode number, for frontends that get inodes
+   * from the kernel instead of paths. Lookup resolves a single component.
+   */
+  size_t RootInode() const;
+  size_t Lookup(size_t parent_inode, std::string_view name);
+  void GetattrByInode(size_t inode_idx, struct stat *stat);
+  uint64_t OpenInode(size_t inode_idx);
+  uint64_t OpendirInode(size_t inode_idx);
+  int ReadlinkInode(size_t inode_idx, char *buf, size_t len);
+
+  /**
+   * lseek(2) with SEEK_DATA or SEEK_HOLE: the first offset at or after `off`
+   * that is in data, respectively in a hole, at block granularity. The end
+   * of the file counts as a hole. Fails with ENXIO past the end of the file
+   * or when there is no more data.
+   */
+  off_t Lseek(uint64_t fd, off_t off, int whence);
+  /**
+   * The block map of an open file, for callers that schedule reads by where
+   * data lies in the image. Files without blocks of their own (the stats
+   * file, fast symlinks) get an empty map.
+   */
+  std::shared_ptr<const BlockMap> FileBlockMap(uint64_t fd);
+  // Size of the image's blocks, the unit of block maps.
+  size_t BlockSize() const;
+
+  /**
+   * Visits every allocated inode, reading each group's inode table in large
+   * sequential chunks up to its last allocated inode instead of a block per
+   * inode. Groups are shared out among `threads` threads; within a group
+   * inodes come in order. With `parents`, every directory is read as well
+   * and each inode linked from one is mapped to it (to the lowest numbered
+   * one for hard links). Only the root is left out.
+   */
+  void ScanInodes(const InodeVisitor &visitor, size_t threads = 1,
+                  std::unordered_map<size_t, size_t> *parents = nullptr);
+  /**
+   * Writes a metadata snapshot of the image to `path`: every allocated
+   * inode, the entries of every directory sorted by name and the block map
+   * of everything that has blocks. Throws std::system_error on failure.
+   */
+  void WriteSnapshot(const std::string &path);
+
+  // Inode number of the stats file, past the last inode of the image.
+  size_t StatsInode() const;
+  /**
+   * Calls, errors and latency percentiles of every operation, internal
+   * counters and cache statistics, one "name value" pair per line. This is
+   * what the stats file reads as, rendered when it is opened.
+   */
+  std::string StatsText() const;
+
+  CacheStats BlockCacheStats() const;
+  CacheStats InodeCacheStats() const;
+  CacheStats BlockMapCacheStats() const;
+  CacheStats DentryCacheStats() const;
+  PrefetchStats ReadaheadStats() const;
+
 private:
   typedef __u32 BlockIdxType;
 
-  size_t GetBlockOffset(size_t block_idx) const;
-  size_t GetGroupOffset(size_t group_idx) const;
+  /**
+   * Returns `len` bytes of the image at `offset`. With a mapped image this is
+   * a pointer into the mapping and `scratch` is left untouched; otherwise the
+   * bytes are read into `scratch`. Returns nullptr and sets errno on failure.
+   */
+  const void *ReadImage(size_t offset, size_t len, void *scratch) const;
+
+  // Byte offset of a block in the image, computed in 64 bits.
+  uint64_t GetBlockOffset(uint64_t block_idx) const;
 
   /**
    * These functions return how much pointers to the given block family is
@@ -47,37 +283,148 @@ private:
    */
   size_t DirectBlockPointers() const;
   size_t IndirectBlockPointers() const;
-  size_t DoublyIndirectBlockPointers() const;
-  size_t TriplyIndirectBlockPointers() const;
-
-  bool IsDirectBlock(size_t file_block_idx);
-  bool IsIndirectBlock(size_t file_block_idx);
-  bool IsDoublyIndirectBlock(size_t file_block_idx);
-  bool IsTriplyIndirectBlock(size_t file_block_idx);
 
+  /**
+   * Symlinks with targets shorter than 60 bytes keep them inline in i_block
+   * and own no data blocks.
+   */
+  bool IsFastSymlink(const ext2_inode &inode) const;
+  // The bodies of the public calls, which time themselves and may share
+  // these without counting twice.
+  void FillStat(size_t inode_idx, struct stat *stat);
+  int ReadSymlink(size_t inode_idx, char *buf, size_t len);
+  uint64_t OpenDirectory(size_t inode_idx);
   int ReadFile(OpenFile &file, char *buf, size_t len, off_t off);
-  std::optional<std::string> ReaddirFile(OpenFile &file);
+  std::vector<ReadSegment> MapFileRange(OpenFile &file, size_t len, off_t off);
   /**
-   * These functions generate the path to the block. If the file_block_idx
-   * is not actually of the required redirection level, an impossible value
-   * (IndirectBlockPointers()) is returned.
+   * Called after every read of a handle. Once reads are sequential, keeps a
+   * window of the following blocks being prefetched in the background, so
+   * that the next reads find them in the block cache.
    */
-  size_t IndirectBlockAddress(size_t file_block_idx);
-  std::array<size_t, 2> DoublyIndirectBlockAddress(size_t file_block_idx);
-  std::array<size_t, 3> TriplyIndirectBlockAddress(size_t file_block_idx);
-
+  void UpdateReadahead(FileHandle &handle, size_t off, size_t len);
+  // Reads file blocks [first, end) into the block cache.
+  void Prefetch(const BlockMap &map, size_t first, size_t end);
+  // Returns the cookie of the first entry `filler` did not take.
+  uint64_t ListDirectory(OpenFile &dir, uint64_t cookie, const DirFiller &filler,
+                         bool plus);
   size_t GetInodeIdxByPath(const char *path);
-  void GetInodeByNumber(size_t inode_idx, ext2_inode *buf);
+  /**
+   * Resolves a single path component through the dentry cache. Failed
+   * lookups are cached too, so repeated probes for missing names do not
+   * touch the directory again.
+   */
+  size_t LookupInDirectory(size_t dir_inode, std::string_view name);
+  /**
+   * Inodes are served from the inode cache. A miss reads the whole inode
+   * table block around the requested inode and caches all of its allocated
+   * neighbours as well.
+   */
+  std::shared_ptr<const ext2_inode> GetInodeByNumber(size_t inode_idx);
+  // ScanInodes for one group, appending (inode, directory) pairs to `links`
+  // if it is set.
+  void ScanGroup(size_t group_number, const InodeVisitor &visitor,
+                 std::vector<std::pair<size_t, size_t>> *links);
+  // Returns the inode bitmap of a group, reading it on first use.
+  const std::vector<uint8_t> &GetInodeBitmap(size_t group_number);
   OpenFile OpenFileByInodeNumber(size_t inode_idx);
-  void ReadFileBlock(OpenFile &file, size_t file_block_idx);
-  void ReadBlock(size_t file_block_idx, std::vector<char> &buf);
+  BlockRef ReadFileBlock(OpenFile &file, size_t file_block_idx);
+  const BlockMap &GetBlockMap(OpenFile &file);
+  /**
+   * The handle's file, with its block map built under the handle's mutex on
+   * first use. Reads may use the result without holding the mutex.
+   */
+  OpenFile &HandleFile(FileHandle &handle);
+  std::shared_ptr<const BlockMap> BuildBlockMap(const ext2_inode &inode);
+  /**
+   * Appends the blocks reachable through an indirect block of given depth.
+   * The tree is walked level by level so that all indirect blocks of a
+   * level are read in one batch.
+   */
+  void MapIndirectTree(BlockMap &map, size_t block_idx, size_t depth,
+                       size_t *file_block, size_t end);
+  /**
+   * Maps the blocks below `end` of an inode with EXT4_EXTENTS_FL. Like
+   * indirect trees, the extent tree is read level by level, each level in
+   * one batch; every extent becomes a single run.
+   */
+  void MapExtentTree(BlockMap &map, const ext2_inode &inode, size_t end);
+  BlockRef ReadBlock(size_t block_idx);
+  // Runs a batch of reads through io_, counting them in the metrics.
+  void Submit(std::vector<IoRequest> &requests);
+  // Like ReadBlock for many blocks, submitting all cache misses at once.
+  std::vector<BlockRef> ReadBlocks(const std::vector<size_t> &block_idxs);
 
   // Finds inode corresponding to a filename in a given directory.
-  size_t FindInDirectory(const char *filename, OpenFile &directory);
+  size_t FindInDirectory(std::string_view filename, OpenFile &directory);
+  // Same for a single block of directory entries, 0 if the name is absent.
+  size_t FindInBlock(std::string_view filename, const char *data) const;
+
+  // One level of a hashed directory index on the way down to a leaf.
+  struct IndexFrame {
+    BlockRef block;
+    const ext2_dx_entry *entries;
+    size_t count;
+    size_t at;
+  };
+  bool ParseIndexNode(BlockRef block, size_t offset, IndexFrame *frame) const;
+  /**
+   * Looks the name up through the directory's htree index, reading only the
+   * index blocks and the leaf the name hashes to. Returns nothing if the
+   * index can't be used, in which case the caller falls back to a linear
+   * scan.
+   */
+  std::optional<size_t> FindInIndexedDirectory(std::string_view filename,
+                                               OpenFile &directory);
 
   std::string image_;
   int fd_{};
+  const char *mapping_{nullptr};
+  size_t mapping_size_{0};
   ext2_super_block sb_{};
   int block_size_;
-  std::unordered_map<uint64_t, OpenFile> open_files_;
+  size_t inode_size_;
+
+  struct InodeBitmap {
+    std::once_flag loaded;
+    std::vector<uint8_t> bits;
+  };
+  // Descriptors of any size are widened to the 64-byte ext4 layout.
+  std::vector<ext4_group_desc> groups_;
+  std::unique_ptr<InodeBitmap[]> inode_bitmaps_;
+
+  HandleTable<FileHandle> open_files_;
+  // Buffers of the blocks read into the block cache.
+  std::shared_ptr<BufferPool> buffers_;
+  ShardedLruCache<size_t, BlockRef> block_cache_;
+  // Shared with the handles of the inodes, which do not copy them.
+  ShardedLruCache<size_t, std::shared_ptr<const ext2_inode>> inode_cache_;
+  // Block maps by inode number, shared with every handle of the file.
+  ShardedLruCache<size_t, std::shared_ptr<const BlockMap>> block_map_cache_;
+
+  struct DentryKey {
+    size_t parent;
+    std::string name;
+
+    bool operator==(const DentryKey &other) const {
+      return parent == other.parent && name == other.name;
+    }
+  };
+  struct DentryKeyHash {
+    size_t operator()(const DentryKey &key) const {
+      return std::hash<std::string>()(key.name) * 31 + key.parent;
+    }
+  };
+  // Maps (directory inode, name) to the child inode, 0 if there is none.
+  ShardedLruCache<DentryKey, size_t, DentryKeyHash> dentry_cache_;
+
+  DriverOptions options_;
+  // Set when options_.snapshot_path names a snapshot matching the image.
+  std::unique_ptr<MetadataSnapshot> snapshot_;
+  std::unique_ptr<IoEngine> io_;
+  mutable Metrics metrics_;
+  std::atomic<uint64_t> readahead_windows_{0};
+  std::atomic<uint64_t> readahead_blocks_{0};
+  std::atomic<size_t> readahead_in_flight_{0};
+  // Declared last so that its threads are gone before anything they use.
+  std::unique_ptr<ThreadPool> readahead_pool_;
 };
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstdint>
+
+/**
+ * On-disk extent tree nodes of inodes with EXT4_EXTENTS_FL, as in
+ * e2fsprogs' ext3_extents.h, which is not part of the ext2_fs.h API. A node
+ * is a header followed by index entries in interior nodes and by extents in
+ * leaves. The root node lives in i_block, deeper nodes fill a block each.
+ */
+struct ExtentHeader {
+  uint16_t magic;
+  uint16_t entries;
+  uint16_t max;
+  // 0 for leaves.
+  uint16_t depth;
+  uint32_t generation;
+};
+
+struct ExtentIndex {
+  // First file block covered by the child node.
+  uint32_t file_block;
+  uint32_t leaf_lo;
+  uint16_t leaf_hi;
+  uint16_t unused;
+};
+
+struct Extent {
+  uint32_t file_block;
+  uint16_t length;
+  uint16_t start_hi;
+  uint32_t start_lo;
+};
+
+const uint16_t kExtentMagic = 0xf30a;
+// Longer extents are preallocated but unwritten, and read as zeros; their
+// length is stored plus this.
+const uint16_t kMaxInitializedExtent = 32768;
@@ -0,0 +1,328 @@
+#include "Extractor.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <system_error>
+#include <unordered_map>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "LruCache.hpp"
+#include "ThreadPool.hpp"
+
+namespace {
+
+// A file whose data is still to be copied.
+struct HostFile {
+  std::string path;
+  size_t inode_idx;
+  // Chunks not written yet; the last one to finish closes the file.
+  std::atomic<size_t> pending{0};
+};
+
+struct Chunk {
+  uint64_t image_offset;
+  size_t file;
+  uint64_t offset;
+  size_t length;
+};
+
+// Something whose attributes are applied once all data is in place.
+struct Node {
+  std::string path;
+  struct stat attr;
+};
+
+void Fail(const char *what, const std::string &path) {
+  char error_msg[1024];
+  snprintf(error_msg, sizeof(error_msg), "%s %s", what, path.c_str());
+  throw std::system_error(errno, std::generic_category(), error_msg);
+}
+
+// A file being copied, opened on the image and on the host. Closed by
+// Close, or else once nobody holds it any more.
+struct OpenHostFile {
+  OpenHostFile(Ext2Driver &driver, const HostFile &file)
+      : driver(driver), path(file.path) {
+    handle = driver.OpenInode(file.inode_idx);
+    fd = open(path.c_str(), O_WRONLY);
+    if (fd < 0) {
+      int error = errno;
+      driver.Close(handle);
+      errno = error;
+      Fail("Could not open", path);
+    }
+  }
+  OpenHostFile(const OpenHostFile &) = delete;
+  OpenHostFile &operator=(const OpenHostFile &) = delete;
+  ~OpenHostFile() {
+    if (fd >= 0) {
+      close(fd);
+      driver.Close(handle);
+    }
+  }
+
+  void Close() {
+    driver.Close(handle);
+    int result = close(fd);
+    fd = -1;
+    if (result < 0) {
+      Fail("Could not write", path);
+    }
+  }
+
+  Ext2Driver &driver;
+  std::string path;
+  uint64_t handle;
+  int fd;
+};
+
+// Files are cut into chunks that are copied in image order, so with a
+// fragmented image the chunks of many files interleave. Only this many are
+// kept open between chunks; the rest are reopened when their turn comes.
+const size_t kOpenFiles = 64;
+
+void WriteChunk(const OpenHostFile &file, const char *data, size_t len,
+                uint64_t offset) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t written =
+        pwrite(file.fd, data + done, len - done, offset + done);
+    if (written < 0) {
+      Fail("Could not write", file.path);
+    }
+    done += written;
+  }
+}
+
+void ApplyAttributes(const Node &node, const ExtractOptions &options) {
+  bool is_link = S_ISLNK(node.attr.st_mode);
+  if (options.modes && !is_link &&
+      chmod(node.path.c_str(), node.attr.st_mode & 07777) < 0) {
+    Fail("Could not chmod", node.path);
+  }
+  if (options.times) {
+    struct timespec times[2] = {{node.attr.st_atime, 0},
+                                {node.attr.st_mtime, 0}};
+    if (utimensat(AT_FDCWD, node.path.c_str(), times,
+                  is_link ? AT_SYMLINK_NOFOLLOW : 0) < 0) {
+      Fail("Could not set times of", node.path);
+    }
+  }
+}
+
+} // namespace
+
+ExtractStats Extract(Ext2Driver &driver, const std::string &destination,
+                     const ExtractOptions &options) {
+  ExtractStats stats;
+  struct stat root;
+  driver.Getattr(options.subtree.c_str(), &root);
+  if (!S_ISDIR(root.st_mode)) {
+    throw std::system_error(ENOTDIR, std::generic_category(), options.subtree);
+  }
+  // While extracting, directories must stay writable whatever their mode.
+  mode_t dir_mode = options.modes ? S_IRWXU : 0777;
+  mode_t file_mode = options.modes ? S_IRUSR | S_IWUSR : 0666;
+  if (mkdir(destination.c_str(), dir_mode) < 0 && errno != EEXIST) {
+    Fail("Could not create", destination);
+  }
+
+  // Create the tree, collecting the data chunks of every file on the way.
+  std::vector<std::unique_ptr<HostFile>> files;
+  std::vector<Chunk> chunks;
+  std::vector<Node> nodes;
+  std::vector<Node> directories{{destination, root}};
+  const uint64_t block_size = driver.BlockSize();
+  std::unordered_map<size_t, std::string> linked;
+  std::vector<std::pair<size_t, std::string>> pending{
+      {root.st_ino, destination}};
+  while (!pending.empty()) {
+    size_t dir_inode = pending.back().first;
+    std::string dir_path = std::move(pending.back().second);
+    pending.pop_back();
+    uint64_t dir = driver.OpendirInode(dir_inode);
+    std::vector<std::pair<std::string, size_t>> entries;
+    try {
+      driver.Readdir(dir, 0, [&entries](const DirEntry &entry) {
+        if (entry.name != "." && entry.name != "..") {
+          entries.emplace_back(std::string(entry.name), entry.inode_idx);
+        }
+        return true;
+      });
+    } catch (...) {
+      driver.Releasedir(dir);
+      throw;
+    }
+    driver.Releasedir(dir);
+    for (const auto &entry : entries) {
+      std::string path = dir_path + "/" + entry.first;
+      struct stat attr;
+      try {
+        driver.GetattrByInode(entry.second, &attr);
+      } catch (const std::system_error &err) {
+        // An entry naming a free or nonexistent inode is damage in the
+        // image, not a reason to give up on the rest of it.
+        int code = err.code().value();
+        if (code != ESTALE && code != ENOENT) {
+          throw;
+        }
+        stats.skipped++;
+        continue;
+      }
+      if (S_ISDIR(attr.st_mode)) {
+        if (mkdir(path.c_str(), dir_mode) < 0 && errno != EEXIST) {
+          Fail("Could not create", path);
+        }
+        stats.directories++;
+        directories.push_back({path, attr});
+        pending.emplace_back(attr.st_ino, path);
+      } else if (S_ISREG(attr.st_mode)) {
+        if (attr.st_nlink > 1) {
+          auto seen = linked.emplace(attr.st_ino, path);
+          if (!seen.second) {
+            unlink(path.c_str());
+            if (link(seen.first->second.c_str(), path.c_str()) < 0) {
+              Fail("Could not link", path);
+            }
+            stats.hard_links++;
+            continue;
+          }
+        }
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, file_mode);
+        if (fd < 0) {
+          Fail("Could not create", path);
+        }
+        int result = ftruncate(fd, attr.st_size);
+        close(fd);
+        if (result < 0) {
+          Fail("Could not resize", path);
+        }
+        stats.files++;
+        nodes.push_back({path, attr});
+        auto file = std::make_unique<HostFile>();
+        file->path = path;
+        file->inode_idx = attr.st_ino;
+        // The handle is only needed for the map; chunks reopen the file.
+        uint64_t handle = driver.OpenInode(attr.st_ino);
+        std::shared_ptr<const BlockMap> map;
+        try {
+          map = driver.FileBlockMap(handle);
+        } catch (...) {
+          driver.Close(handle);
+          throw;
+        }
+        driver.Close(handle);
+        for (const BlockRun &run : *map) {
+          if (run.image_block == 0) {
+            continue;
+          }
+          uint64_t run_start = run.file_block * block_size;
+          uint64_t run_end = std::min<uint64_t>(
+              run_start + run.length * block_size, attr.st_size);
+          for (uint64_t offset = run_start; offset < run_end;
+               offset += options.chunk_bytes) {
+            chunks.push_back(
+                {run.image_block * block_size + (offset - run_start),
+                 files.size(), offset,
+                 static_cast<size_t>(std::min<uint64_t>(options.chunk_bytes,
+                                                        run_end - offset))});
+            file->pending++;
+          }
+        }
+        files.push_back(std::move(file));
+      } else if (S_ISLNK(attr.st_mode) && options.symlinks) {
+        char target[PATH_MAX];
+        int len = driver.ReadlinkInode(attr.st_ino, target, sizeof(target) - 1);
+        target[len] = '\0';
+        unlink(path.c_str());
+        if (symlink(target, path.c_str()) < 0) {
+          Fail("Could not create", path);
+        }
+        stats.symlinks++;
+        nodes.push_back({path, attr});
+      } else {
+        stats.skipped++;
+      }
+    }
+  }
+
+  // Copy the data in image order.
+  std::sort(chunks.begin(), chunks.end(), [](const Chunk &a, const Chunk &b) {
+    return a.image_offset < b.image_offset;
+  });
+  std::mutex mutex;
+  std::exception_ptr error;
+  std::atomic<bool> failed{false};
+  std::atomic<uint64_t> bytes{0};
+  ShardedLruCache<size_t, std::shared_ptr<OpenHostFile>> open_files(
+      kOpenFiles);
+  {
+    ThreadPool pool(std::max<size_t>(options.threads, 1));
+    for (const Chunk &chunk : chunks) {
+      pool.Submit([&, chunk] {
+        HostFile &file = *files[chunk.file];
+        try {
+          if (!failed) {
+            std::shared_ptr<OpenHostFile> open =
+                open_files.Get(chunk.file).value_or(nullptr);
+            if (!open) {
+              open = std::make_shared<OpenHostFile>(driver, file);
+              open_files.Put(chunk.file, open);
+            }
+            thread_local std::vector<char> buf;
+            buf.resize(std::max(buf.size(), chunk.length));
+            size_t len = driver.Read(open->handle, buf.data(), chunk.length,
+                                     chunk.offset);
+            if (len != chunk.length) {
+              errno = EIO;
+              Fail("Short read of", file.path);
+            }
+            WriteChunk(*open, buf.data(), len, chunk.offset);
+            bytes += len;
+          }
+          // Every other chunk of the file has let go of it by now.
+          if (--file.pending == 0) {
+            std::optional<std::shared_ptr<OpenHostFile>> open =
+                open_files.Get(chunk.file);
+            open_files.Erase(chunk.file);
+            if (open.has_value() && open.value()) {
+              open.value()->Close();
+            }
+          }
+        } catch (...) {
+          std::lock_guard<std::mutex> lock(mutex);
+          if (!error) {
+            error = std::current_exception();
+          }
+          failed = true;
+        }
+      });
+    }
+    pool.Wait();
+  }
+  if (error) {
+    std::rethrow_exception(error);
+  }
+  stats.bytes = bytes;
+
+  // Writing into a directory changes its times, and its mode may forbid
+  // writing, so directories come last and deepest first.
+  for (const Node &node : nodes) {
+    ApplyAttributes(node, options);
+  }
+  for (auto dir = directories.rbegin(); dir != directories.rend(); ++dir) {
+    ApplyAttributes(*dir, options);
+  }
+  return stats;
+}
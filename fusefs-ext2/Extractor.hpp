@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "Ext2Driver.hpp"
+
+struct ExtractOptions {
+  // Directory of the image whose contents are extracted.
+  std::string subtree{"/"};
+  // Workers reading file data from the image and writing it to the host.
+  size_t threads{4};
+  // File data is read in pieces of at most this many bytes.
+  size_t chunk_bytes{1 << 20};
+  // Give files and directories the permission bits they have in the image,
+  // instead of the defaults left by the umask.
+  bool modes{false};
+  // Give everything extracted its access and modification times.
+  bool times{false};
+  // Recreate symlinks; without this they are left out.
+  bool symlinks{false};
+};
+
+struct ExtractStats {
+  uint64_t directories{0};
+  uint64_t files{0};
+  uint64_t symlinks{0};
+  // Extra names of files already extracted, recreated as hard links.
+  uint64_t hard_links{0};
+  // Devices, FIFOs and sockets (and symlinks unless asked for), which are
+  // not recreated, and entries naming a free or nonexistent inode.
+  uint64_t skipped{0};
+  uint64_t bytes{0};
+};
+
+/**
+ * Copies `options.subtree` of the image into `destination`, creating it if
+ * needed. The tree is created first, with every file at its final size;
+ * then the data of all files is cut into chunks and read in the order it
+ * lies in the image, so the image is read nearly sequentially whatever the
+ * directory layout. A pool of workers reads the chunks and writes them out,
+ * overlapping image reads with host writes. Holes are skipped, so files
+ * stay sparse on the host.
+ *
+ * Reads are already in order, the driver's own readahead only gets in the
+ * way and is best disabled. Throws std::system_error on the first failure,
+ * after closing every file and handle it opened.
+ */
+ExtractStats Extract(Ext2Driver &driver, const std::string &destination,
+                     const ExtractOptions &options = ExtractOptions());
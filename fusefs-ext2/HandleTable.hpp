@@ -0,0 +1,179 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include <errno.h>
+
+/**
+ * Maps FUSE file handles to per-handle state. The table is split into shards
+ * with their own locks so that Open/Close on different handles do not
+ * serialize. Entries are handed out as shared pointers: a handle that is
+ * closed while a read is still in flight stays alive until that read ends.
+ *
+ * Every shard is a slab of slots with a free list, so Insert, Find and Erase
+ * are O(1) and the table grows as needed. A handle carries its slot index in
+ * the low 32 bits and the slot's generation in the high ones. Erasing bumps
+ * the generation, so a stale handle to a recycled slot is not found.
+ *
+ * The memory of an entry (with its reference count) goes back to a free list
+ * of its shard once the last reference is dropped, and the next Insert takes
+ * it from there, so steady open/close churn does not touch the heap.
+ */
+template <class T> class HandleTable {
+public:
+  static const size_t kShards = 16;
+
+  template <class... Args> uint64_t Insert(Args &&... args) {
+    size_t shard_idx = next_shard_.fetch_add(1, std::memory_order_relaxed) % kShards;
+    Shard &shard = shards_[shard_idx];
+    auto entry = std::allocate_shared<T>(EntryAllocator<T>(shard.entries),
+                                         std::forward<Args>(args)...);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    uint32_t local;
+    if (!shard.free.empty()) {
+      local = shard.free.back();
+      shard.free.pop_back();
+    } else {
+      if (shard.slots.size() >= kMaxSlotsPerShard) {
+        throw std::system_error(ENFILE, std::generic_category());
+      }
+      local = shard.slots.size();
+      shard.slots.emplace_back();
+    }
+    Slot &slot = shard.slots[local];
+    slot.entry = std::move(entry);
+    return static_cast<uint64_t>(slot.generation) << 32 |
+           (static_cast<uint64_t>(local) * kShards + shard_idx);
+  }
+
+  std::shared_ptr<T> Find(uint64_t handle) const {
+    const Shard &shard = shards_[SlotIndex(handle) % kShards];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    const Slot *slot = Lookup(shard, handle);
+    return slot != nullptr ? slot->entry : nullptr;
+  }
+
+  bool Erase(uint64_t handle) {
+    Shard &shard = shards_[SlotIndex(handle) % kShards];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    Slot *slot = const_cast<Slot *>(Lookup(shard, handle));
+    if (slot == nullptr) {
+      return false;
+    }
+    slot->entry.reset();
+    slot->generation++;
+    shard.free.push_back(SlotIndex(handle) / kShards);
+    return true;
+  }
+
+  // Entry memory waiting for the next Insert, summed over the shards.
+  size_t free_entries() const {
+    size_t result = 0;
+    for (const Shard &shard : shards_) {
+      std::lock_guard<std::mutex> lock(shard.entries->mutex);
+      result += shard.entries->free.size();
+    }
+    return result;
+  }
+
+private:
+  static const uint64_t kMaxSlotsPerShard = (uint64_t(1) << 32) / kShards;
+
+  // Freed entry memory of a shard. Entries may outlive the table, so each
+  // one holds on to the list it returns to.
+  struct EntryMemory {
+    ~EntryMemory() {
+      for (void *block : free) {
+        ::operator delete(block);
+      }
+    }
+
+    std::mutex mutex;
+    // Every entry takes the same allocation, its size is learnt from the
+    // first one.
+    size_t block_size{0};
+    std::vector<void *> free;
+  };
+
+  template <class U> struct EntryAllocator {
+    typedef U value_type;
+
+    explicit EntryAllocator(std::shared_ptr<EntryMemory> memory)
+        : memory(std::move(memory)) {}
+    template <class V>
+    EntryAllocator(const EntryAllocator<V> &other) : memory(other.memory) {}
+
+    U *allocate(size_t n) {
+      size_t bytes = n * sizeof(U);
+      {
+        std::lock_guard<std::mutex> lock(memory->mutex);
+        if (memory->block_size == 0) {
+          memory->block_size = bytes;
+        }
+        if (bytes == memory->block_size && !memory->free.empty()) {
+          void *block = memory->free.back();
+          memory->free.pop_back();
+          return static_cast<U *>(block);
+        }
+      }
+      return static_cast<U *>(::operator new(bytes));
+    }
+
+    void deallocate(U *block, size_t n) {
+      {
+        std::lock_guard<std::mutex> lock(memory->mutex);
+        if (n * sizeof(U) == memory->block_size) {
+          memory->free.push_back(block);
+          return;
+        }
+      }
+      ::operator delete(block);
+    }
+
+    template <class V> bool operator==(const EntryAllocator<V> &other) const {
+      return memory == other.memory;
+    }
+    template <class V> bool operator!=(const EntryAllocator<V> &other) const {
+      return memory != other.memory;
+    }
+
+    std::shared_ptr<EntryMemory> memory;
+  };
+
+  struct Slot {
+    uint32_t generation{0};
+    std::shared_ptr<T> entry;
+  };
+
+  struct Shard {
+    mutable std::mutex mutex;
+    std::vector<Slot> slots;
+    std::vector<uint32_t> free;
+    std::shared_ptr<EntryMemory> entries{std::make_shared<EntryMemory>()};
+  };
+
+  static uint32_t SlotIndex(uint64_t handle) {
+    return static_cast<uint32_t>(handle);
+  }
+
+  static const Slot *Lookup(const Shard &shard, uint64_t handle) {
+    size_t local = SlotIndex(handle) / kShards;
+    if (local >= shard.slots.size()) {
+      return nullptr;
+    }
+    const Slot &slot = shard.slots[local];
+    if (!slot.entry || slot.generation != static_cast<uint32_t>(handle >> 32)) {
+      return nullptr;
+    }
+    return &slot;
+  }
+
+  std::atomic<size_t> next_shard_{0};
+  Shard shards_[kShards];
+};
@@ -0,0 +1,677 @@
+#include "ImageBuilder.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <system_error>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Extents.hpp"
+
+namespace {
+
+const uint32_t kInodeSize = EXT2_GOOD_OLD_INODE_SIZE;
+// Every timestamp in the image, so that equal specs give equal images.
+const uint32_t kTimestamp = 1700000000;
+const size_t kDirEntryHeader = 8;
+// Symlink targets shorter than this are kept inline in i_block.
+const size_t kFastSymlinkMax = sizeof(ext2_inode::i_block);
+// File data is written in runs of consecutive blocks up to this size.
+const size_t kMaxWriteBytes = 1 << 20;
+// Sparse files are allocated, or not, in chunks of this many blocks.
+const uint64_t kSparseChunkBlocks = 16;
+// Depth of the deepest block pointer, triply indirect.
+const uint32_t kMaxFileBlocksDepth = 3;
+
+uint64_t SplitMix64(uint64_t *state) {
+  uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+uint64_t Mix(uint32_t seed, uint32_t inode, uint64_t value) {
+  uint64_t state = (static_cast<uint64_t>(seed) << 32) | inode;
+  SplitMix64(&state);
+  state ^= value;
+  return SplitMix64(&state);
+}
+
+bool IsPowerOf(uint32_t value, uint32_t base) {
+  while (value > 1 && value % base == 0) {
+    value /= base;
+  }
+  return value == 1;
+}
+
+size_t EntrySize(size_t name_len) {
+  return (kDirEntryHeader + name_len + 3) & ~size_t(3);
+}
+
+} // namespace
+
+ImageBuilder::ImageBuilder(const std::string &path, uint64_t size_bytes,
+                           uint32_t block_size, uint32_t inode_count,
+                           uint32_t seed, double fragmentation, bool extents)
+    : seed_(seed), fragmentation_(fragmentation), extents_(extents),
+      random_(seed), block_size_(block_size) {
+  char error_msg[1024];
+  if (block_size < 1024 || block_size > 65536 ||
+      (block_size & (block_size - 1)) != 0) {
+    snprintf(error_msg, sizeof(error_msg), "Invalid block size %u", block_size);
+    throw std::system_error(EINVAL, std::generic_category(), error_msg);
+  }
+  first_data_block_ = block_size == 1024 ? 1 : 0;
+  blocks_per_group_ = 8 * block_size;
+  blocks_count_ = size_bytes / block_size;
+  if (blocks_count_ > UINT32_MAX) {
+    throw std::system_error(EFBIG, std::generic_category(),
+                            "Image needs more than 2^32 blocks");
+  }
+  inode_count = std::max<uint32_t>(inode_count, EXT2_GOOD_OLD_FIRST_INO + 1);
+  uint32_t inodes_per_block = block_size / kInodeSize;
+  // Drop the last group while it can't hold its own metadata plus a block.
+  while (true) {
+    if (blocks_count_ <= first_data_block_) {
+      throw std::system_error(ENOSPC, std::generic_category(),
+                              "Image is too small");
+    }
+    group_count_ = (blocks_count_ - first_data_block_ + blocks_per_group_ - 1) /
+                   blocks_per_group_;
+    gdt_blocks_ =
+        (group_count_ * sizeof(ext2_group_desc) + block_size - 1) / block_size;
+    inodes_per_group_ = (inode_count + group_count_ - 1) / group_count_;
+    inodes_per_group_ = (inodes_per_group_ + inodes_per_block - 1) /
+                        inodes_per_block * inodes_per_block;
+    if (inodes_per_group_ > 8 * block_size) {
+      snprintf(error_msg, sizeof(error_msg),
+               "%u inodes do not fit in %u groups", inode_count, group_count_);
+      throw std::system_error(EINVAL, std::generic_category(), error_msg);
+    }
+    inode_table_blocks_ = inodes_per_group_ / inodes_per_block;
+    uint32_t last = group_count_ - 1;
+    uint64_t overhead = BlockBitmap(last) + 2 + inode_table_blocks_;
+    if (blocks_count_ > overhead) {
+      break;
+    }
+    if (group_count_ == 1) {
+      throw std::system_error(ENOSPC, std::generic_category(),
+                              "Image is too small");
+    }
+    blocks_count_ = GroupStart(last);
+  }
+
+  used_blocks_.assign(blocks_count_, 0);
+  std::fill(used_blocks_.begin(), used_blocks_.begin() + first_data_block_, 1);
+  for (uint32_t group = 0; group < group_count_; ++group) {
+    uint64_t metadata_end = BlockBitmap(group) + 2 + inode_table_blocks_;
+    std::fill(used_blocks_.begin() + GroupStart(group),
+              used_blocks_.begin() + metadata_end, 1);
+  }
+  free_blocks_ = std::count(used_blocks_.begin(), used_blocks_.end(), 0);
+  next_block_ = BlockBitmap(0) + 2 + inode_table_blocks_;
+  next_inode_ = EXT2_GOOD_OLD_FIRST_INO;
+  directories_per_group_.assign(group_count_, 0);
+  directory_index_.assign(inodes_per_group_ * group_count_ + 1, -1);
+
+  fd_ = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd_ < 0) {
+    snprintf(error_msg, sizeof(error_msg), "Could not create image %s",
+             path.c_str());
+    throw std::system_error(errno, std::generic_category(), error_msg);
+  }
+  if (ftruncate(fd_, blocks_count_ * block_size_) < 0) {
+    int err = errno;
+    close(fd_);
+    throw std::system_error(err, std::generic_category(),
+                            "Could not size image");
+  }
+
+  // The root is its own parent.
+  directories_.push_back(Directory{kRootInode, kRootInode});
+  directory_index_[kRootInode] = 0;
+  directories_per_group_[0]++;
+  AddEntry(directories_[0], kRootInode, ".", EXT2_FT_DIR);
+  AddEntry(directories_[0], kRootInode, "..", EXT2_FT_DIR);
+  AddDirectory(kRootInode, "lost+found");
+}
+
+ImageBuilder::~ImageBuilder() { close(fd_); }
+
+uint32_t ImageBuilder::AddDirectory(uint32_t parent, const std::string &name) {
+  GetDirectory(parent);
+  uint32_t inode_idx = AllocateInode();
+  directory_index_[inode_idx] = directories_.size();
+  directories_.push_back(Directory{inode_idx, parent});
+  directories_per_group_[(inode_idx - 1) / inodes_per_group_]++;
+  Directory &dir = directories_.back();
+  AddEntry(dir, inode_idx, ".", EXT2_FT_DIR);
+  AddEntry(dir, parent, "..", EXT2_FT_DIR);
+  Directory &parent_dir = GetDirectory(parent);
+  AddEntry(parent_dir, inode_idx, name, EXT2_FT_DIR);
+  parent_dir.subdirectories++;
+  return inode_idx;
+}
+
+uint32_t ImageBuilder::AddFile(uint32_t parent, const std::string &name,
+                               uint64_t size, bool sparse) {
+  return AddRegularFile(parent, name, size,
+                        [this, sparse](uint32_t inode_idx, uint64_t file_block) {
+                          return sparse && IsHole(seed_, inode_idx, file_block);
+                        });
+}
+
+uint32_t ImageBuilder::AddSparseFile(uint32_t parent, const std::string &name,
+                                     uint64_t size,
+                                     std::vector<uint64_t> data_blocks) {
+  std::sort(data_blocks.begin(), data_blocks.end());
+  return AddRegularFile(
+      parent, name, size, [&data_blocks](uint32_t, uint64_t file_block) {
+        return !std::binary_search(data_blocks.begin(), data_blocks.end(),
+                                   file_block);
+      });
+}
+
+uint32_t ImageBuilder::AddRegularFile(
+    uint32_t parent, const std::string &name, uint64_t size,
+    const std::function<bool(uint32_t, uint64_t)> &is_hole) {
+  Directory &dir = GetDirectory(parent);
+  uint64_t block_count = (size + block_size_ - 1) / block_size_;
+  uint64_t pointers = block_size_ / sizeof(uint32_t);
+  uint64_t max_blocks = EXT2_NDIR_BLOCKS;
+  for (uint64_t depth = 1, span = pointers; depth <= kMaxFileBlocksDepth;
+       ++depth, span *= pointers) {
+    max_blocks += span;
+  }
+  if (block_count > max_blocks) {
+    char error_msg[1024];
+    snprintf(error_msg, sizeof(error_msg), "File %s of %lu bytes is too large",
+             name.c_str(), static_cast<unsigned long>(size));
+    throw std::system_error(EFBIG, std::generic_category(), error_msg);
+  }
+  uint32_t inode_idx = AllocateInode();
+  if (size > INT32_MAX) {
+    large_file_ = true;
+  }
+
+  std::vector<uint32_t> blocks(block_count, 0);
+  std::vector<char> run;
+  run.reserve(kMaxWriteBytes);
+  uint64_t run_start = 0;
+  uint64_t data_blocks = 0;
+  for (uint64_t file_block = 0; file_block < block_count; ++file_block) {
+    if (is_hole(inode_idx, file_block)) {
+      continue;
+    }
+    uint32_t block_idx = AllocateBlock();
+    blocks[file_block] = block_idx;
+    data_blocks++;
+    if (!run.empty() && (block_idx != run_start + run.size() / block_size_ ||
+                         run.size() == kMaxWriteBytes)) {
+      Write(run.data(), run.size(), run_start * block_size_);
+      run.clear();
+    }
+    if (run.empty()) {
+      run_start = block_idx;
+    }
+    run.resize(run.size() + block_size_);
+    char *data = run.data() + run.size() - block_size_;
+    FillBlock(seed_, inode_idx, file_block, data, block_size_);
+    if ((file_block + 1) * block_size_ > size) {
+      size_t used = size % block_size_;
+      memset(data + used, 0, block_size_ - used);
+    }
+  }
+  if (!run.empty()) {
+    Write(run.data(), run.size(), run_start * block_size_);
+  }
+
+  ext2_inode inode = NewInode(S_IFREG | 0644, size);
+  inode.i_links_count = 1;
+  uint64_t indirect_blocks = SetBlockPointers(&inode, blocks);
+  inode.i_blocks = (data_blocks + indirect_blocks) * (block_size_ / 512);
+  WriteInode(inode_idx, inode);
+  AddEntry(dir, inode_idx, name, EXT2_FT_REG_FILE);
+  return inode_idx;
+}
+
+uint32_t ImageBuilder::AddSymlink(uint32_t parent, const std::string &name,
+                                  const std::string &target) {
+  Directory &dir = GetDirectory(parent);
+  if (target.empty() || target.size() >= block_size_) {
+    char error_msg[1024];
+    snprintf(error_msg, sizeof(error_msg),
+             "Symlink target of %zu bytes is not supported", target.size());
+    throw std::system_error(ENAMETOOLONG, std::generic_category(), error_msg);
+  }
+  uint32_t inode_idx = AllocateInode();
+  ext2_inode inode = NewInode(S_IFLNK | 0777, target.size());
+  inode.i_links_count = 1;
+  if (target.size() < kFastSymlinkMax) {
+    memcpy(inode.i_block, target.data(), target.size());
+  } else {
+    std::vector<char> data(block_size_, 0);
+    memcpy(data.data(), target.data(), target.size());
+    inode.i_block[0] = AllocateBlock();
+    inode.i_blocks = block_size_ / 512;
+    Write(data.data(), data.size(),
+          static_cast<uint64_t>(inode.i_block[0]) * block_size_);
+  }
+  WriteInode(inode_idx, inode);
+  AddEntry(dir, inode_idx, name, EXT2_FT_SYMLINK);
+  return inode_idx;
+}
+
+void ImageBuilder::Finish() {
+  if (finished_) {
+    return;
+  }
+  for (Directory &dir : directories_) {
+    uint64_t block_count = dir.data.size() / block_size_;
+    std::vector<uint32_t> blocks(block_count);
+    for (uint64_t i = 0; i < block_count; ++i) {
+      blocks[i] = AllocateBlock();
+      Write(dir.data.data() + i * block_size_, block_size_,
+            static_cast<uint64_t>(blocks[i]) * block_size_);
+    }
+    ext2_inode inode = NewInode(S_IFDIR | 0755, dir.data.size());
+    inode.i_links_count = 2 + dir.subdirectories;
+    uint64_t indirect_blocks = SetBlockPointers(&inode, blocks);
+    inode.i_blocks = (block_count + indirect_blocks) * (block_size_ / 512);
+    WriteInode(dir.inode, inode);
+    std::vector<char>().swap(dir.data);
+  }
+
+  std::vector<ext2_group_desc> groups(group_count_);
+  std::vector<uint8_t> bitmap(block_size_);
+  uint64_t free_inodes = 0;
+  for (uint32_t group = 0; group < group_count_; ++group) {
+    ext2_group_desc &desc = groups[group];
+    desc.bg_block_bitmap = BlockBitmap(group);
+    desc.bg_inode_bitmap = desc.bg_block_bitmap + 1;
+    desc.bg_inode_table = desc.bg_block_bitmap + 2;
+    desc.bg_used_dirs_count = directories_per_group_[group];
+
+    // Bits past the end of the image, or of the inodes, are set.
+    std::fill(bitmap.begin(), bitmap.end(), 0);
+    uint64_t start = GroupStart(group);
+    uint64_t group_blocks =
+        std::min<uint64_t>(blocks_per_group_, blocks_count_ - start);
+    for (uint64_t bit = 0; bit < blocks_per_group_; ++bit) {
+      if (bit >= group_blocks || used_blocks_[start + bit]) {
+        bitmap[bit / 8] |= 1 << (bit % 8);
+      } else {
+        desc.bg_free_blocks_count++;
+      }
+    }
+    Write(bitmap.data(), block_size_, desc.bg_block_bitmap * block_size_);
+
+    std::fill(bitmap.begin(), bitmap.end(), 0);
+    uint64_t first_inode = static_cast<uint64_t>(group) * inodes_per_group_ + 1;
+    for (uint64_t bit = 0; bit < 8 * block_size_; ++bit) {
+      if (bit >= inodes_per_group_ || first_inode + bit < next_inode_) {
+        bitmap[bit / 8] |= 1 << (bit % 8);
+      } else {
+        desc.bg_free_inodes_count++;
+      }
+    }
+    free_inodes += desc.bg_free_inodes_count;
+    Write(bitmap.data(), block_size_, desc.bg_inode_bitmap * block_size_);
+  }
+
+  ext2_super_block sb = {};
+  sb.s_inodes_count = inodes_per_group_ * group_count_;
+  sb.s_blocks_count = blocks_count_;
+  sb.s_free_blocks_count = free_blocks_;
+  sb.s_free_inodes_count = free_inodes;
+  sb.s_first_data_block = first_data_block_;
+  sb.s_log_block_size = __builtin_ctz(block_size_) - 10;
+  sb.s_log_cluster_size = sb.s_log_block_size;
+  sb.s_blocks_per_group = blocks_per_group_;
+  sb.s_clusters_per_group = blocks_per_group_;
+  sb.s_inodes_per_group = inodes_per_group_;
+  sb.s_wtime = kTimestamp;
+  sb.s_max_mnt_count = -1;
+  sb.s_magic = EXT2_SUPER_MAGIC;
+  sb.s_state = EXT2_VALID_FS;
+  sb.s_errors = EXT2_ERRORS_CONTINUE;
+  sb.s_lastcheck = kTimestamp;
+  sb.s_creator_os = EXT2_OS_LINUX;
+  sb.s_rev_level = EXT2_DYNAMIC_REV;
+  sb.s_first_ino = EXT2_GOOD_OLD_FIRST_INO;
+  sb.s_inode_size = kInodeSize;
+  sb.s_feature_incompat = EXT2_FEATURE_INCOMPAT_FILETYPE;
+  if (extents_) {
+    sb.s_feature_incompat |= EXT3_FEATURE_INCOMPAT_EXTENTS;
+  }
+  sb.s_feature_ro_compat = EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER;
+  if (large_file_) {
+    sb.s_feature_ro_compat |= EXT2_FEATURE_RO_COMPAT_LARGE_FILE;
+  }
+  uint64_t state = seed_;
+  for (size_t i = 0; i < sizeof(sb.s_uuid); i += sizeof(uint64_t)) {
+    uint64_t random = SplitMix64(&state);
+    memcpy(sb.s_uuid + i, &random, sizeof(random));
+  }
+  for (uint32_t &word : sb.s_hash_seed) {
+    word = SplitMix64(&state);
+  }
+  sb.s_def_hash_version = EXT2_HASH_HALF_MD4;
+  sb.s_mkfs_time = kTimestamp;
+
+  std::vector<char> gdt(gdt_blocks_ * block_size_, 0);
+  memcpy(gdt.data(), groups.data(), groups.size() * sizeof(ext2_group_desc));
+  for (uint32_t group = 0; group < group_count_; ++group) {
+    if (!HasSuperblockBackup(group)) {
+      continue;
+    }
+    uint64_t start = GroupStart(group);
+    sb.s_block_group_nr = group;
+    // The primary superblock sits 1024 bytes in, whatever the block size.
+    Write(&sb, sizeof(sb), group == 0 ? 1024 : start * block_size_);
+    Write(gdt.data(), gdt.size(), (start + 1) * block_size_);
+  }
+  if (fsync(fd_) < 0) {
+    throw std::system_error(errno, std::generic_category(),
+                            "Could not flush image");
+  }
+  finished_ = true;
+}
+
+void ImageBuilder::FillBlock(uint32_t seed, uint32_t inode,
+                             uint64_t file_block, char *buf, size_t len) {
+  uint64_t state = Mix(seed, inode, file_block);
+  for (size_t i = 0; i < len; i += sizeof(uint64_t)) {
+    uint64_t random = SplitMix64(&state);
+    memcpy(buf + i, &random, std::min(sizeof(random), len - i));
+  }
+}
+
+bool ImageBuilder::IsHole(uint32_t seed, uint32_t inode, uint64_t file_block) {
+  // A quarter of the chunks hold data.
+  return Mix(seed ^ 0x5a5a5a5a, inode, file_block / kSparseChunkBlocks) % 4 != 0;
+}
+
+uint64_t ImageBuilder::GroupStart(uint32_t group) const {
+  return first_data_block_ + static_cast<uint64_t>(group) * blocks_per_group_;
+}
+
+bool ImageBuilder::HasSuperblockBackup(uint32_t group) const {
+  return group <= 1 || IsPowerOf(group, 3) || IsPowerOf(group, 5) ||
+         IsPowerOf(group, 7);
+}
+
+uint64_t ImageBuilder::BlockBitmap(uint32_t group) const {
+  uint64_t start = GroupStart(group);
+  return HasSuperblockBackup(group) ? start + 1 + gdt_blocks_ : start;
+}
+
+uint32_t ImageBuilder::AllocateInode() {
+  if (next_inode_ > inodes_per_group_ * group_count_) {
+    throw std::system_error(ENOSPC, std::generic_category(),
+                            "Image is out of inodes");
+  }
+  return next_inode_++;
+}
+
+uint32_t ImageBuilder::AllocateBlock() {
+  if (free_blocks_ == 0) {
+    throw std::system_error(ENOSPC, std::generic_category(),
+                            "Image is out of blocks");
+  }
+  if (fragmentation_ > 0 &&
+      std::uniform_real_distribution<double>()(random_) < fragmentation_) {
+    next_block_ = random_() % blocks_count_;
+  }
+  while (true) {
+    if (next_block_ >= blocks_count_) {
+      next_block_ = first_data_block_;
+    }
+    if (!used_blocks_[next_block_]) {
+      used_blocks_[next_block_] = 1;
+      free_blocks_--;
+      return next_block_++;
+    }
+    next_block_++;
+  }
+}
+
+ImageBuilder::Directory &ImageBuilder::GetDirectory(uint32_t inode) {
+  if (inode >= directory_index_.size() || directory_index_[inode] < 0) {
+    char error_msg[1024];
+    snprintf(error_msg, sizeof(error_msg), "Inode %u is not a directory",
+             inode);
+    throw std::system_error(ENOTDIR, std::generic_category(), error_msg);
+  }
+  return directories_[directory_index_[inode]];
+}
+
+void ImageBuilder::AddEntry(Directory &dir, uint32_t inode,
+                            const std::string &name, uint8_t file_type) {
+  if (name.empty() || name.size() > EXT2_NAME_LEN) {
+    char error_msg[1024];
+    snprintf(error_msg, sizeof(error_msg), "Invalid name length %zu",
+             name.size());
+    throw std::system_error(ENAMETOOLONG, std::generic_category(), error_msg);
+  }
+  size_t size = EntrySize(name.size());
+  size_t offset = dir.data.size();
+  size_t rec_len = block_size_;
+  if (!dir.data.empty()) {
+    auto last =
+        reinterpret_cast<ext2_dir_entry_2 *>(dir.data.data() + dir.last_entry);
+    size_t last_size = EntrySize(last->name_len);
+    if (last->rec_len - last_size >= size) {
+      offset = dir.last_entry + last_size;
+      rec_len = last->rec_len - last_size;
+      last->rec_len = last_size;
+    }
+  }
+  if (offset == dir.data.size()) {
+    dir.data.resize(offset + block_size_, 0);
+  }
+  auto entry = reinterpret_cast<ext2_dir_entry_2 *>(dir.data.data() + offset);
+  entry->inode = inode;
+  entry->rec_len = rec_len;
+  entry->name_len = name.size();
+  entry->file_type = file_type;
+  memcpy(entry->name, name.data(), name.size());
+  dir.last_entry = offset;
+}
+
+uint64_t ImageBuilder::SetBlockPointers(ext2_inode *inode,
+                                        const std::vector<uint32_t> &blocks) {
+  if (extents_) {
+    return SetExtents(inode, blocks);
+  }
+  uint64_t indirect_blocks = 0;
+  uint64_t direct = std::min<uint64_t>(EXT2_NDIR_BLOCKS, blocks.size());
+  std::copy(blocks.begin(), blocks.begin() + direct, inode->i_block);
+  uint64_t pointers = block_size_ / sizeof(uint32_t);
+  uint64_t start = EXT2_NDIR_BLOCKS;
+  uint64_t span = pointers;
+  for (uint32_t depth = 1; depth <= kMaxFileBlocksDepth && start < blocks.size();
+       ++depth) {
+    inode->i_block[EXT2_NDIR_BLOCKS + depth - 1] =
+        BuildIndirect(blocks, start, depth, &indirect_blocks);
+    start += span;
+    span *= pointers;
+  }
+  return indirect_blocks;
+}
+
+uint32_t ImageBuilder::BuildIndirect(const std::vector<uint32_t> &blocks,
+                                     uint64_t start, uint32_t depth,
+                                     uint64_t *indirect_blocks) {
+  uint64_t pointers = block_size_ / sizeof(uint32_t);
+  uint64_t span = 1;
+  for (uint32_t i = 1; i < depth; ++i) {
+    span *= pointers;
+  }
+  std::vector<uint32_t> table(pointers, 0);
+  bool empty = true;
+  for (uint64_t i = 0; i < pointers && start + i * span < blocks.size(); ++i) {
+    uint64_t child = start + i * span;
+    table[i] = depth == 1 ? blocks[child]
+                          : BuildIndirect(blocks, child, depth - 1,
+                                          indirect_blocks);
+    empty = empty && table[i] == 0;
+  }
+  // Subtrees covering only holes are left out.
+  if (empty) {
+    return 0;
+  }
+  uint32_t block_idx = AllocateBlock();
+  Write(table.data(), block_size_, static_cast<uint64_t>(block_idx) * block_size_);
+  (*indirect_blocks)++;
+  return block_idx;
+}
+
+uint64_t ImageBuilder::SetExtents(ext2_inode *inode,
+                                  const std::vector<uint32_t> &blocks) {
+  inode->i_flags |= EXT4_EXTENTS_FL;
+  std::vector<Extent> extents;
+  for (uint64_t file_block = 0; file_block < blocks.size(); ++file_block) {
+    if (blocks[file_block] == 0) {
+      continue;
+    }
+    if (!extents.empty()) {
+      Extent &last = extents.back();
+      if (last.file_block + last.length == file_block &&
+          last.start_lo + last.length == blocks[file_block] &&
+          last.length < kMaxInitializedExtent) {
+        last.length++;
+        continue;
+      }
+    }
+    extents.push_back({static_cast<uint32_t>(file_block), 1, 0,
+                       blocks[file_block]});
+  }
+  // Nodes are written bottom up, a level at a time, until the entries of
+  // the top level fit into the root in i_block.
+  const size_t root_entries =
+      (sizeof(inode->i_block) - sizeof(ExtentHeader)) / sizeof(Extent);
+  const size_t node_entries = (block_size_ - sizeof(ExtentHeader)) / sizeof(Extent);
+  uint64_t tree_blocks = 0;
+  uint16_t depth = 0;
+  std::vector<ExtentIndex> indexes;
+  while ((depth == 0 ? extents.size() : indexes.size()) > root_entries) {
+    std::vector<ExtentIndex> next;
+    size_t count = depth == 0 ? extents.size() : indexes.size();
+    for (size_t i = 0; i < count; i += node_entries) {
+      size_t entries = std::min(node_entries, count - i);
+      uint32_t block_idx =
+          depth == 0 ? WriteExtentNode(&extents[i], entries, depth)
+                     : WriteExtentNode(&indexes[i], entries, depth);
+      uint32_t first =
+          depth == 0 ? extents[i].file_block : indexes[i].file_block;
+      next.push_back({first, block_idx, 0, 0});
+      tree_blocks++;
+    }
+    indexes = std::move(next);
+    depth++;
+  }
+  size_t count = depth == 0 ? extents.size() : indexes.size();
+  ExtentHeader header{kExtentMagic, static_cast<uint16_t>(count),
+                      static_cast<uint16_t>(root_entries), depth, 0};
+  char *root = reinterpret_cast<char *>(inode->i_block);
+  memcpy(root, &header, sizeof(header));
+  const void *entries =
+      depth == 0 ? static_cast<const void *>(extents.data()) : indexes.data();
+  if (count != 0) {
+    memcpy(root + sizeof(header), entries, count * sizeof(Extent));
+  }
+  return tree_blocks;
+}
+
+uint32_t ImageBuilder::WriteExtentNode(const void *entries, size_t count,
+                                       uint16_t depth) {
+  std::vector<char> node(block_size_, 0);
+  ExtentHeader header{
+      kExtentMagic, static_cast<uint16_t>(count),
+      static_cast<uint16_t>((block_size_ - sizeof(ExtentHeader)) / sizeof(Extent)),
+      depth, 0};
+  memcpy(node.data(), &header, sizeof(header));
+  memcpy(node.data() + sizeof(header), entries, count * sizeof(Extent));
+  uint32_t block_idx = AllocateBlock();
+  Write(node.data(), node.size(), static_cast<uint64_t>(block_idx) * block_size_);
+  return block_idx;
+}
+
+ext2_inode ImageBuilder::NewInode(uint16_t mode, uint64_t size) const {
+  ext2_inode inode = {};
+  inode.i_mode = mode;
+  inode.i_size = size;
+  inode.i_size_high = size >> 32;
+  inode.i_atime = kTimestamp;
+  inode.i_ctime = kTimestamp;
+  inode.i_mtime = kTimestamp;
+  return inode;
+}
+
+void ImageBuilder::WriteInode(uint32_t inode_idx, const ext2_inode &inode) {
+  uint32_t group = (inode_idx - 1) / inodes_per_group_;
+  uint64_t index = (inode_idx - 1) % inodes_per_group_;
+  uint64_t table = BlockBitmap(group) + 2;
+  Write(&inode, sizeof(inode), table * block_size_ + index * kInodeSize);
+}
+
+void ImageBuilder::Write(const void *data, size_t len, uint64_t offset) {
+  const char *bytes = static_cast<const char *>(data);
+  while (len > 0) {
+    ssize_t written = pwrite(fd_, bytes, len, offset);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw std::system_error(errno, std::generic_category(),
+                              "Could not write image");
+    }
+    bytes += written;
+    len -= written;
+    offset += written;
+  }
+}
+
+void GenerateImage(const std::string &path, const ImageSpec &spec) {
+  uint64_t fanout = std::max<uint32_t>(spec.fanout, 1);
+  uint64_t directories = std::max<uint64_t>(1, (spec.files + fanout - 1) / fanout);
+  // Room for the reserved inodes and lost+found.
+  uint64_t inodes = spec.files + directories + EXT2_GOOD_OLD_FIRST_INO;
+  if (inodes > UINT32_MAX) {
+    throw std::system_error(EINVAL, std::generic_category(),
+                            "Too many files for one image");
+  }
+  ImageBuilder builder(path, spec.size_bytes, spec.block_size, inodes,
+                       spec.seed, spec.fragmentation, spec.extents);
+  // Directory i hangs off directory (i - 1) / fanout, like a heap.
+  std::vector<uint32_t> dirs(directories, ImageBuilder::kRootInode);
+  for (uint64_t i = 1; i < directories; ++i) {
+    dirs[i] = builder.AddDirectory(dirs[(i - 1) / fanout], "d" + std::to_string(i));
+  }
+  std::mt19937_64 random(spec.seed);
+  std::uniform_real_distribution<double> unit;
+  double log_min = std::log(spec.min_file_bytes + 1.0);
+  double log_max = std::log(std::max(spec.max_file_bytes, spec.min_file_bytes) + 1.0);
+  for (uint64_t i = 0; i < spec.files; ++i) {
+    uint32_t parent = dirs[i % directories];
+    double kind = unit(random);
+    if (kind < spec.symlink_fraction) {
+      // Targets of all lengths, so both inline and block symlinks show up.
+      std::string target = "../f" + std::to_string(i);
+      target.resize(target.size() + random() % 120, 'x');
+      builder.AddSymlink(parent, "l" + std::to_string(i), target);
+      continue;
+    }
+    uint64_t size = std::exp(log_min + unit(random) * (log_max - log_min)) - 1;
+    size = std::min(std::max(size, spec.min_file_bytes), spec.max_file_bytes);
+    bool sparse = unit(random) < spec.sparse_fraction;
+    builder.AddFile(parent, "f" + std::to_string(i), size, sparse);
+  }
+  builder.Finish();
+}
@@ -0,0 +1,148 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <ext2fs/ext2_fs.h>
+
+/**
+ * Writes an ext2 image (revision 1, 128-byte inodes, filetype and
+ * sparse_super features, large_file when needed) without any external tool.
+ * Optionally files and directories are mapped by ext4 extent trees instead
+ * of indirect blocks.
+ * Files are written through to the image as they are added, so images far
+ * larger than memory can be built; only directory contents are held until
+ * Finish().
+ *
+ * Everything is deterministic: file contents, sparse layouts and, with a
+ * fragmentation level above zero, block placement all derive from the seed.
+ * FillBlock and IsHole tell what any file block must read back as.
+ */
+class ImageBuilder {
+public:
+  static constexpr uint32_t kRootInode = EXT2_ROOT_INO;
+
+  /**
+   * `fragmentation` is the probability, per allocated block, of continuing
+   * allocation at a random spot of the image instead of the next free block.
+   */
+  ImageBuilder(const std::string &path, uint64_t size_bytes,
+               uint32_t block_size, uint32_t inode_count, uint32_t seed,
+               double fragmentation = 0, bool extents = false);
+  ~ImageBuilder();
+
+  ImageBuilder(const ImageBuilder &) = delete;
+  ImageBuilder &operator=(const ImageBuilder &) = delete;
+
+  // Each returns the new inode number. Names must be unique per directory.
+  uint32_t AddDirectory(uint32_t parent, const std::string &name);
+  // A sparse file only has some of its blocks allocated, see IsHole.
+  uint32_t AddFile(uint32_t parent, const std::string &name, uint64_t size,
+                   bool sparse = false);
+  // A file that is a hole except for the given blocks, e.g. to put data far
+  // into a file without writing everything before it.
+  uint32_t AddSparseFile(uint32_t parent, const std::string &name,
+                         uint64_t size, std::vector<uint64_t> data_blocks);
+  uint32_t AddSymlink(uint32_t parent, const std::string &name,
+                      const std::string &target);
+  // Writes directories, bitmaps, group descriptors and superblocks.
+  void Finish();
+
+  // Contents of a data block of `inode` in an image built with `seed`.
+  static void FillBlock(uint32_t seed, uint32_t inode, uint64_t file_block,
+                        char *buf, size_t len);
+  // Whether a block of a sparse file is left unallocated.
+  static bool IsHole(uint32_t seed, uint32_t inode, uint64_t file_block);
+
+private:
+  struct Directory {
+    uint32_t inode;
+    uint32_t parent;
+    uint32_t subdirectories{0};
+    // Entries as they go to disk, whole blocks; the last entry of every
+    // block stretches to its end.
+    std::vector<char> data;
+    size_t last_entry{0};
+  };
+
+  uint64_t GroupStart(uint32_t group) const;
+  bool HasSuperblockBackup(uint32_t group) const;
+  // The block bitmap; the inode bitmap and the inode table follow it.
+  uint64_t BlockBitmap(uint32_t group) const;
+  uint32_t AllocateInode();
+  uint32_t AllocateBlock();
+  Directory &GetDirectory(uint32_t inode);
+  // Adds a file whose blocks are holes where `is_hole(inode, block)` says so.
+  uint32_t AddRegularFile(
+      uint32_t parent, const std::string &name, uint64_t size,
+      const std::function<bool(uint32_t, uint64_t)> &is_hole);
+  void AddEntry(Directory &dir, uint32_t inode, const std::string &name,
+                uint8_t file_type);
+  /**
+   * Points the inode at `blocks` (0 for holes), allocating and writing the
+   * indirect blocks needed. Returns the number of indirect blocks.
+   */
+  uint64_t SetBlockPointers(ext2_inode *inode,
+                            const std::vector<uint32_t> &blocks);
+  uint32_t BuildIndirect(const std::vector<uint32_t> &blocks, uint64_t start,
+                         uint32_t depth, uint64_t *indirect_blocks);
+  // SetBlockPointers for extent-mapped images.
+  uint64_t SetExtents(ext2_inode *inode, const std::vector<uint32_t> &blocks);
+  // Writes a non-root extent tree node holding `count` 12-byte entries.
+  uint32_t WriteExtentNode(const void *entries, size_t count, uint16_t depth);
+  ext2_inode NewInode(uint16_t mode, uint64_t size) const;
+  void WriteInode(uint32_t inode_idx, const ext2_inode &inode);
+  void Write(const void *data, size_t len, uint64_t offset);
+
+  int fd_;
+  uint32_t seed_;
+  double fragmentation_;
+  bool extents_;
+  std::mt19937_64 random_;
+  uint32_t block_size_;
+  uint32_t first_data_block_;
+  uint64_t blocks_count_;
+  uint32_t blocks_per_group_;
+  uint32_t group_count_;
+  uint32_t gdt_blocks_;
+  uint32_t inodes_per_group_;
+  uint32_t inode_table_blocks_;
+  bool large_file_{false};
+  bool finished_{false};
+
+  std::vector<uint8_t> used_blocks_;
+  uint64_t free_blocks_{0};
+  uint64_t next_block_;
+  uint32_t next_inode_;
+  std::vector<uint32_t> directories_per_group_;
+  std::vector<Directory> directories_;
+  // Index into directories_ by inode number, -1 for non-directories.
+  std::vector<int64_t> directory_index_;
+};
+
+/**
+ * Parameters of a generated tree. Files are spread over directories holding
+ * at most `fanout` files and `fanout` subdirectories each; sizes follow a
+ * log-uniform distribution between min_file_bytes and max_file_bytes.
+ */
+struct ImageSpec {
+  uint32_t seed{1};
+  uint64_t size_bytes{64 << 20};
+  uint32_t block_size{1024};
+  uint64_t files{1000};
+  uint32_t fanout{32};
+  uint64_t min_file_bytes{0};
+  uint64_t max_file_bytes{64 << 10};
+  double fragmentation{0};
+  // Fractions of the files that are sparse, respectively symlinks.
+  double sparse_fraction{0};
+  double symlink_fraction{0};
+  // Map files with extent trees, as ext4 does.
+  bool extents{false};
+};
+
+// Builds the image described by `spec` at `path`.
+void GenerateImage(const std::string &path, const ImageSpec &spec);
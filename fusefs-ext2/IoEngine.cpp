@@ -0,0 +1,144 @@
+#include "IoEngine.hpp"
+
+#include <mutex>
+#include <system_error>
+#include <vector>
+
+#include <errno.h>
+#include <unistd.h>
+
+#ifdef EXT2_WITH_URING
+#include <liburing.h>
+#endif
+
+size_t IoRequest::length() const {
+  size_t total = 0;
+  for (size_t i = 0; i < iovcnt; ++i) {
+    total += buffers()[i].iov_len;
+  }
+  return total;
+}
+
+namespace {
+
+class PreadEngine : public IoEngine {
+public:
+  explicit PreadEngine(int fd) : fd_(fd) {}
+
+  void Submit(IoRequest *requests, size_t count) override {
+    for (size_t i = 0; i < count; ++i) {
+      IoRequest &request = requests[i];
+      ssize_t result =
+          request.iovcnt == 1
+              ? pread(fd_, request.buffers()[0].iov_base,
+                      request.buffers()[0].iov_len, request.offset)
+              : preadv(fd_, request.buffers(), request.iovcnt, request.offset);
+      request.result = result < 0 ? -errno : result;
+    }
+  }
+
+  const char *Name() const override { return "pread"; }
+
+private:
+  int fd_;
+};
+
+#ifdef EXT2_WITH_URING
+class UringEngine : public IoEngine {
+public:
+  UringEngine(int fd, size_t queue_depth)
+      : fd_(fd), queue_depth_(queue_depth) {
+    // Fail early, so that Create can fall back to pread.
+    Release(Acquire());
+  }
+
+  ~UringEngine() override {
+    for (auto &ring : idle_rings_) {
+      io_uring_queue_exit(ring.get());
+    }
+  }
+
+  void Submit(IoRequest *requests, size_t count) override {
+    std::unique_ptr<io_uring> ring = Acquire();
+    size_t next = 0;
+    size_t in_flight = 0;
+    size_t completed = 0;
+    while (completed < count) {
+      while (next < count && in_flight < queue_depth_) {
+        io_uring_sqe *sqe = io_uring_get_sqe(ring.get());
+        if (sqe == nullptr) {
+          break;
+        }
+        IoRequest &request = requests[next++];
+        io_uring_prep_readv(sqe, fd_, request.buffers(), request.iovcnt,
+                            request.offset);
+        io_uring_sqe_set_data(sqe, &request);
+        in_flight++;
+      }
+      int submitted = io_uring_submit_and_wait(ring.get(), 1);
+      if (submitted < 0 && submitted != -EINTR && submitted != -EAGAIN) {
+        // The ring is in an unknown state, don't hand it out again.
+        io_uring_queue_exit(ring.get());
+        throw std::system_error(-submitted, std::generic_category(),
+                                "io_uring submission failed");
+      }
+      io_uring_cqe *cqe;
+      while (io_uring_peek_cqe(ring.get(), &cqe) == 0) {
+        static_cast<IoRequest *>(io_uring_cqe_get_data(cqe))->result = cqe->res;
+        io_uring_cqe_seen(ring.get(), cqe);
+        in_flight--;
+        completed++;
+      }
+    }
+    Release(std::move(ring));
+  }
+
+  const char *Name() const override { return "io_uring"; }
+
+private:
+  // Every concurrent batch gets a ring of its own.
+  std::unique_ptr<io_uring> Acquire() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!idle_rings_.empty()) {
+        std::unique_ptr<io_uring> ring = std::move(idle_rings_.back());
+        idle_rings_.pop_back();
+        return ring;
+      }
+    }
+    std::unique_ptr<io_uring> ring(new io_uring);
+    int error = io_uring_queue_init(queue_depth_, ring.get(), 0);
+    if (error < 0) {
+      throw std::system_error(-error, std::generic_category(),
+                              "Could not set up io_uring");
+    }
+    return ring;
+  }
+
+  void Release(std::unique_ptr<io_uring> ring) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    idle_rings_.push_back(std::move(ring));
+  }
+
+  int fd_;
+  size_t queue_depth_;
+  std::mutex mutex_;
+  std::vector<std::unique_ptr<io_uring>> idle_rings_;
+};
+#endif
+
+} // namespace
+
+std::unique_ptr<IoEngine> IoEngine::Create(int fd, bool use_io_uring,
+                                           size_t queue_depth) {
+#ifdef EXT2_WITH_URING
+  if (use_io_uring) {
+    try {
+      return std::unique_ptr<IoEngine>(new UringEngine(fd, queue_depth));
+    } catch (const std::system_error &) {
+      // Kernel without io_uring, or it is blocked; plain reads still work.
+    }
+  }
+#endif
+  return std::unique_ptr<IoEngine>(new PreadEngine(fd));
+}
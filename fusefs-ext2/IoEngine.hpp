@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/**
+ * One positional read, either into a single buffer or scattered over
+ * several. After IoEngine::Submit, `result` holds the number of bytes read
+ * or a negated errno value.
+ */
+struct IoRequest {
+  IoRequest(void *buf, size_t len, size_t offset)
+      : single{buf, len}, offset(offset) {}
+  IoRequest(const iovec *iov, size_t iovcnt, size_t offset)
+      : iov(iov), iovcnt(iovcnt), offset(offset) {}
+
+  const iovec *buffers() const { return iov != nullptr ? iov : &single; }
+  size_t length() const;
+
+  const iovec *iov{nullptr};
+  size_t iovcnt{1};
+  iovec single{};
+  size_t offset;
+  ssize_t result{0};
+};
+
+/**
+ * Executes batches of reads against the image. The default engine issues
+ * them one by one with pread/preadv; the io_uring engine, available when
+ * built with EXT2_WITH_URING, keeps up to a queue depth of them in flight
+ * and completes the whole batch with a handful of system calls.
+ *
+ * Engines are safe to use from several threads at once.
+ */
+class IoEngine {
+public:
+  virtual ~IoEngine() = default;
+
+  virtual void Submit(IoRequest *requests, size_t count) = 0;
+  virtual const char *Name() const = 0;
+
+  /**
+   * Returns an io_uring engine if one was asked for and can be set up, the
+   * pread engine otherwise.
+   */
+  static std::unique_ptr<IoEngine> Create(int fd, bool use_io_uring,
+                                          size_t queue_depth);
+};
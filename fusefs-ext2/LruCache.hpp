@@ -0,0 +1,169 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+#include <utility>
+
+struct CacheStats {
+  uint64_t hits{0};
+  uint64_t misses{0};
+  uint64_t evictions{0};
+};
+
+/**
+ * A size-bounded map that evicts the least recently used entry once it holds
+ * more than `capacity` entries. A capacity of zero disables caching entirely.
+ *
+ * Values are handed out by copy, so a value that is a shared pointer stays
+ * alive (pinned) for as long as somebody holds it, even after eviction.
+ */
+template <class Key, class Value, class Hash = std::hash<Key>> class LruCache {
+public:
+  explicit LruCache(size_t capacity = 0) : capacity_(capacity) {}
+
+  std::optional<Value> Get(const Key &key) {
+    auto it = index_.find(key);
+    if (it == index_.end()) {
+      stats_.misses++;
+      return {};
+    }
+    stats_.hits++;
+    entries_.splice(entries_.begin(), entries_, it->second);
+    return it->second->second;
+  }
+
+  // Unlike Get, neither counts towards the stats nor refreshes the entry.
+  bool Contains(const Key &key) const { return index_.count(key) != 0; }
+
+  void Put(const Key &key, Value value) {
+    if (capacity_ == 0) {
+      return;
+    }
+    auto it = index_.find(key);
+    if (it != index_.end()) {
+      it->second->second = std::move(value);
+      entries_.splice(entries_.begin(), entries_, it->second);
+      return;
+    }
+    entries_.emplace_front(key, std::move(value));
+    index_.emplace(key, entries_.begin());
+    if (index_.size() > capacity_) {
+      index_.erase(entries_.back().first);
+      entries_.pop_back();
+      stats_.evictions++;
+    }
+  }
+
+  bool Erase(const Key &key) {
+    auto it = index_.find(key);
+    if (it == index_.end()) {
+      return false;
+    }
+    entries_.erase(it->second);
+    index_.erase(it);
+    return true;
+  }
+
+  size_t size() const { return index_.size(); }
+  size_t capacity() const { return capacity_; }
+  CacheStats stats() const { return stats_; }
+
+private:
+  typedef std::list<std::pair<Key, Value>> EntryList;
+
+  size_t capacity_;
+  EntryList entries_;
+  std::unordered_map<Key, typename EntryList::iterator, Hash> index_;
+  CacheStats stats_;
+};
+
+/**
+ * Thread-safe LruCache: keys are spread over independently locked shards so
+ * that concurrent readers rarely contend on the same mutex. Eviction is LRU
+ * within a shard.
+ */
+template <class Key, class Value, class Hash = std::hash<Key>>
+class ShardedLruCache {
+public:
+  static const size_t kDefaultShards = 16;
+
+  explicit ShardedLruCache(size_t capacity = 0,
+                           size_t shards = kDefaultShards)
+      : capacity_(capacity),
+        shard_count_(std::max<size_t>(1, std::min(shards, capacity))),
+        shards_(new Shard[shard_count_]) {
+    // The first shards take the remainder, so the shards add up to exactly
+    // `capacity` entries.
+    for (size_t i = 0; i < shard_count_; ++i) {
+      shards_[i].cache = LruCache<Key, Value, Hash>(
+          capacity / shard_count_ + (i < capacity % shard_count_));
+    }
+  }
+
+  std::optional<Value> Get(const Key &key) {
+    Shard &shard = ShardFor(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    return shard.cache.Get(key);
+  }
+
+  bool Contains(const Key &key) const {
+    const Shard &shard = ShardFor(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    return shard.cache.Contains(key);
+  }
+
+  void Put(const Key &key, Value value) {
+    Shard &shard = ShardFor(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    shard.cache.Put(key, std::move(value));
+  }
+
+  bool Erase(const Key &key) {
+    Shard &shard = ShardFor(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    return shard.cache.Erase(key);
+  }
+
+  size_t size() const {
+    size_t result = 0;
+    for (size_t i = 0; i < shard_count_; ++i) {
+      std::lock_guard<std::mutex> lock(shards_[i].mutex);
+      result += shards_[i].cache.size();
+    }
+    return result;
+  }
+
+  size_t capacity() const { return capacity_; }
+
+  CacheStats stats() const {
+    CacheStats result;
+    for (size_t i = 0; i < shard_count_; ++i) {
+      std::lock_guard<std::mutex> lock(shards_[i].mutex);
+      CacheStats shard_stats = shards_[i].cache.stats();
+      result.hits += shard_stats.hits;
+      result.misses += shard_stats.misses;
+      result.evictions += shard_stats.evictions;
+    }
+    return result;
+  }
+
+private:
+  struct Shard {
+    mutable std::mutex mutex;
+    LruCache<Key, Value, Hash> cache;
+  };
+
+  Shard &ShardFor(const Key &key) const {
+    return shards_[Hash()(key) % shard_count_];
+  }
+
+  size_t capacity_;
+  size_t shard_count_;
+  std::unique_ptr<Shard[]> shards_;
+};
@@ -0,0 +1,257 @@
+#include "MetadataSnapshot.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <system_error>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+const char kMagic[8] = {'E', 'X', 'T', '2', 'S', 'N', 'A', 'P'};
+// Bumped whenever the layout of the file or of a record changes.
+const uint32_t kVersion = 1;
+
+struct SnapshotHeader {
+  char magic[8];
+  uint32_t version;
+  // Identify the image, and its state, the snapshot was taken of.
+  uint32_t wtime;
+  uint8_t uuid[16];
+  uint32_t inodes_count;
+  uint32_t log_block_size;
+  // Sections, each at an offset aligned to 8 bytes.
+  uint64_t inodes_offset;
+  uint64_t inode_count;
+  uint64_t entries_offset;
+  uint64_t entry_count;
+  uint64_t runs_offset;
+  uint64_t run_count;
+  uint64_t names_offset;
+  uint64_t names_size;
+};
+
+uint64_t Align(uint64_t offset) {
+  return (offset + 7) & ~uint64_t(7);
+}
+
+// Whether `count` records of `size` bytes at `offset` fit in `file_size`.
+bool Fits(uint64_t offset, uint64_t count, uint64_t size, uint64_t file_size) {
+  return offset % 8 == 0 && offset <= file_size &&
+         count <= (file_size - offset) / size;
+}
+
+void WriteAll(int fd, const void *data, size_t len, uint64_t offset,
+              const std::string &path) {
+  const char *bytes = static_cast<const char *>(data);
+  while (len > 0) {
+    ssize_t written = pwrite(fd, bytes, len, offset);
+    if (written < 0) {
+      char error_msg[1024];
+      snprintf(error_msg, sizeof(error_msg), "Could not write %s",
+               path.c_str());
+      throw std::system_error(errno, std::generic_category(), error_msg);
+    }
+    bytes += written;
+    len -= written;
+    offset += written;
+  }
+}
+
+} // namespace
+
+MetadataSnapshot::~MetadataSnapshot() {
+  if (mapping_ != nullptr) {
+    munmap(const_cast<char *>(mapping_), mapping_size_);
+  }
+}
+
+void MetadataSnapshot::Write(const std::string &path,
+                             const ext2_super_block &sb,
+                             const Contents &contents) {
+  SnapshotHeader header = {};
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kVersion;
+  header.wtime = sb.s_wtime;
+  memcpy(header.uuid, sb.s_uuid, sizeof(header.uuid));
+  header.inodes_count = sb.s_inodes_count;
+  header.log_block_size = sb.s_log_block_size;
+  header.inodes_offset = Align(sizeof(header));
+  header.inode_count = contents.inodes.size();
+  header.entries_offset = Align(header.inodes_offset +
+                                header.inode_count * sizeof(SnapshotInode));
+  header.entry_count = contents.entries.size();
+  header.runs_offset = Align(header.entries_offset +
+                             header.entry_count * sizeof(SnapshotEntry));
+  header.run_count = contents.runs.size();
+  header.names_offset =
+      Align(header.runs_offset + header.run_count * sizeof(SnapshotRun));
+  header.names_size = contents.names.size();
+
+  // A file of its own next to the snapshot, so that mounts writing the
+  // same snapshot at once never write into each other's files.
+  std::string temporary = path + ".XXXXXX";
+  int fd = mkstemp(&temporary[0]);
+  if (fd < 0) {
+    char error_msg[1024];
+    snprintf(error_msg, sizeof(error_msg), "Could not create %s",
+             temporary.c_str());
+    throw std::system_error(errno, std::generic_category(), error_msg);
+  }
+  try {
+    // mkstemp leaves the file private to us, snapshots are for everyone.
+    if (fchmod(fd, 0644) < 0) {
+      throw std::system_error(errno, std::generic_category(), temporary);
+    }
+    WriteAll(fd, contents.inodes.data(),
+             header.inode_count * sizeof(SnapshotInode), header.inodes_offset,
+             temporary);
+    WriteAll(fd, contents.entries.data(),
+             header.entry_count * sizeof(SnapshotEntry), header.entries_offset,
+             temporary);
+    WriteAll(fd, contents.runs.data(), header.run_count * sizeof(SnapshotRun),
+             header.runs_offset, temporary);
+    WriteAll(fd, contents.names.data(), header.names_size, header.names_offset,
+             temporary);
+    // The header goes last, so a file cut short is never taken as whole.
+    WriteAll(fd, &header, sizeof(header), 0, temporary);
+    if (fsync(fd) < 0 || close(fd) < 0) {
+      fd = -1;
+      throw std::system_error(errno, std::generic_category(), temporary);
+    }
+    fd = -1;
+    if (rename(temporary.c_str(), path.c_str()) < 0) {
+      throw std::system_error(errno, std::generic_category(), path);
+    }
+  } catch (...) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    unlink(temporary.c_str());
+    throw;
+  }
+}
+
+std::unique_ptr<MetadataSnapshot> MetadataSnapshot::Open(
+    const std::string &path, const ext2_super_block &sb) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return nullptr;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0 ||
+      static_cast<size_t>(st.st_size) < sizeof(SnapshotHeader)) {
+    close(fd);
+    return nullptr;
+  }
+  void *mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    return nullptr;
+  }
+  std::unique_ptr<MetadataSnapshot> snapshot(new MetadataSnapshot());
+  snapshot->mapping_ = static_cast<const char *>(mapping);
+  snapshot->mapping_size_ = st.st_size;
+
+  const SnapshotHeader &header =
+      *reinterpret_cast<const SnapshotHeader *>(snapshot->mapping_);
+  uint64_t size = snapshot->mapping_size_;
+  if (memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 ||
+      header.version != kVersion || header.wtime != sb.s_wtime ||
+      memcmp(header.uuid, sb.s_uuid, sizeof(header.uuid)) != 0 ||
+      header.inodes_count != sb.s_inodes_count ||
+      header.log_block_size != sb.s_log_block_size ||
+      !Fits(header.inodes_offset, header.inode_count, sizeof(SnapshotInode),
+            size) ||
+      !Fits(header.entries_offset, header.entry_count, sizeof(SnapshotEntry),
+            size) ||
+      !Fits(header.runs_offset, header.run_count, sizeof(SnapshotRun), size) ||
+      !Fits(header.names_offset, header.names_size, 1, size)) {
+    return nullptr;
+  }
+  snapshot->inodes_ = reinterpret_cast<const SnapshotInode *>(
+      snapshot->mapping_ + header.inodes_offset);
+  snapshot->inode_count_ = header.inode_count;
+  snapshot->entries_ = reinterpret_cast<const SnapshotEntry *>(
+      snapshot->mapping_ + header.entries_offset);
+  snapshot->entry_count_ = header.entry_count;
+  snapshot->runs_ = reinterpret_cast<const SnapshotRun *>(
+      snapshot->mapping_ + header.runs_offset);
+  snapshot->run_count_ = header.run_count;
+  snapshot->names_ = snapshot->mapping_ + header.names_offset;
+  snapshot->names_size_ = header.names_size;
+  return snapshot;
+}
+
+const SnapshotInode *MetadataSnapshot::Find(size_t inode_idx) const {
+  const SnapshotInode *end = inodes_ + inode_count_;
+  const SnapshotInode *record = std::lower_bound(
+      inodes_, end, inode_idx, [](const SnapshotInode &record, size_t idx) {
+        return record.inode_idx < idx;
+      });
+  if (record == end || record->inode_idx != inode_idx) {
+    return nullptr;
+  }
+  return record;
+}
+
+const ext2_inode *MetadataSnapshot::Inode(size_t inode_idx) const {
+  const SnapshotInode *record = Find(inode_idx);
+  return record != nullptr ? &record->inode : nullptr;
+}
+
+std::optional<size_t> MetadataSnapshot::Lookup(size_t dir_inode,
+                                               std::string_view name) const {
+  const SnapshotInode *dir = Find(dir_inode);
+  // Records are checked as they are used; a damaged one is no answer at all.
+  if (dir == nullptr || !S_ISDIR(dir->inode.i_mode) ||
+      dir->first_entry > entry_count_ ||
+      dir->entry_count > entry_count_ - dir->first_entry) {
+    return {};
+  }
+  bool damaged = false;
+  auto entry_name = [this, &damaged](const SnapshotEntry &entry) {
+    if (entry.name_offset > names_size_ ||
+        entry.name_len > names_size_ - entry.name_offset) {
+      damaged = true;
+      return std::string_view();
+    }
+    return std::string_view(names_ + entry.name_offset, entry.name_len);
+  };
+  const SnapshotEntry *begin = entries_ + dir->first_entry;
+  const SnapshotEntry *end = begin + dir->entry_count;
+  const SnapshotEntry *entry = std::lower_bound(
+      begin, end, name,
+      [&entry_name](const SnapshotEntry &entry, std::string_view name) {
+        return entry_name(entry) < name;
+      });
+  if (entry == end || entry_name(*entry) != name) {
+    if (damaged) {
+      return {};
+    }
+    return 0;
+  }
+  return entry->inode_idx;
+}
+
+std::shared_ptr<const BlockMap> MetadataSnapshot::Map(size_t inode_idx) const {
+  const SnapshotInode *record = Find(inode_idx);
+  if (record == nullptr || !record->has_runs ||
+      record->first_run > run_count_ ||
+      record->run_count > run_count_ - record->first_run) {
+    return nullptr;
+  }
+  auto map = std::make_shared<BlockMap>();
+  map->reserve(record->run_count);
+  for (size_t i = 0; i < record->run_count; ++i) {
+    const SnapshotRun &run = runs_[record->first_run + i];
+    map->push_back({run.file_block, run.image_block, run.length});
+  }
+  return map;
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <ext2fs/ext2_fs.h>
+
+#include "Ext2Driver.hpp"
+
+// Records of a snapshot file, stored as they are in memory.
+struct SnapshotInode {
+  uint32_t inode_idx;
+  // Directories: entries [first_entry, first_entry + entry_count), sorted
+  // by name.
+  uint32_t entry_count;
+  // Files, directories and slow symlinks: the block map is runs
+  // [first_run, first_run + run_count). Others have no map.
+  uint32_t run_count;
+  uint32_t has_runs;
+  uint64_t first_entry;
+  uint64_t first_run;
+  ext2_inode inode;
+};
+
+struct SnapshotEntry {
+  uint64_t name_offset;
+  uint32_t inode_idx;
+  uint16_t name_len;
+  uint16_t padding;
+};
+
+struct SnapshotRun {
+  uint64_t file_block;
+  uint64_t image_block;
+  uint64_t length;
+};
+
+/**
+ * A read-only index of an image's metadata kept in a sidecar file: every
+ * allocated inode, the entries of every directory and the block map of every
+ * file. Opening one maps it, so lookups, inodes and block maps cost a binary
+ * search in memory the kernel pages in on demand, and nothing of the image
+ * but the data itself is read.
+ *
+ * A snapshot records the superblock's write time and UUID. Open refuses one
+ * taken of another image, or of this image before it was last written to.
+ */
+class MetadataSnapshot {
+public:
+  struct Contents {
+    // Sorted by inode number.
+    std::vector<SnapshotInode> inodes;
+    std::vector<SnapshotEntry> entries;
+    std::vector<SnapshotRun> runs;
+    std::string names;
+  };
+
+  ~MetadataSnapshot();
+
+  MetadataSnapshot(const MetadataSnapshot &) = delete;
+  MetadataSnapshot &operator=(const MetadataSnapshot &) = delete;
+
+  /**
+   * Writes a snapshot of the image with superblock `sb` to `path`. It goes
+   * to a uniquely named temporary file first and is renamed into place, so
+   * readers never see half of one, nor concurrent writers each other's.
+   */
+  static void Write(const std::string &path, const ext2_super_block &sb,
+                    const Contents &contents);
+  /**
+   * Maps the snapshot at `path`. Returns nullptr if there is none, it is
+   * damaged or it does not match the image with superblock `sb`.
+   */
+  static std::unique_ptr<MetadataSnapshot> Open(const std::string &path,
+                                                const ext2_super_block &sb);
+
+  // The inode, nullptr if it is not allocated.
+  const ext2_inode *Inode(size_t inode_idx) const;
+  /**
+   * The inode a name of a directory refers to, 0 if the directory has no
+   * such name. Returns nullopt if the snapshot has no usable record of the
+   * directory, in which case the image has the answer.
+   */
+  std::optional<size_t> Lookup(size_t dir_inode, std::string_view name) const;
+  // The block map of an inode, nullptr if the snapshot has none for it.
+  std::shared_ptr<const BlockMap> Map(size_t inode_idx) const;
+
+private:
+  MetadataSnapshot() = default;
+
+  const SnapshotInode *Find(size_t inode_idx) const;
+
+  const char *mapping_{nullptr};
+  size_t mapping_size_{0};
+  const SnapshotInode *inodes_{nullptr};
+  size_t inode_count_{0};
+  const SnapshotEntry *entries_{nullptr};
+  size_t entry_count_{0};
+  const SnapshotRun *runs_{nullptr};
+  size_t run_count_{0};
+  const char *names_{nullptr};
+  size_t names_size_{0};
+};
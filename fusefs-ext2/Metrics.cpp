@@ -0,0 +1,183 @@
+#include "Metrics.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <utility>
+
+const size_t kCounterCount = static_cast<size_t>(Counter::kCount);
+const size_t kOpCount = static_cast<size_t>(Op::kCount);
+
+struct MetricsShard {
+  struct OpSlot {
+    std::atomic<uint64_t> calls{0};
+    std::atomic<uint64_t> errors{0};
+    std::atomic<uint64_t> total_ns{0};
+    std::atomic<uint64_t> buckets[Metrics::kLatencyBuckets]{};
+  };
+
+  // Cleared when the owning thread exits, so another thread can take over.
+  std::atomic<bool> in_use{true};
+  std::atomic<uint64_t> counters[kCounterCount]{};
+  OpSlot ops[kOpCount];
+};
+
+namespace {
+
+std::atomic<uint64_t> next_metrics_id{1};
+
+// Only the owning thread writes a shard, so there is no need for an atomic
+// read-modify-write; the atomics only make the concurrent reads well-defined.
+void Bump(std::atomic<uint64_t> &value, uint64_t amount) {
+  value.store(value.load(std::memory_order_relaxed) + amount,
+              std::memory_order_relaxed);
+}
+
+struct LocalShards {
+  ~LocalShards() {
+    for (auto &entry : shards) {
+      entry.second->in_use.store(false, std::memory_order_release);
+    }
+  }
+
+  // Shards of this thread by Metrics id.
+  std::vector<std::pair<uint64_t, std::shared_ptr<MetricsShard>>> shards;
+};
+
+thread_local LocalShards local_shards;
+
+} // namespace
+
+uint64_t Metrics::OpStats::PercentileNs(double fraction) const {
+  uint64_t rank = fraction * calls;
+  uint64_t seen = 0;
+  for (size_t i = 0; i < kLatencyBuckets; ++i) {
+    seen += buckets[i];
+    if (seen > rank) {
+      return uint64_t(1) << i;
+    }
+  }
+  return calls == 0 ? 0 : uint64_t(1) << (kLatencyBuckets - 1);
+}
+
+Metrics::Metrics() : id_(next_metrics_id++) {}
+
+Metrics::~Metrics() = default;
+
+void Metrics::Add(Counter counter, uint64_t value) {
+  Bump(LocalShard().counters[static_cast<size_t>(counter)], value);
+}
+
+void Metrics::Record(Op op, uint64_t nanoseconds, bool failed) {
+  MetricsShard::OpSlot &slot = LocalShard().ops[static_cast<size_t>(op)];
+  Bump(slot.calls, 1);
+  if (failed) {
+    Bump(slot.errors, 1);
+  }
+  Bump(slot.total_ns, nanoseconds);
+  size_t bucket =
+      nanoseconds == 0 ? 0 : 64 - __builtin_clzll(nanoseconds);
+  Bump(slot.buckets[std::min(bucket, kLatencyBuckets - 1)], 1);
+}
+
+uint64_t Metrics::Get(Counter counter) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  uint64_t total = 0;
+  for (const auto &shard : shards_) {
+    total += shard->counters[static_cast<size_t>(counter)].load(
+        std::memory_order_relaxed);
+  }
+  return total;
+}
+
+Metrics::OpStats Metrics::Get(Op op) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  OpStats stats;
+  for (const auto &shard : shards_) {
+    const MetricsShard::OpSlot &slot = shard->ops[static_cast<size_t>(op)];
+    stats.calls += slot.calls.load(std::memory_order_relaxed);
+    stats.errors += slot.errors.load(std::memory_order_relaxed);
+    stats.total_ns += slot.total_ns.load(std::memory_order_relaxed);
+    for (size_t i = 0; i < kLatencyBuckets; ++i) {
+      stats.buckets[i] += slot.buckets[i].load(std::memory_order_relaxed);
+    }
+  }
+  return stats;
+}
+
+const char *Metrics::Name(Counter counter) {
+  switch (counter) {
+  case Counter::kReadBlockCalls:
+    return "read_block_calls";
+  case Counter::kImageReads:
+    return "image_reads";
+  case Counter::kImageBytesRead:
+    return "image_bytes_read";
+  case Counter::kInodeFetches:
+    return "inode_fetches";
+  case Counter::kBytesRead:
+    return "bytes_read";
+  case Counter::kSnapshotHits:
+    return "snapshot_hits";
+  case Counter::kSnapshotWriteErrors:
+    return "snapshot_write_errors";
+  case Counter::kCount:
+    break;
+  }
+  return "unknown";
+}
+
+const char *Metrics::Name(Op op) {
+  switch (op) {
+  case Op::kLookup:
+    return "lookup";
+  case Op::kGetattr:
+    return "getattr";
+  case Op::kOpen:
+    return "open";
+  case Op::kOpendir:
+    return "opendir";
+  case Op::kRead:
+    return "read";
+  case Op::kReaddir:
+    return "readdir";
+  case Op::kReadlink:
+    return "readlink";
+  case Op::kCount:
+    break;
+  }
+  return "unknown";
+}
+
+MetricsShard &Metrics::LocalShard() {
+  for (const auto &entry : local_shards.shards) {
+    if (entry.first == id_) {
+      return *entry.second;
+    }
+  }
+  // First use from this thread: forget shards of Metrics that are gone and
+  // take over a shard left behind by an exited thread, or add one.
+  auto &shards = local_shards.shards;
+  shards.erase(std::remove_if(shards.begin(), shards.end(),
+                              [](const auto &entry) {
+                                return entry.second.use_count() == 1;
+                              }),
+               shards.end());
+  std::shared_ptr<MetricsShard> shard;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto &candidate : shards_) {
+      bool in_use = false;
+      if (candidate->in_use.compare_exchange_strong(
+              in_use, true, std::memory_order_acquire)) {
+        shard = candidate;
+        break;
+      }
+    }
+    if (!shard) {
+      shard = std::make_shared<MetricsShard>();
+      shards_.push_back(shard);
+    }
+  }
+  shards.emplace_back(id_, shard);
+  return *shard;
+}
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Driver operations whose calls, failures and latencies are tracked.
+enum class Op {
+  kLookup,
+  kGetattr,
+  kOpen,
+  kOpendir,
+  kRead,
+  kReaddir,
+  kReadlink,
+  kCount,
+};
+
+// Internal costs, counted wherever they are incurred.
+enum class Counter {
+  kReadBlockCalls,
+  // Reads of the image (or accesses to its mapping) and the bytes they got.
+  kImageReads,
+  kImageBytesRead,
+  // Inodes read from the inode table, i.e. inode cache misses.
+  kInodeFetches,
+  // Bytes handed out by Read.
+  kBytesRead,
+  // Inodes, names and block maps found in the metadata snapshot.
+  kSnapshotHits,
+  // Snapshots that could not be written.
+  kSnapshotWriteErrors,
+  kCount,
+};
+
+struct MetricsShard;
+
+/**
+ * Counters and latency histograms cheap enough to always keep on. Every
+ * thread updates a shard of its own with plain relaxed stores, so recording
+ * neither locks nor shares cache lines; reading merges all shards. A shard
+ * outlives its thread and is handed to the next new thread, so totals never
+ * go down and the number of shards stays bounded by the number of threads
+ * alive at once.
+ */
+class Metrics {
+public:
+  // Latencies are bucketed by powers of two of nanoseconds: bucket i holds
+  // those below 2^i ns and at least 2^(i-1) ns.
+  static const size_t kLatencyBuckets = 40;
+
+  struct OpStats {
+    uint64_t calls{0};
+    uint64_t errors{0};
+    uint64_t total_ns{0};
+    uint64_t buckets[kLatencyBuckets]{};
+
+    // Upper bound of the bucket holding the given fraction of the calls.
+    uint64_t PercentileNs(double fraction) const;
+  };
+
+  Metrics();
+  ~Metrics();
+
+  Metrics(const Metrics &) = delete;
+  Metrics &operator=(const Metrics &) = delete;
+
+  void Add(Counter counter, uint64_t value = 1);
+  void Record(Op op, uint64_t nanoseconds, bool failed);
+
+  uint64_t Get(Counter counter) const;
+  OpStats Get(Op op) const;
+
+  static const char *Name(Counter counter);
+  static const char *Name(Op op);
+
+private:
+  MetricsShard &LocalShard();
+
+  // Tells apart instances that reuse an address, for the thread-local
+  // shard lookup.
+  uint64_t id_;
+  mutable std::mutex mutex_;
+  std::vector<std::shared_ptr<MetricsShard>> shards_;
+};
+
+// Records one call of `op`, from construction to destruction. A call left
+// through an exception counts as failed.
+class OpTimer {
+public:
+  OpTimer(Metrics &metrics, Op op)
+      : metrics_(metrics), op_(op), exceptions_(std::uncaught_exceptions()),
+        start_(std::chrono::steady_clock::now()) {}
+
+  ~OpTimer() {
+    auto elapsed = std::chrono::steady_clock::now() - start_;
+    metrics_.Record(
+        op_, std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count(),
+        std::uncaught_exceptions() > exceptions_);
+  }
+
+  OpTimer(const OpTimer &) = delete;
+  OpTimer &operator=(const OpTimer &) = delete;
+
+private:
+  Metrics &metrics_;
+  Op op_;
+  int exceptions_;
+  std::chrono::steady_clock::time_point start_;
+};
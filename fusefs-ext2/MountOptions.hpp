@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdlib>
+
+#include <fuse_opt.h>
+
+#include "Ext2Driver.hpp"
+
+/**
+ * Driver options accepted on top of the usual FUSE ones, by both frontends:
+ *   -o mmap               serve the image out of a read-only mapping
+ *   -o block_cache=BYTES  size of the shared block cache
+ *   -o io_uring           batch block reads through io_uring (URING=1 builds)
+ *   -o snapshot=PATH      answer metadata from a snapshot kept at PATH
+ *   -o snapshot_write     write that snapshot first if it is missing or stale
+ */
+struct MountOptions {
+  int use_mmap;
+  unsigned long block_cache_bytes;
+  int use_io_uring;
+  char *snapshot_path;
+  int write_snapshot;
+};
+
+const struct fuse_opt kMountOptions[] = {
+    {"mmap", offsetof(MountOptions, use_mmap), 1},
+    {"block_cache=%lu", offsetof(MountOptions, block_cache_bytes), 0},
+    {"io_uring", offsetof(MountOptions, use_io_uring), 1},
+    {"snapshot=%s", offsetof(MountOptions, snapshot_path), 0},
+    {"snapshot_write", offsetof(MountOptions, write_snapshot), 1},
+    FUSE_OPT_END,
+};
+
+// Strips the driver options from `args` into `options`.
+inline bool ParseMountOptions(struct fuse_args *args, DriverOptions *options) {
+  MountOptions mount_options = {0, options->block_cache_bytes, 0, NULL, 0};
+  if (fuse_opt_parse(args, &mount_options, kMountOptions, NULL) == -1) {
+    return false;
+  }
+  options->use_mmap = mount_options.use_mmap;
+  options->block_cache_bytes = mount_options.block_cache_bytes;
+  options->use_io_uring = mount_options.use_io_uring;
+  options->write_snapshot = mount_options.write_snapshot;
+  if (mount_options.snapshot_path != NULL) {
+    options->snapshot_path = mount_options.snapshot_path;
+    free(mount_options.snapshot_path);
+  }
+  return true;
+}
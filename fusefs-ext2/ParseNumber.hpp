@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cctype>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+
+/**
+ * Parses a command line count or size for the tools. Numbers take a K, M or
+ * G suffix (powers of 1024). Returns false for anything but a plain
+ * non-negative number, or one above `max`.
+ */
+inline bool ParseNumber(const char *value, uint64_t *number,
+                        uint64_t max = UINT64_MAX) {
+  // strtoull would take a sign and wrap a negative number around.
+  if (!isdigit(static_cast<unsigned char>(value[0]))) {
+    return false;
+  }
+  char *end;
+  errno = 0;
+  *number = strtoull(value, &end, 10);
+  if (errno == ERANGE) {
+    return false;
+  }
+  int shift = 0;
+  switch (*end) {
+  case 'G':
+    shift += 10;
+    [[fallthrough]];
+  case 'M':
+    shift += 10;
+    [[fallthrough]];
+  case 'K':
+    shift += 10;
+    ++end;
+    break;
+  }
+  if (*end != '\0' || *number > (max >> shift)) {
+    return false;
+  }
+  *number <<= shift;
+  return true;
+}
@@ -0,0 +1,53 @@
+#include "ThreadPool.hpp"
+
+ThreadPool::ThreadPool(size_t threads) : thread_count_(threads) {}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+    tasks_.clear();
+  }
+  task_available_.notify_all();
+  for (auto &thread : threads_) {
+    thread.join();
+  }
+}
+
+void ThreadPool::Submit(std::function<void()> task) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    tasks_.push_back(std::move(task));
+    if (threads_.empty()) {
+      for (size_t i = 0; i < thread_count_; ++i) {
+        threads_.emplace_back(&ThreadPool::Worker, this);
+      }
+    }
+  }
+  task_available_.notify_one();
+}
+
+void ThreadPool::Wait() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  idle_.wait(lock, [this] { return tasks_.empty() && running_ == 0; });
+}
+
+void ThreadPool::Worker() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    task_available_.wait(lock, [this] { return stopping_ || !tasks_.empty(); });
+    if (stopping_) {
+      return;
+    }
+    std::function<void()> task = std::move(tasks_.front());
+    tasks_.pop_front();
+    running_++;
+    lock.unlock();
+    task();
+    lock.lock();
+    running_--;
+    if (tasks_.empty() && running_ == 0) {
+      idle_.notify_all();
+    }
+  }
+}
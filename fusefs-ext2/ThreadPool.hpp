@@ -0,0 +1,42 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * A fixed set of worker threads running submitted tasks in FIFO order.
+ * Tasks must not throw. Destroying the pool drops tasks that have not
+ * started yet and waits for the running ones.
+ *
+ * The workers are only started by the first Submit, so a pool created before
+ * the process daemonizes (forks) still has its threads afterwards.
+ */
+class ThreadPool {
+public:
+  explicit ThreadPool(size_t threads);
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  void Submit(std::function<void()> task);
+  // Blocks until the queue is empty and no task is running.
+  void Wait();
+
+private:
+  void Worker();
+
+  std::mutex mutex_;
+  std::condition_variable task_available_;
+  std::condition_variable idle_;
+  std::deque<std::function<void()>> tasks_;
+  size_t thread_count_;
+  size_t running_{0};
+  bool stopping_{false};
+  std::vector<std::thread> threads_;
+};
@@ -0,0 +1,254 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <random>
+#include <string>
+#include <system_error>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Ext2Driver.hpp"
+#include "ImageBuilder.hpp"
+
+/**
+ * Read-path benchmarks driving Ext2Driver directly, without FUSE.
+ *
+ * For every block size a deterministic image is generated from a fixed seed
+ * with ImageBuilder. Each scenario then runs against a fresh driver and
+ * prints one JSON object per line with latency percentiles in microseconds
+ * and the throughput, so runs can be diffed and tracked.
+ * The image is freshly written, so it is mostly in the page cache: the
+ * numbers measure the driver, not the disk.
+ *
+ * Usage: build_bench [work_dir]
+ */
+
+const uint32_t kSeed = 20240601;
+const uint64_t kImageBytes = 160 << 20;
+const size_t kLargeFileBytes = 64 << 20;
+const size_t kSequentialChunk = 128 << 10;
+const size_t kRandomReads = 20000;
+const size_t kRandomReadBytes = 4096;
+const size_t kPathDepth = 8;
+const size_t kGetattrCalls = 200000;
+const size_t kNegativeLookups = 200000;
+const size_t kHugeDirEntries = 50000;
+const size_t kReaddirPage = 128;
+
+struct Result {
+  std::string scenario;
+  std::vector<double> latencies_us;
+  double seconds{0};
+  double amount{0};
+  const char *unit{"ops/s"};
+};
+
+void Fail(const char *what) {
+  throw std::system_error(errno, std::generic_category(), what);
+}
+
+// Returns the path of the deep file.
+std::string BuildImage(const std::string &image, int block_size) {
+  ImageBuilder builder(image, kImageBytes, block_size, kHugeDirEntries + 1024,
+                       kSeed);
+  builder.AddFile(ImageBuilder::kRootInode, "large", kLargeFileBytes);
+  std::string deep;
+  uint32_t dir = ImageBuilder::kRootInode;
+  for (size_t level = 0; level < kPathDepth; ++level) {
+    std::string name = "d" + std::to_string(level);
+    deep += "/" + name;
+    dir = builder.AddDirectory(dir, name);
+    // Some siblings, so that every level needs a real directory search.
+    for (int sibling = 0; sibling < 16; ++sibling) {
+      builder.AddFile(dir, "f" + std::to_string(sibling), 0);
+    }
+  }
+  builder.AddFile(dir, "leaf", 4096);
+  deep += "/leaf";
+  uint32_t huge = builder.AddDirectory(ImageBuilder::kRootInode, "huge");
+  for (size_t i = 0; i < kHugeDirEntries; ++i) {
+    builder.AddFile(huge, "entry_" + std::to_string(i), 0);
+  }
+  builder.Finish();
+  return deep;
+}
+
+template <class Op> Result Measure(const std::string &scenario, size_t ops, Op op) {
+  Result result;
+  result.scenario = scenario;
+  result.latencies_us.reserve(ops);
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < ops; ++i) {
+    auto op_start = std::chrono::steady_clock::now();
+    result.amount += op(i);
+    result.latencies_us.push_back(std::chrono::duration<double, std::micro>(
+                                      std::chrono::steady_clock::now() - op_start)
+                                      .count());
+  }
+  result.seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+  return result;
+}
+
+double Percentile(const std::vector<double> &sorted, double fraction) {
+  if (sorted.empty()) {
+    return 0;
+  }
+  return sorted[std::min(sorted.size() - 1,
+                         static_cast<size_t>(fraction * sorted.size()))];
+}
+
+void Report(int block_size, Result result) {
+  std::sort(result.latencies_us.begin(), result.latencies_us.end());
+  printf("{\"block_size\": %d, \"scenario\": \"%s\", \"ops\": %zu, "
+         "\"p50_us\": %.2f, \"p90_us\": %.2f, \"p99_us\": %.2f, "
+         "\"max_us\": %.2f, \"throughput\": %.2f, \"unit\": \"%s\"}\n",
+         block_size, result.scenario.c_str(), result.latencies_us.size(),
+         Percentile(result.latencies_us, 0.5),
+         Percentile(result.latencies_us, 0.9),
+         Percentile(result.latencies_us, 0.99),
+         result.latencies_us.empty() ? 0 : result.latencies_us.back(),
+         result.amount / result.seconds, result.unit);
+  fflush(stdout);
+}
+
+void RunScenarios(const std::string &image, const std::string &deep_path,
+                  int block_size) {
+  std::vector<char> buf(std::max(kSequentialChunk, kRandomReadBytes));
+  {
+    Ext2Driver driver(image);
+    driver.Initialize();
+    uint64_t fd = driver.Open("/large");
+    Result result = Measure("sequential_read", kLargeFileBytes / kSequentialChunk,
+                            [&](size_t i) {
+                              return driver.Read(fd, buf.data(), kSequentialChunk,
+                                                 i * kSequentialChunk) /
+                                     double(1 << 20);
+                            });
+    result.unit = "MiB/s";
+    Report(block_size, std::move(result));
+    driver.Close(fd);
+  }
+  {
+    Ext2Driver driver(image);
+    driver.Initialize();
+    uint64_t fd = driver.Open("/large");
+    std::mt19937_64 random(kSeed);
+    size_t slots = kLargeFileBytes / kRandomReadBytes;
+    Result result = Measure("random_read_4k", kRandomReads, [&](size_t) {
+      return driver.Read(fd, buf.data(), kRandomReadBytes,
+                         (random() % slots) * kRandomReadBytes) /
+             double(1 << 20);
+    });
+    result.unit = "MiB/s";
+    Report(block_size, std::move(result));
+    driver.Close(fd);
+  }
+  {
+    Ext2Driver driver(image);
+    driver.Initialize();
+    struct stat st;
+    Report(block_size, Measure("getattr_deep_path", kGetattrCalls, [&](size_t) {
+             driver.Getattr(deep_path.c_str(), &st);
+             return 1;
+           }));
+  }
+  {
+    Ext2Driver driver(image);
+    driver.Initialize();
+    struct stat st;
+    std::vector<std::string> missing;
+    for (size_t i = 0; i < 1024; ++i) {
+      missing.push_back("/d0/missing_" + std::to_string(i));
+    }
+    Report(block_size, Measure("negative_lookup", kNegativeLookups, [&](size_t i) {
+             try {
+               driver.Getattr(missing[i % missing.size()].c_str(), &st);
+             } catch (const std::system_error &) {
+             }
+             return 1;
+           }));
+  }
+  for (bool plus : {false, true}) {
+    Ext2Driver driver(image);
+    driver.Initialize();
+    uint64_t fd = driver.Opendir("/huge");
+    uint64_t cookie = 0;
+    bool done = false;
+    Result result;
+    // One op is one page of entries, throughput is in entries.
+    while (!done) {
+      Result page = Measure(plus ? "readdirplus_huge_dir" : "readdir_huge_dir",
+                            1, [&](size_t) {
+                              size_t taken = 0;
+                              driver.Readdir(fd, cookie, [&](const DirEntry &entry) {
+                                if (taken == kReaddirPage) {
+                                  return false;
+                                }
+                                cookie = entry.next;
+                                taken++;
+                                return true;
+                              }, plus);
+                              done = taken < kReaddirPage;
+                              return taken;
+                            });
+      result.scenario = page.scenario;
+      // A listing of whole pages ends with an empty one, which is no op.
+      if (page.amount == 0) {
+        break;
+      }
+      result.latencies_us.push_back(page.latencies_us[0]);
+      result.seconds += page.seconds;
+      result.amount += page.amount;
+    }
+    result.unit = "entries/s";
+    Report(block_size, std::move(result));
+    driver.Releasedir(fd);
+  }
+  for (size_t threads : {1, 4}) {
+    Ext2Driver driver(image);
+    driver.Initialize();
+    std::unordered_map<size_t, size_t> parents;
+    // One op is a whole scan with the parent map, throughput is in inodes.
+    Result result = Measure("inode_scan_" + std::to_string(threads) + "t", 1,
+                            [&](size_t) {
+                              std::atomic<size_t> inodes{0};
+                              driver.ScanInodes(
+                                  [&](size_t, const ext2_inode &) { inodes++; },
+                                  threads, &parents);
+                              return inodes.load();
+                            });
+    result.unit = "inodes/s";
+    Report(block_size, std::move(result));
+  }
+}
+
+int main(int argc, char **argv) {
+  std::string work_dir = argc > 1 ? argv[1] : "";
+  bool own_work_dir = work_dir.empty();
+  if (own_work_dir) {
+    char templ[] = "/tmp/ext2_bench_XXXXXX";
+    if (mkdtemp(templ) == nullptr) {
+      Fail("Could not create work directory");
+    }
+    work_dir = templ;
+  }
+  for (int block_size : {1024, 2048, 4096}) {
+    std::string image = work_dir + "/bench_" + std::to_string(block_size) + ".img";
+    std::string deep_path = BuildImage(image, block_size);
+    RunScenarios(image, deep_path, block_size);
+    unlink(image.c_str());
+  }
+  if (own_work_dir) {
+    rmdir(work_dir.c_str());
+  }
+}
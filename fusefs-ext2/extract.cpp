@@ -0,0 +1,102 @@
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <string>
+
+#include "Ext2Driver.hpp"
+#include "Extractor.hpp"
+#include "ParseNumber.hpp"
+
+/**
+ * Extracts an image, or a directory of it, to a host directory without
+ * mounting it, see Extract for how. --preserve stands for --modes --times
+ * --symlinks.
+ *
+ * Usage: extract <image> <destination> [--subtree=PATH] [--threads=N]
+ *          [--chunk-size=BYTES] [--modes] [--times] [--symlinks]
+ *          [--preserve]
+ */
+
+const char kUsage[] =
+    "Usage: extract <image> <destination> [--subtree=PATH] [--threads=N]\n"
+    "         [--chunk-size=BYTES] [--modes] [--times] [--symlinks]\n"
+    "         [--preserve]\n";
+
+// More workers than this only queue up on the image and the host disk.
+const uint64_t kMaxThreads = 1024;
+
+bool ParseOption(const char *arg, ExtractOptions *options) {
+  if (strcmp(arg, "--modes") == 0) {
+    options->modes = true;
+    return true;
+  }
+  if (strcmp(arg, "--times") == 0) {
+    options->times = true;
+    return true;
+  }
+  if (strcmp(arg, "--symlinks") == 0) {
+    options->symlinks = true;
+    return true;
+  }
+  if (strcmp(arg, "--preserve") == 0) {
+    options->modes = options->times = options->symlinks = true;
+    return true;
+  }
+  const char *value = strchr(arg, '=');
+  if (value == nullptr) {
+    return false;
+  }
+  std::string name(arg, value++ - arg);
+  uint64_t number;
+  if (name == "--subtree" && value[0] == '/') {
+    options->subtree = value;
+  } else if (name == "--threads" && ParseNumber(value, &number, kMaxThreads) &&
+             number != 0) {
+    options->threads = number;
+  } else if (name == "--chunk-size" && ParseNumber(value, &number) &&
+             number != 0) {
+    options->chunk_bytes = number;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 3 || argv[1][0] == '-' || argv[2][0] == '-') {
+    fputs(kUsage, stderr);
+    return 2;
+  }
+  ExtractOptions options;
+  for (int i = 3; i < argc; ++i) {
+    if (!ParseOption(argv[i], &options)) {
+      fprintf(stderr, "Invalid option %s\n%s", argv[i], kUsage);
+      return 2;
+    }
+  }
+  auto start = std::chrono::steady_clock::now();
+  ExtractStats stats;
+  try {
+    Ext2Driver driver(argv[1]);
+    DriverOptions driver_options;
+    driver_options.readahead_threads = 0;
+    driver.Initialize(driver_options);
+    stats = Extract(driver, argv[2], options);
+  } catch (const std::exception &err) {
+    fprintf(stderr, "extract: %s\n", err.what());
+    return 1;
+  }
+  double seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+  fprintf(stderr,
+          "%lu directories, %lu files, %lu symlinks, %lu hard links, "
+          "%lu skipped; %.1f MiB in %.2fs (%.1f MiB/s)\n",
+          stats.directories, stats.files, stats.symlinks, stats.hard_links,
+          stats.skipped, stats.bytes / double(1 << 20), seconds,
+          stats.bytes / double(1 << 20) / seconds);
+  return 0;
+}
@@ -1,9 +1,14 @@
 #define FUSE_USE_VERSION 31
 
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
 #include <cstdint>
+#include <cstdlib>
 #include <cstring>
 #include <string>
 #include <system_error>
+#include <vector>
 
 #include <errno.h>
 #include <fcntl.h>
@@ -12,6 +17,7 @@
 #include <unistd.h>
 
 #include "Ext2Driver.hpp"
+#include "MountOptions.hpp"
 
 /**
  * struct ext2_super_block
@@ -21,6 +27,9 @@
  * struct ext2_inode
  */
 
+// Set once the kernel agreed to take replies spliced into /dev/fuse.
+std::atomic<bool> splice_replies{false};
+
 Ext2Driver *private_data() {
   return static_cast<Ext2Driver *>(fuse_get_context()->private_data);
 }
@@ -37,8 +46,13 @@ int myfs_getattr(const char *path, struct stat *stbuf) {
 
 int myfs_readlink(const char *path, char *buf, size_t len) {
   Ext2Driver *cast = private_data();
+  if (len == 0) {
+    return -EINVAL;
+  }
   try {
-    return cast->Readlink(path, buf, len);
+    // FUSE wants 0 and a NUL-terminated (possibly truncated) target.
+    buf[cast->Readlink(path, buf, len - 1)] = '\0';
+    return 0;
   } catch (const std::system_error &err) {
     return -err.code().value();
   }
@@ -51,6 +65,11 @@ int myfs_open(const char *path, struct fuse_file_info *info) {
   } catch (const std::system_error &err) {
     return -err.code().value();
   }
+  // The stats file changes all the time, so neither its pages nor the size
+  // the kernel last saw may cut reads short.
+  if (std::strcmp(path + 1, kStatsFileName) == 0) {
+    info->direct_io = 1;
+  }
   return 0;
 }
 
@@ -64,6 +83,88 @@ int myfs_read(const char *path, char *buf, size_t len, off_t off,
   }
 }
 
+// A single buffer filled by Read, for reads not worth splicing.
+int ReadIntoBuffer(Ext2Driver *cast, struct fuse_bufvec **bufp, size_t len,
+                   off_t off, struct fuse_file_info *info) {
+  struct fuse_bufvec *bufv =
+      static_cast<struct fuse_bufvec *>(calloc(1, sizeof(struct fuse_bufvec)));
+  void *mem = malloc(std::max<size_t>(len, 1));
+  if (bufv == NULL || mem == NULL) {
+    free(bufv);
+    free(mem);
+    return -ENOMEM;
+  }
+  int bytes;
+  try {
+    bytes = cast->Read(info->fh, static_cast<char *>(mem), len, off);
+  } catch (const std::system_error &err) {
+    free(bufv);
+    free(mem);
+    return -err.code().value();
+  }
+  bufv->count = 1;
+  bufv->buf[0].size = bytes;
+  bufv->buf[0].mem = mem;
+  *bufp = bufv;
+  return 0;
+}
+
+/**
+ * Zero-copy variant of myfs_read: whole blocks are handed to libfuse as
+ * pieces of the image file, which it splices into /dev/fuse without the data
+ * ever entering our address space. Only holes and partial blocks are copied.
+ * Without splicing libfuse would pread every piece on its own, so reads go
+ * through Read unless the kernel takes spliced replies and the driver deems
+ * the read worth it. libfuse frees the vector and every `mem` with free().
+ */
+int myfs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t len,
+                  off_t off, struct fuse_file_info *info) {
+  Ext2Driver *cast = private_data();
+  if (!splice_replies || !cast->ShouldSplice(len, off)) {
+    return ReadIntoBuffer(cast, bufp, len, off, info);
+  }
+  std::vector<ReadSegment> segments;
+  try {
+    segments = cast->ReadSegments(info->fh, len, off);
+  } catch (const std::system_error &err) {
+    return -err.code().value();
+  }
+  // An empty read still needs one (empty) buffer.
+  size_t count = std::max<size_t>(segments.size(), 1);
+  struct fuse_bufvec *bufv = static_cast<struct fuse_bufvec *>(calloc(
+      1, sizeof(struct fuse_bufvec) + (count - 1) * sizeof(struct fuse_buf)));
+  if (bufv == NULL) {
+    return -ENOMEM;
+  }
+  bufv->count = count;
+  for (size_t i = 0; i < segments.size(); ++i) {
+    const ReadSegment &segment = segments[i];
+    struct fuse_buf &buf = bufv->buf[i];
+    buf.size = segment.length;
+    if (segment.data || segment.image_offset == 0) {
+      buf.mem = segment.data ? malloc(segment.length)
+                             : calloc(1, segment.length);
+      if (buf.mem == NULL) {
+        for (size_t j = 0; j < i; ++j) {
+          free(bufv->buf[j].mem);
+        }
+        free(bufv);
+        return -ENOMEM;
+      }
+      if (segment.data) {
+        memcpy(buf.mem, segment.data.get(), segment.length);
+      }
+    } else {
+      buf.flags = static_cast<enum fuse_buf_flags>(FUSE_BUF_IS_FD |
+                                                   FUSE_BUF_FD_SEEK);
+      buf.fd = cast->ImageFd();
+      buf.pos = segment.image_offset;
+    }
+  }
+  *bufp = bufv;
+  return 0;
+}
+
 int myfs_release(const char *path, struct fuse_file_info *info) {
   Ext2Driver *cast = private_data();
   try {
@@ -88,11 +189,16 @@ int myfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t off,
                  struct fuse_file_info *info) {
   Ext2Driver *cast = private_data();
   try {
-    auto name = cast->Readdir(info->fh);
-    while (name.has_value()) {
-      filler(buf, name.value_or("").c_str(), NULL, 0);
-      name = cast->Readdir(info->fh);
-    }
+    // Resume from `off` and stop once the kernel's buffer is full. Of the
+    // attributes the kernel only takes st_ino and the d_type of st_mode, both
+    // of which the directory entry has, so no inode is read here.
+    cast->Readdir(info->fh, off, [buf, filler](const DirEntry &entry) {
+      std::string name(entry.name);
+      struct stat attr = {};
+      attr.st_ino = entry.inode_idx;
+      attr.st_mode = entry.type;
+      return filler(buf, name.c_str(), &attr, entry.next) == 0;
+    });
   } catch (const std::system_error &err) {
     return -err.code().value();
   }
@@ -109,6 +215,13 @@ int myfs_releasedir(const char *path, struct fuse_file_info *info) {
   return 0;
 }
 
+// libfuse only splices replies into /dev/fuse when asked to.
+void *myfs_init(struct fuse_conn_info *conn) {
+  conn->want |= conn->capable & (FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+  splice_replies = (conn->want & FUSE_CAP_SPLICE_WRITE) != 0;
+  return private_data();
+}
+
 void myfs_destroy(void *private_data) {
   Ext2Driver *cast = static_cast<Ext2Driver*>(private_data);
   delete cast;
@@ -125,16 +238,28 @@ int main(int argc, char *argv[]) {
   myfs_oper.readlink = myfs_readlink;
   myfs_oper.open = myfs_open;
   myfs_oper.read = myfs_read;
+  myfs_oper.read_buf = myfs_read_buf;
   myfs_oper.release = myfs_release;
   myfs_oper.opendir = myfs_opendir;
   myfs_oper.readdir = myfs_readdir;
   myfs_oper.releasedir = myfs_releasedir;
+  myfs_oper.init = myfs_init;
   myfs_oper.destroy = myfs_destroy;
 
-  Ext2Driver *private_data = new Ext2Driver(argv[1]);
-  private_data->Initialize();
-  fprintf(stderr, "about to call fuse_main\n");
+  std::string image = argv[1];
   argv[1] = argv[0];
-  int fuse_stat = fuse_main(argc - 1, argv + 1, &myfs_oper, private_data);
+  struct fuse_args args = FUSE_ARGS_INIT(argc - 1, argv + 1);
+  DriverOptions options;
+  if (!ParseMountOptions(&args, &options)) {
+    return 2;
+  }
+
+  Ext2Driver *private_data = new Ext2Driver(image);
+  private_data->Initialize(options);
+  fprintf(stderr, "about to call fuse_main\n");
+  // fuse_main serves requests from a pool of threads unless -s is passed;
+  // the driver is thread-safe, so the multithreaded loop is what we want.
+  int fuse_stat = fuse_main(args.argc, args.argv, &myfs_oper, private_data);
   fprintf(stderr, "fuse_main returned %d\n", fuse_stat);
+  fuse_opt_free_args(&args);
 }
@@ -0,0 +1,315 @@
+#define FUSE_USE_VERSION 31
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include <errno.h>
+#include <fuse_lowlevel.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "Ext2Driver.hpp"
+#include "MountOptions.hpp"
+
+/**
+ * Frontend on top of the FUSE low-level API. The kernel addresses files by
+ * the inode numbers we hand out in lookup replies, so every request goes
+ * straight to the inode instead of resolving a path first; a path is only
+ * walked component by component when the kernel's dcache misses.
+ *
+ * FUSE inode numbers are ext2 inode numbers, except that the FUSE root
+ * (FUSE_ROOT_ID, 1) is ext2's root inode 2. Inode 1 of ext2 holds bad
+ * blocks and is never reachable from a directory.
+ */
+
+// The image is mounted read-only, so the kernel may keep what it learned.
+const double kCacheTimeout = 3600.0;
+
+// Set once the kernel agreed to take replies spliced into /dev/fuse.
+std::atomic<bool> splice_replies{false};
+
+Ext2Driver *driver(fuse_req_t req) {
+  return static_cast<Ext2Driver *>(fuse_req_userdata(req));
+}
+
+size_t ToInode(Ext2Driver *driver, fuse_ino_t ino) {
+  return ino == FUSE_ROOT_ID ? driver->RootInode() : ino;
+}
+
+fuse_ino_t ToFuseIno(Ext2Driver *driver, size_t inode_idx) {
+  return inode_idx == driver->RootInode() ? FUSE_ROOT_ID : inode_idx;
+}
+
+// The stats file changes all the time, the kernel must not cache anything
+// about it.
+double CacheTimeout(Ext2Driver *driver, size_t inode_idx) {
+  return inode_idx == driver->StatsInode() ? 0 : kCacheTimeout;
+}
+
+// libfuse only splices replies into /dev/fuse when asked to.
+void ll_init(void *userdata, struct fuse_conn_info *conn) {
+  conn->want |= conn->capable & (FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+  splice_replies = (conn->want & FUSE_CAP_SPLICE_WRITE) != 0;
+}
+
+void ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  Ext2Driver *cast = driver(req);
+  struct fuse_entry_param entry = {};
+  try {
+    size_t inode_idx = cast->Lookup(ToInode(cast, parent), name);
+    cast->GetattrByInode(inode_idx, &entry.attr);
+    entry.ino = ToFuseIno(cast, inode_idx);
+  } catch (const std::system_error &err) {
+    fuse_reply_err(req, err.code().value());
+    return;
+  }
+  entry.attr.st_ino = entry.ino;
+  entry.attr_timeout = CacheTimeout(cast, entry.attr.st_ino);
+  entry.entry_timeout = entry.attr_timeout;
+  fuse_reply_entry(req, &entry);
+}
+
+// Lookups pin nothing in the driver, so there is nothing to release.
+void ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup) {
+  fuse_reply_none(req);
+}
+
+void ll_forget_multi(fuse_req_t req, size_t count,
+                     struct fuse_forget_data *forgets) {
+  fuse_reply_none(req);
+}
+
+void ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *info) {
+  Ext2Driver *cast = driver(req);
+  struct stat stbuf = {};
+  try {
+    cast->GetattrByInode(ToInode(cast, ino), &stbuf);
+  } catch (const std::system_error &err) {
+    fuse_reply_err(req, err.code().value());
+    return;
+  }
+  stbuf.st_ino = ino;
+  fuse_reply_attr(req, &stbuf, CacheTimeout(cast, ToInode(cast, ino)));
+}
+
+void ll_readlink(fuse_req_t req, fuse_ino_t ino) {
+  Ext2Driver *cast = driver(req);
+  char target[PATH_MAX + 1];
+  try {
+    int len = cast->ReadlinkInode(ToInode(cast, ino), target, PATH_MAX);
+    target[len] = '\0';
+  } catch (const std::system_error &err) {
+    fuse_reply_err(req, err.code().value());
+    return;
+  }
+  fuse_reply_readlink(req, target);
+}
+
+void ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *info) {
+  Ext2Driver *cast = driver(req);
+  try {
+    info->fh = cast->OpenInode(ToInode(cast, ino));
+  } catch (const std::system_error &err) {
+    fuse_reply_err(req, err.code().value());
+    return;
+  }
+  // Nothing can change a file behind our back, keep its cached pages. The
+  // stats file is the exception, and its size is out of date as soon as it
+  // is reported.
+  if (ToInode(cast, ino) == cast->StatsInode()) {
+    info->direct_io = 1;
+  } else {
+    info->keep_cache = 1;
+  }
+  fuse_reply_open(req, info);
+}
+
+/**
+ * Replies with the pieces the driver describes instead of a copy of the
+ * data: whole blocks go as pieces of the image file, which libfuse splices
+ * into /dev/fuse when the kernel allows it. fuse_reply_data is done with the
+ * buffers when it returns, so memory pieces point at the driver's blocks.
+ */
+void ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+             struct fuse_file_info *info) {
+  Ext2Driver *cast = driver(req);
+  // Image pieces only pay off when libfuse can splice them, see
+  // Ext2Driver::ShouldSplice; otherwise the read is copied once, by Read.
+  if (!splice_replies || !cast->ShouldSplice(size, off)) {
+    std::vector<char> buf(size);
+    int bytes;
+    try {
+      bytes = cast->Read(info->fh, buf.data(), size, off);
+    } catch (const std::system_error &err) {
+      fuse_reply_err(req, err.code().value());
+      return;
+    }
+    fuse_reply_buf(req, buf.data(), bytes);
+    return;
+  }
+  std::vector<ReadSegment> segments;
+  try {
+    segments = cast->ReadSegments(info->fh, size, off);
+  } catch (const std::system_error &err) {
+    fuse_reply_err(req, err.code().value());
+    return;
+  }
+  size_t count = std::max<size_t>(segments.size(), 1);
+  std::vector<char> storage(sizeof(struct fuse_bufvec) +
+                            (count - 1) * sizeof(struct fuse_buf));
+  struct fuse_bufvec *bufv =
+      reinterpret_cast<struct fuse_bufvec *>(storage.data());
+  bufv->count = count;
+  size_t zeros = 0;
+  for (const ReadSegment &segment : segments) {
+    if (!segment.data && segment.image_offset == 0) {
+      zeros = std::max(zeros, segment.length);
+    }
+  }
+  std::vector<char> zero_buf(zeros);
+  for (size_t i = 0; i < segments.size(); ++i) {
+    const ReadSegment &segment = segments[i];
+    struct fuse_buf &buf = bufv->buf[i];
+    buf.size = segment.length;
+    if (segment.data) {
+      buf.mem = const_cast<char *>(segment.data.get());
+    } else if (segment.image_offset == 0) {
+      buf.mem = zero_buf.data();
+    } else {
+      buf.flags = static_cast<enum fuse_buf_flags>(FUSE_BUF_IS_FD |
+                                                   FUSE_BUF_FD_SEEK);
+      buf.fd = cast->ImageFd();
+      buf.pos = segment.image_offset;
+    }
+  }
+  fuse_reply_data(req, bufv, FUSE_BUF_SPLICE_MOVE);
+}
+
+void ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *info) {
+  try {
+    driver(req)->Close(info->fh);
+  } catch (const std::system_error &err) {
+    fuse_reply_err(req, err.code().value());
+    return;
+  }
+  fuse_reply_err(req, 0);
+}
+
+void ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *info) {
+  Ext2Driver *cast = driver(req);
+  try {
+    info->fh = cast->OpendirInode(ToInode(cast, ino));
+  } catch (const std::system_error &err) {
+    fuse_reply_err(req, err.code().value());
+    return;
+  }
+  fuse_reply_open(req, info);
+}
+
+void ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                struct fuse_file_info *info) {
+  Ext2Driver *cast = driver(req);
+  std::unique_ptr<char[]> buf(new char[size]);
+  size_t used = 0;
+  try {
+    // Every entry carries the cookie of the next one, so the kernel can
+    // resume the listing wherever this reply ends.
+    cast->Readdir(info->fh, off, [&](const DirEntry &entry) {
+      std::string name(entry.name);
+      struct stat stbuf = {};
+      stbuf.st_ino = ToFuseIno(cast, entry.inode_idx);
+      stbuf.st_mode = entry.type;
+      size_t entry_size = fuse_add_direntry(req, buf.get() + used, size - used,
+                                            name.c_str(), &stbuf, entry.next);
+      if (entry_size > size - used) {
+        return false;
+      }
+      used += entry_size;
+      return true;
+    });
+  } catch (const std::system_error &err) {
+    fuse_reply_err(req, err.code().value());
+    return;
+  }
+  fuse_reply_buf(req, buf.get(), used);
+}
+
+void ll_releasedir(fuse_req_t req, fuse_ino_t ino,
+                   struct fuse_file_info *info) {
+  try {
+    driver(req)->Releasedir(info->fh);
+  } catch (const std::system_error &err) {
+    fuse_reply_err(req, err.code().value());
+    return;
+  }
+  fuse_reply_err(req, 0);
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    fprintf(stderr, "Usage: ext2fuse_ll <image> <mountpoint> [fuse_args...]");
+    return 2;
+  }
+
+  struct fuse_lowlevel_ops ll_oper = {};
+  ll_oper.init = ll_init;
+  ll_oper.lookup = ll_lookup;
+  ll_oper.forget = ll_forget;
+  ll_oper.forget_multi = ll_forget_multi;
+  ll_oper.getattr = ll_getattr;
+  ll_oper.readlink = ll_readlink;
+  ll_oper.open = ll_open;
+  ll_oper.read = ll_read;
+  ll_oper.release = ll_release;
+  ll_oper.opendir = ll_opendir;
+  ll_oper.readdir = ll_readdir;
+  ll_oper.releasedir = ll_releasedir;
+
+  std::string image = argv[1];
+  argv[1] = argv[0];
+  struct fuse_args args = FUSE_ARGS_INIT(argc - 1, argv + 1);
+  DriverOptions options;
+  if (!ParseMountOptions(&args, &options)) {
+    return 2;
+  }
+  char *mountpoint;
+  int multithreaded;
+  int foreground;
+  if (fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) ==
+      -1) {
+    return 2;
+  }
+
+  Ext2Driver ext2_driver(image);
+  ext2_driver.Initialize(options);
+  int err = -1;
+  struct fuse_chan *channel = fuse_mount(mountpoint, &args);
+  if (channel != NULL) {
+    struct fuse_session *session =
+        fuse_lowlevel_new(&args, &ll_oper, sizeof(ll_oper), &ext2_driver);
+    if (session != NULL) {
+      if (fuse_set_signal_handlers(session) != -1) {
+        fuse_session_add_chan(session, channel);
+        fuse_daemonize(foreground);
+        // Like fuse_main, serve from a pool of threads unless -s is passed.
+        err = multithreaded ? fuse_session_loop_mt(session)
+                            : fuse_session_loop(session);
+        fuse_remove_signal_handlers(session);
+        fuse_session_remove_chan(channel);
+      }
+      fuse_session_destroy(session);
+    }
+    fuse_unmount(mountpoint, channel);
+  }
+  free(mountpoint);
+  fuse_opt_free_args(&args);
+  return err == 0 ? 0 : 1;
+}
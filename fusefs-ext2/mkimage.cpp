@@ -0,0 +1,91 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <string>
+
+#include "ImageBuilder.hpp"
+#include "ParseNumber.hpp"
+
+/**
+ * Generates a synthetic ext2 image, see ImageSpec for what the options mean.
+ * The same options always give the same image.
+ *
+ * Usage: mkimage <image> [--seed=N] [--size=BYTES] [--block-size=BYTES]
+ *          [--files=N] [--fanout=N] [--min-file-size=BYTES]
+ *          [--max-file-size=BYTES] [--fragmentation=P] [--sparse=P]
+ *          [--symlinks=P] [--extents]
+ * Numbers take a K, M or G suffix (powers of 1024); P is a fraction between
+ * 0 and 1.
+ */
+
+const char kUsage[] =
+    "Usage: mkimage <image> [--seed=N] [--size=BYTES] [--block-size=BYTES]\n"
+    "         [--files=N] [--fanout=N] [--min-file-size=BYTES]\n"
+    "         [--max-file-size=BYTES] [--fragmentation=P] [--sparse=P]\n"
+    "         [--symlinks=P] [--extents]\n";
+
+bool ParseFraction(const char *value, double *fraction) {
+  char *end;
+  *fraction = strtod(value, &end);
+  return end != value && *end == '\0' && *fraction >= 0 && *fraction <= 1;
+}
+
+bool ParseOption(const char *arg, ImageSpec *spec) {
+  if (strcmp(arg, "--extents") == 0) {
+    spec->extents = true;
+    return true;
+  }
+  const char *value = strchr(arg, '=');
+  if (value == nullptr) {
+    return false;
+  }
+  std::string name(arg, value++ - arg);
+  uint64_t number;
+  if (name == "--seed" && ParseNumber(value, &number, UINT32_MAX)) {
+    spec->seed = number;
+  } else if (name == "--size") {
+    return ParseNumber(value, &spec->size_bytes);
+  } else if (name == "--block-size" && ParseNumber(value, &number, 65536)) {
+    spec->block_size = number;
+  } else if (name == "--files") {
+    return ParseNumber(value, &spec->files);
+  } else if (name == "--fanout" && ParseNumber(value, &number, UINT32_MAX)) {
+    spec->fanout = number;
+  } else if (name == "--min-file-size") {
+    return ParseNumber(value, &spec->min_file_bytes);
+  } else if (name == "--max-file-size") {
+    return ParseNumber(value, &spec->max_file_bytes);
+  } else if (name == "--fragmentation") {
+    return ParseFraction(value, &spec->fragmentation);
+  } else if (name == "--sparse") {
+    return ParseFraction(value, &spec->sparse_fraction);
+  } else if (name == "--symlinks") {
+    return ParseFraction(value, &spec->symlink_fraction);
+  } else {
+    return false;
+  }
+  return true;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2 || argv[1][0] == '-') {
+    fputs(kUsage, stderr);
+    return 2;
+  }
+  ImageSpec spec;
+  for (int i = 2; i < argc; ++i) {
+    if (!ParseOption(argv[i], &spec)) {
+      fprintf(stderr, "Invalid option %s\n%s", argv[i], kUsage);
+      return 2;
+    }
+  }
+  try {
+    GenerateImage(argv[1], spec);
+  } catch (const std::exception &err) {
+    fprintf(stderr, "mkimage: %s\n", err.what());
+    return 1;
+  }
+  return 0;
+}
@@ -1,9 +1,30 @@
+#include <algorithm>
+#include <cstdlib>
 #include <cstring>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 #include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <sys/resource.h>
+#include <unistd.h>
 
 #include "prove.hpp"
+#include "BufferPool.hpp"
+#include "DirectoryHash.hpp"
 #include "Ext2Driver.hpp"
+#include "HandleTable.hpp"
+#include "Extractor.hpp"
+#include "ImageBuilder.hpp"
+#include "MetadataSnapshot.hpp"
+#include "Metrics.hpp"
+#include "IoEngine.hpp"
 
 const char kTestFile[] = "simple_image.img";
 
@@ -15,14 +36,26 @@ PROVE_CASE(TestInit) {
 PROVE_CASE(TestOpen) {
   Ext2Driver driver(kTestFile);
   driver.Initialize();
-  int fd = driver.Open("/test");
+  uint64_t fd = driver.Open("/test");
   char buf[6];
   buf[5] = '\0';
-  PROVE_CHECK(driver.Read(fd, buf, sizeof(buf), 0) == sizeof(buf) - 1);
+  PROVE_CHECK(driver.Read(fd, buf, sizeof(buf), 0) ==
+              static_cast<int>(sizeof(buf) - 1));
   PROVE_CHECK(std::strcmp("TEST\n", buf) == 0);
   driver.Close(fd);
 }
 
+PROVE_CASE(TestReadAtOffset) {
+  Ext2Driver driver(kTestFile);
+  driver.Initialize();
+  uint64_t fd = driver.Open("/test");
+  char buf[16] = {};
+  PROVE_CHECK(driver.Read(fd, buf, sizeof(buf), 2) == 3);
+  PROVE_CHECK(std::strcmp("ST\n", buf) == 0);
+  PROVE_CHECK(driver.Read(fd, buf, sizeof(buf), 5) == 0);
+  driver.Close(fd);
+}
+
 PROVE_CASE(TestNonexistentFile) {
   Ext2Driver driver(kTestFile);
   driver.Initialize();
@@ -39,7 +72,7 @@ PROVE_CASE(TestNonexistentFile) {
 PROVE_CASE(TestReaddir) {
   Ext2Driver driver(kTestFile);
   driver.Initialize();
-  int fd = driver.Opendir("/");
+  uint64_t fd = driver.Opendir("/");
   {
     auto filename = driver.Readdir(fd);
     PROVE_CHECK(filename.has_value());
@@ -66,6 +99,1341 @@ PROVE_CASE(TestReaddir) {
   }
 }
 
+PROVE_CASE(TestPagedReaddir) {
+  Ext2Driver driver(kTestFile);
+  driver.Initialize();
+  uint64_t fd = driver.Opendir("/");
+  std::vector<std::string> names;
+  uint64_t cookie = 0;
+  // Two entries per page, every page resumes where the previous one stopped.
+  while (true) {
+    size_t taken = 0;
+    driver.Readdir(fd, cookie, [&](const DirEntry &entry) {
+      if (taken == 2) {
+        return false;
+      }
+      names.emplace_back(entry.name);
+      cookie = entry.next;
+      taken++;
+      return true;
+    });
+    if (taken == 0) {
+      break;
+    }
+  }
+  PROVE_CHECK(names.size() == 4u);
+  PROVE_CHECK(names[0] == ".");
+  PROVE_CHECK(names[1] == "..");
+  PROVE_CHECK(names[2] == "test");
+  PROVE_CHECK(names[3] == "test2");
+
+  size_t test_size = 0;
+  mode_t test_type = 0;
+  driver.Readdir(fd, 0, [&](const DirEntry &entry) {
+    if (entry.name == "test") {
+      test_size = entry.attr->st_size;
+      test_type = entry.type;
+    }
+    return true;
+  }, true);
+  PROVE_CHECK(test_size == 5u);
+  PROVE_CHECK(S_ISREG(test_type));
+  driver.Releasedir(fd);
+}
+
+PROVE_CASE(TestSeekDataHole) {
+  Ext2Driver driver(kTestFile);
+  driver.Initialize();
+  uint64_t fd = driver.Open("/test");
+  PROVE_CHECK(driver.Lseek(fd, 0, SEEK_DATA) == 0);
+  PROVE_CHECK(driver.Lseek(fd, 3, SEEK_DATA) == 3);
+  // The file is a single block of data, followed by the implicit hole at EOF.
+  PROVE_CHECK(driver.Lseek(fd, 0, SEEK_HOLE) == 5);
+  int error = 0;
+  try {
+    driver.Lseek(fd, 5, SEEK_DATA);
+  } catch (const std::system_error &err) {
+    error = err.code().value();
+  }
+  PROVE_CHECK(error == ENXIO);
+  driver.Close(fd);
+}
+
+PROVE_CASE(TestReadlinkOfRegularFile) {
+  Ext2Driver driver(kTestFile);
+  driver.Initialize();
+  char buf[16];
+  int error = 0;
+  try {
+    driver.Readlink("/test", buf, sizeof(buf));
+  } catch (const std::system_error &err) {
+    error = err.code().value();
+  }
+  PROVE_CHECK(error == EINVAL);
+}
+
+PROVE_CASE(TestBlockCacheSharedBetweenHandles) {
+  Ext2Driver driver(kTestFile);
+  driver.Initialize();
+  char buf[5];
+  uint64_t first = driver.Open("/test");
+  PROVE_CHECK(driver.Read(first, buf, sizeof(buf), 0) ==
+              static_cast<int>(sizeof(buf)));
+  CacheStats before = driver.BlockCacheStats();
+  uint64_t second = driver.Open("/test");
+  PROVE_CHECK(driver.Read(second, buf, sizeof(buf), 0) ==
+              static_cast<int>(sizeof(buf)));
+  CacheStats after = driver.BlockCacheStats();
+  PROVE_CHECK(after.misses == before.misses);
+  PROVE_CHECK(after.hits > before.hits);
+  driver.Close(first);
+  driver.Close(second);
+}
+
+PROVE_CASE(TestBlockMapSharedBetweenOpens) {
+  Ext2Driver driver(kTestFile);
+  driver.Initialize();
+  uint64_t first = driver.Open("/test");
+  std::shared_ptr<const BlockMap> map = driver.FileBlockMap(first);
+  driver.Close(first);
+  CacheStats before = driver.BlockMapCacheStats();
+  uint64_t second = driver.Open("/test");
+  PROVE_CHECK(driver.FileBlockMap(second) == map);
+  driver.Close(second);
+  PROVE_CHECK(driver.BlockMapCacheStats().hits == before.hits + 1);
+}
+
+PROVE_CASE(TestBlockCacheDisabled) {
+  Ext2Driver driver(kTestFile);
+  DriverOptions options;
+  options.block_cache_bytes = 0;
+  driver.Initialize(options);
+  uint64_t fd = driver.Open("/test");
+  char buf[6];
+  buf[5] = '\0';
+  PROVE_CHECK(driver.Read(fd, buf, sizeof(buf), 0) ==
+              static_cast<int>(sizeof(buf) - 1));
+  PROVE_CHECK(std::strcmp("TEST\n", buf) == 0);
+  PROVE_CHECK(driver.BlockCacheStats().hits == 0u);
+  driver.Close(fd);
+}
+
+PROVE_CASE(TestShardedCacheCapacity) {
+  // 20 entries over 16 shards: the total must not round up to 32.
+  ShardedLruCache<size_t, size_t> cache(20);
+  for (size_t i = 0; i < 1000; ++i) {
+    cache.Put(i, i);
+  }
+  PROVE_CHECK(cache.size() <= 20u);
+}
+
+PROVE_CASE(TestHandleTableReusesEntries) {
+  const size_t shards = HandleTable<std::string>::kShards;
+  HandleTable<std::string> table;
+  std::set<const std::string *> allocated;
+  for (size_t i = 0; i < shards; ++i) {
+    uint64_t handle = table.Insert("first");
+    allocated.insert(table.Find(handle).get());
+    PROVE_CHECK(table.Erase(handle));
+  }
+  PROVE_CHECK(table.free_entries() == shards);
+  // Once every shard has freed an entry, opens only take recycled ones...
+  for (size_t i = 0; i < shards; ++i) {
+    uint64_t handle = table.Insert("second");
+    std::shared_ptr<std::string> entry = table.Find(handle);
+    PROVE_CHECK(*entry == "second");
+    PROVE_CHECK(allocated.count(entry.get()) == 1u);
+    PROVE_CHECK(table.free_entries() == shards - 1);
+    PROVE_CHECK(table.Erase(handle));
+  }
+  // ...but not one still referenced by a read in flight.
+  uint64_t handle = table.Insert("held");
+  std::shared_ptr<std::string> held = table.Find(handle);
+  PROVE_CHECK(table.Erase(handle));
+  PROVE_CHECK(table.free_entries() == shards - 1);
+  PROVE_CHECK(*held == "held");
+  held.reset();
+  PROVE_CHECK(table.free_entries() == shards);
+}
+
+PROVE_CASE(TestInodeCachePrefetchesNeighbours) {
+  Ext2Driver driver(kTestFile);
+  driver.Initialize();
+  struct stat stat;
+  driver.Getattr("/test", &stat);
+  CacheStats before = driver.InodeCacheStats();
+  driver.Getattr("/test", &stat);
+  driver.Getattr("/test2", &stat);
+  CacheStats after = driver.InodeCacheStats();
+  PROVE_CHECK(after.misses == before.misses);
+  PROVE_CHECK(after.hits > before.hits);
+}
+
+PROVE_CASE(TestFreeInode) {
+  Ext2Driver driver(kTestFile);
+  driver.Initialize();
+  // The last inode of the image is not in use.
+  struct stat st;
+  bool fired = false;
+  try {
+    driver.GetattrByInode(driver.StatsInode() - 1, &st);
+  } catch (const std::system_error &err) {
+    PROVE_CHECK(err.code().value() == ESTALE);
+    fired = true;
+  }
+  PROVE_CHECK(fired);
+}
+
+PROVE_CASE(TestNegativeDentries) {
+  Ext2Driver driver(kTestFile);
+  driver.Initialize();
+  for (int attempt = 0; attempt < 2; ++attempt) {
+    CacheStats before = driver.BlockCacheStats();
+    int error = 0;
+    try {
+      driver.Open("/missing");
+    } catch (const std::system_error &err) {
+      error = err.code().value();
+    }
+    PROVE_CHECK(error == ENOENT);
+    if (attempt == 1) {
+      CacheStats after = driver.BlockCacheStats();
+      PROVE_CHECK(after.hits + after.misses == before.hits + before.misses);
+      PROVE_CHECK(driver.DentryCacheStats().hits == 1u);
+    }
+  }
+}
+
+PROVE_CASE(TestDamagedDirectoryEntries) {
+  const char image[] = "/tmp/ext2fuse_test_dirent.img";
+  uint32_t dir, second;
+  {
+    ImageBuilder builder(image, 4 << 20, 1024, 64, 1);
+    dir = builder.AddDirectory(ImageBuilder::kRootInode, "dir");
+    builder.AddFile(dir, "a", 10);
+    second = builder.AddFile(dir, "b", 10);
+    builder.Finish();
+  }
+  std::vector<char> block(1024);
+  int image_fd = open(image, O_RDWR);
+  // The directory's only block is the one whose "." entry names it.
+  off_t block_offset = 0;
+  for (; block_offset < (4 << 20); block_offset += 1024) {
+    PROVE_CHECK(pread(image_fd, block.data(), block.size(), block_offset) == 1024);
+    const ext2_dir_entry_2 *dot =
+        reinterpret_cast<const ext2_dir_entry_2 *>(block.data());
+    if (dot->inode == dir && dot->name_len == 1 && dot->name[0] == '.') {
+      break;
+    }
+  }
+  PROVE_CHECK(block_offset < (4 << 20));
+  auto entry = [&block](const char *name) {
+    for (size_t at = 0; at < block.size();) {
+      ext2_dir_entry_2 *dirent =
+          reinterpret_cast<ext2_dir_entry_2 *>(block.data() + at);
+      if (dirent->name_len == strlen(name) &&
+          std::memcmp(dirent->name, name, dirent->name_len) == 0) {
+        return dirent;
+      }
+      at += dirent->rec_len;
+    }
+    return static_cast<ext2_dir_entry_2 *>(nullptr);
+  };
+  // "a" deleted, and "b" renamed to "a" after it: only the live one counts.
+  entry("a")->inode = 0;
+  entry("b")->name[0] = 'a';
+  PROVE_CHECK(pwrite(image_fd, block.data(), block.size(), block_offset) == 1024);
+  {
+    Ext2Driver driver(image);
+    driver.Initialize();
+    PROVE_CHECK(driver.Lookup(dir, "a") == second);
+  }
+  // An entry running past the end of the block.
+  entry("..")->rec_len = 2048;
+  PROVE_CHECK(pwrite(image_fd, block.data(), block.size(), block_offset) == 1024);
+  close(image_fd);
+  {
+    Ext2Driver driver(image);
+    driver.Initialize();
+    bool fired = false;
+    try {
+      driver.Lookup(dir, "missing");
+    } catch (const std::system_error &err) {
+      PROVE_CHECK(err.code().value() == EIO);
+      fired = true;
+    }
+    PROVE_CHECK(fired);
+  }
+  unlink(image);
+}
+
+PROVE_CASE(TestDirectoryHash) {
+  // Reference values from debugfs' dx_hash with the default seed.
+  PROVE_CHECK(DirectoryHash("lost+found", EXT2_HASH_LEGACY, nullptr) == 0x5e2aba24u);
+  PROVE_CHECK(DirectoryHash("lost+found", EXT2_HASH_HALF_MD4, nullptr) == 0x591de422u);
+  PROVE_CHECK(DirectoryHash("lost+found", EXT2_HASH_TEA, nullptr) == 0x2dbf9e80u);
+  const char long_name[] =
+      "a.very.long.file.name.that.spans.more.than.thirty.two.bytes";
+  PROVE_CHECK(DirectoryHash(long_name, EXT2_HASH_HALF_MD4, nullptr) == 0xeb6ef1ee);
+  PROVE_CHECK(DirectoryHash(long_name, EXT2_HASH_TEA, nullptr) == 0xe0d47782);
+  uint32_t minor = 0;
+  const uint32_t seed[4] = {0xa330e47a, 0xd84ad0c9, 0x323a2ba1, 0xfc707205};
+  PROVE_CHECK(DirectoryHash("test", EXT2_HASH_HALF_MD4, seed, &minor) == 0x6f67dc50u);
+  PROVE_CHECK(minor == 0x946c9dcf);
+}
+
+PROVE_CASE(TestDamagedDirectoryIndex) {
+  const char image[] = "/tmp/ext2fuse_test_dx.img";
+  uint32_t dir, last = 0;
+  {
+    ImageBuilder builder(image, 4 << 20, 1024, 64, 1);
+    dir = builder.AddDirectory(ImageBuilder::kRootInode, "dir");
+    // Enough long names to fill more than one directory block.
+    for (int i = 0; i < 40; ++i) {
+      last = builder.AddFile(
+          dir, "a-name-long-enough-to-fill-blocks-" + std::to_string(i), 10);
+    }
+    builder.Finish();
+  }
+  int image_fd = open(image, O_RDWR);
+  ext2_super_block sb;
+  PROVE_CHECK(pread(image_fd, &sb, sizeof(sb), 1024) ==
+              static_cast<ssize_t>(sizeof(sb)));
+  sb.s_feature_compat |= EXT2_FEATURE_COMPAT_DIR_INDEX;
+  PROVE_CHECK(pwrite(image_fd, &sb, sizeof(sb), 1024) ==
+              static_cast<ssize_t>(sizeof(sb)));
+  ext2_group_desc gd;
+  PROVE_CHECK(pread(image_fd, &gd, sizeof(gd), 2 * 1024) ==
+              static_cast<ssize_t>(sizeof(gd)));
+  ext2_inode inode;
+  const off_t inode_offset = off_t(gd.bg_inode_table) * 1024 + (dir - 1) * 128;
+  PROVE_CHECK(pread(image_fd, &inode, sizeof(inode), inode_offset) ==
+              static_cast<ssize_t>(sizeof(inode)));
+  PROVE_CHECK(inode.i_size > 1024u);
+  inode.i_flags |= EXT2_INDEX_FL;
+  PROVE_CHECK(pwrite(image_fd, &inode, sizeof(inode), inode_offset) ==
+              static_cast<ssize_t>(sizeof(inode)));
+  // Turn the first block into a dx_root whose only leaf lies past the end of
+  // the directory. Its "." and ".." entries still read as a plain block.
+  std::vector<char> block(1024, 0);
+  auto dirent = [&block](size_t at, uint32_t inode_idx, uint16_t rec_len,
+                         const char *name) {
+    ext2_dir_entry_2 *entry = reinterpret_cast<ext2_dir_entry_2 *>(&block[at]);
+    entry->inode = inode_idx;
+    entry->rec_len = rec_len;
+    entry->name_len = strlen(name);
+    entry->file_type = EXT2_FT_DIR;
+    std::memcpy(entry->name, name, entry->name_len);
+  };
+  dirent(0, dir, 12, ".");
+  dirent(12, ImageBuilder::kRootInode, 1024 - 12, "..");
+  ext2_dx_root_info *info = reinterpret_cast<ext2_dx_root_info *>(&block[24]);
+  info->hash_version = EXT2_HASH_HALF_MD4;
+  info->info_length = sizeof(*info);
+  ext2_dx_countlimit *countlimit =
+      reinterpret_cast<ext2_dx_countlimit *>(&block[32]);
+  countlimit->limit = (1024 - 32) / sizeof(ext2_dx_entry);
+  countlimit->count = 1;
+  reinterpret_cast<ext2_dx_entry *>(&block[32])->block = 1000;
+  PROVE_CHECK(pwrite(image_fd, block.data(), block.size(),
+                     off_t(inode.i_block[0]) * 1024) == 1024);
+  close(image_fd);
+
+  Ext2Driver driver(image);
+  driver.Initialize();
+  PROVE_CHECK(driver.Lookup(dir, "a-name-long-enough-to-fill-blocks-39") == last);
+  unlink(image);
+}
+
+PROVE_CASE(TestMmapBackend) {
+  Ext2Driver driver(kTestFile);
+  DriverOptions options;
+  options.use_mmap = true;
+  driver.Initialize(options);
+  uint64_t fd = driver.Open("/test");
+  char buf[6];
+  buf[5] = '\0';
+  PROVE_CHECK(driver.Read(fd, buf, sizeof(buf), 0) ==
+              static_cast<int>(sizeof(buf) - 1));
+  PROVE_CHECK(std::strcmp("TEST\n", buf) == 0);
+  driver.Close(fd);
+  CacheStats stats = driver.BlockCacheStats();
+  PROVE_CHECK(stats.hits + stats.misses == 0u);
+}
+
+PROVE_CASE(TestParallelReads) {
+  Ext2Driver driver(kTestFile);
+  driver.Initialize();
+  uint64_t shared_fd = driver.Open("/test");
+  std::vector<std::thread> threads;
+  std::vector<int> failures(8, 0);
+  for (size_t t = 0; t < failures.size(); ++t) {
+    threads.emplace_back([&driver, &failures, shared_fd, t] {
+      for (int i = 0; i < 1000; ++i) {
+        uint64_t fd = (i % 2 == 0) ? shared_fd : driver.Open("/test");
+        char buf[6] = {};
+        if (driver.Read(fd, buf, 5, i % 5) != 5 - i % 5 ||
+            std::strncmp("TEST\n" + i % 5, buf, 5 - i % 5) != 0) {
+          failures[t]++;
+        }
+        if (fd != shared_fd) {
+          driver.Close(fd);
+        }
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  for (int failed : failures) {
+    PROVE_CHECK(failed == 0);
+  }
+  driver.Close(shared_fd);
+}
+
+PROVE_CASE(TestManyHandles) {
+  Ext2Driver driver(kTestFile);
+  driver.Initialize();
+  std::vector<uint64_t> fds;
+  for (int i = 0; i < 10000; ++i) {
+    fds.push_back(driver.Open("/test"));
+  }
+  char buf[6] = {};
+  PROVE_CHECK(driver.Read(fds.back(), buf, 5, 0) == 5);
+  for (uint64_t fd : fds) {
+    driver.Close(fd);
+  }
+  // A recycled slot gets a new generation, the old handle stays invalid.
+  uint64_t reused = driver.Open("/test");
+  PROVE_CHECK(std::count(fds.begin(), fds.end(), reused) == 0);
+  int error = 0;
+  try {
+    driver.Read(fds.back(), buf, 5, 0);
+  } catch (const std::system_error &err) {
+    error = err.code().value();
+  }
+  PROVE_CHECK(error == EBADF);
+  driver.Close(reused);
+}
+
+PROVE_CASE(TestInodeApi) {
+  Ext2Driver driver(kTestFile);
+  driver.Initialize();
+  struct stat by_path;
+  driver.Getattr("/test", &by_path);
+  size_t inode_idx = driver.Lookup(driver.RootInode(), "test");
+  PROVE_CHECK(inode_idx == by_path.st_ino);
+  struct stat by_inode;
+  driver.GetattrByInode(inode_idx, &by_inode);
+  PROVE_CHECK(by_inode.st_size == by_path.st_size);
+
+  uint64_t fd = driver.OpenInode(inode_idx);
+  char buf[6] = {};
+  PROVE_CHECK(driver.Read(fd, buf, 5, 0) == 5);
+  PROVE_CHECK(std::strcmp("TEST\n", buf) == 0);
+  driver.Close(fd);
+
+  uint64_t dir = driver.OpendirInode(driver.RootInode());
+  size_t listed_inode = 0;
+  auto name = driver.Readdir(dir, &listed_inode);
+  while (name.has_value() && name.value() != "test") {
+    name = driver.Readdir(dir, &listed_inode);
+  }
+  PROVE_CHECK(name.has_value() && listed_inode == inode_idx);
+  driver.Releasedir(dir);
+
+  int error = 0;
+  try {
+    driver.Lookup(driver.RootInode(), "missing");
+  } catch (const std::system_error &err) {
+    error = err.code().value();
+  }
+  PROVE_CHECK(error == ENOENT);
+  error = 0;
+  try {
+    driver.OpendirInode(inode_idx);
+  } catch (const std::system_error &err) {
+    error = err.code().value();
+  }
+  PROVE_CHECK(error == ENOTDIR);
+}
+
+PROVE_CASE(TestBufferPoolRecycles) {
+  std::shared_ptr<BufferPool> pool = BufferPool::Create(4096, 2);
+  char *first;
+  {
+    std::shared_ptr<char> buffer = pool->Acquire();
+    first = buffer.get();
+    PROVE_CHECK(reinterpret_cast<uintptr_t>(first) % 4096 == 0u);
+  }
+  PROVE_CHECK(pool->free_buffers() == 1u);
+  std::shared_ptr<char> again = pool->Acquire();
+  PROVE_CHECK(static_cast<void *>(again.get()) == static_cast<void *>(first));
+  PROVE_CHECK(pool->free_buffers() == 0u);
+  {
+    std::vector<std::shared_ptr<char>> many;
+    for (int i = 0; i < 4; ++i) {
+      many.push_back(pool->Acquire());
+    }
+  }
+  PROVE_CHECK(pool->free_buffers() == 2u);
+}
+
+PROVE_CASE(TestIoEngineBatch) {
+  int fd = open(kTestFile, O_RDONLY);
+  PROVE_CHECK(fd >= 0);
+  // Falls back to pread when io_uring is not built in or not available.
+  std::unique_ptr<IoEngine> engine = IoEngine::Create(fd, true, 4);
+  ext2_super_block sb;
+  char first[512], second[512];
+  iovec halves[] = {{first, sizeof(first)}, {second, sizeof(second)}};
+  std::vector<IoRequest> requests;
+  requests.emplace_back(&sb, sizeof(sb), 1024);
+  requests.emplace_back(halves, 2, 1024);
+  requests.emplace_back(first, 16, 1 << 30);
+  engine->Submit(requests.data(), requests.size());
+  PROVE_CHECK(requests[0].result == static_cast<ssize_t>(sizeof(sb)));
+  PROVE_CHECK(sb.s_magic == EXT2_SUPER_MAGIC);
+  PROVE_CHECK(requests[1].result == 1024);
+  PROVE_CHECK(std::memcmp(first, &sb, sizeof(first)) == 0);
+  PROVE_CHECK(requests[2].result == 0);
+  close(fd);
+}
+
+PROVE_CASE(TestImageBuilder) {
+  const char image[] = "/tmp/ext2fuse_test_builder.img";
+  const uint32_t seed = 42;
+  uint32_t dense, sparse;
+  {
+    // 2K blocks and scattered allocation; "big" needs a double indirect
+    // block.
+    ImageBuilder builder(image, 8 << 20, 2048, 64, seed, 0.3);
+    uint32_t dir = builder.AddDirectory(ImageBuilder::kRootInode, "dir");
+    dense = builder.AddFile(dir, "big", 3 << 20);
+    sparse = builder.AddFile(dir, "sparse", 1 << 20, true);
+    builder.AddFile(ImageBuilder::kRootInode, "empty", 0);
+    builder.AddSymlink(dir, "fast", "big");
+    builder.AddSymlink(dir, "slow", std::string(100, 'x'));
+    builder.Finish();
+  }
+  Ext2Driver driver(image);
+  driver.Initialize();
+  struct stat st;
+  driver.Getattr("/dir/big", &st);
+  PROVE_CHECK(st.st_size == 3 << 20);
+  PROVE_CHECK(st.st_ino == dense);
+  driver.Getattr("/empty", &st);
+  PROVE_CHECK(st.st_size == 0);
+  std::vector<char> buf(2048), expected(2048);
+  uint64_t fd = driver.Open("/dir/big");
+  for (uint64_t block : {0, 11, 12, 600, 1535}) {
+    PROVE_CHECK(driver.Read(fd, buf.data(), buf.size(), block * 2048) == 2048);
+    ImageBuilder::FillBlock(seed, dense, block, expected.data(), expected.size());
+    PROVE_CHECK(std::memcmp(buf.data(), expected.data(), buf.size()) == 0);
+  }
+  driver.Close(fd);
+  fd = driver.Open("/dir/sparse");
+  size_t holes = 0;
+  for (uint64_t block = 0; block < 512; ++block) {
+    driver.Read(fd, buf.data(), buf.size(), block * 2048);
+    if (ImageBuilder::IsHole(seed, sparse, block)) {
+      std::fill(expected.begin(), expected.end(), 0);
+      holes++;
+    } else {
+      ImageBuilder::FillBlock(seed, sparse, block, expected.data(),
+                              expected.size());
+    }
+    PROVE_CHECK(std::memcmp(buf.data(), expected.data(), buf.size()) == 0);
+  }
+  PROVE_CHECK(holes > 0u);
+  PROVE_CHECK(holes < 512u);
+  driver.Close(fd);
+  char target[128];
+  PROVE_CHECK(driver.Readlink("/dir/fast", target, sizeof(target)) == 3);
+  PROVE_CHECK(std::string(target, 3) == "big");
+  PROVE_CHECK(driver.Readlink("/dir/slow", target, sizeof(target)) == 100);
+  PROVE_CHECK(std::string(target, 100) == std::string(100, 'x'));
+  // An opened fast symlink reads as its target, not as the blocks its
+  // target bytes would point to.
+  fd = driver.Open("/dir/fast");
+  PROVE_CHECK(driver.Read(fd, target, sizeof(target), 0) == 3);
+  PROVE_CHECK(std::string(target, 3) == "big");
+  std::vector<ReadSegment> segments = driver.ReadSegments(fd, 10, 1);
+  PROVE_CHECK(segments.size() == 1u);
+  PROVE_CHECK(segments[0].length == 2u);
+  PROVE_CHECK(std::memcmp(segments[0].data.get(), "ig", 2) == 0);
+  PROVE_CHECK(driver.Lseek(fd, 1, SEEK_HOLE) == 3);
+  driver.Close(fd);
+  std::vector<std::string> names;
+  fd = driver.Opendir("/");
+  while (auto name = driver.Readdir(fd)) {
+    names.push_back(*name);
+  }
+  driver.Releasedir(fd);
+  PROVE_CHECK(names.size() == 5u);
+  PROVE_CHECK(names[2] == "lost+found");
+  PROVE_CHECK(names[3] == "dir");
+  PROVE_CHECK(names[4] == "empty");
+  unlink(image);
+}
+
+PROVE_CASE(TestSequentialReadahead) {
+  const char image[] = "/tmp/ext2fuse_test_readahead.img";
+  uint32_t inode;
+  {
+    ImageBuilder builder(image, 8 << 20, 1024, 64, 1);
+    inode = builder.AddFile(ImageBuilder::kRootInode, "file", 2 << 20);
+    builder.Finish();
+  }
+  Ext2Driver driver(image);
+  driver.Initialize();
+  uint64_t fd = driver.Open("/file");
+  std::vector<char> buf(64 << 10);
+  std::vector<char> expected(1024);
+  for (size_t off = 0; off < (1 << 20); off += buf.size()) {
+    PROVE_CHECK(driver.Read(fd, buf.data(), buf.size(), off) ==
+                static_cast<int>(buf.size()));
+    ImageBuilder::FillBlock(1, inode, off / 1024, expected.data(), 1024);
+    PROVE_CHECK(std::memcmp(buf.data(), expected.data(), 1024) == 0);
+  }
+  // Every window doubles, so 1 MiB of 64 KiB reads starts a handful.
+  uint64_t windows = driver.ReadaheadStats().windows;
+  PROVE_CHECK(windows >= 2u);
+  // A jump back restarts detection instead of extending the window.
+  PROVE_CHECK(driver.Read(fd, buf.data(), buf.size(), 0) ==
+              static_cast<int>(buf.size()));
+  PROVE_CHECK(driver.ReadaheadStats().windows == windows);
+  driver.Close(fd);
+  unlink(image);
+}
+
+PROVE_CASE(TestStatsFile) {
+  Ext2Driver driver(kTestFile);
+  driver.Initialize();
+  struct stat st;
+  driver.Getattr("/test", &st);
+  try {
+    driver.Getattr("/missing", &st);
+  } catch (const std::system_error &) {
+  }
+  uint64_t fd = driver.Open("/test");
+  char buf[4096];
+  PROVE_CHECK(driver.Read(fd, buf, sizeof(buf), 0) == 5);
+  driver.Close(fd);
+
+  std::string path = std::string("/") + kStatsFileName;
+  driver.Getattr(path.c_str(), &st);
+  PROVE_CHECK(S_ISREG(st.st_mode));
+  PROVE_CHECK(st.st_size == 0);
+  fd = driver.Open(path.c_str());
+  int len = driver.Read(fd, buf, sizeof(buf), 0);
+  std::string text(buf, len);
+  // The snapshot was taken at open, before its own getattr and read ended.
+  PROVE_CHECK(text.find("getattr.calls 3\n") != std::string::npos);
+  PROVE_CHECK(text.find("getattr.errors 1\n") != std::string::npos);
+  PROVE_CHECK(text.find("read.calls 1\n") != std::string::npos);
+  PROVE_CHECK(text.find("bytes_read 5\n") != std::string::npos);
+  PROVE_CHECK(text.find("block_cache.misses") != std::string::npos);
+  PROVE_CHECK(driver.Read(fd, buf, sizeof(buf), len) == 0);
+  driver.Close(fd);
+  PROVE_CHECK(driver.Lookup(driver.RootInode(), kStatsFileName) ==
+              driver.StatsInode());
+}
+
+PROVE_CASE(TestMetricsMergesThreads) {
+  Metrics metrics;
+  for (int round = 0; round < 2; ++round) {
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t) {
+      threads.emplace_back([&metrics] {
+        for (int i = 0; i < 1000; ++i) {
+          metrics.Add(Counter::kImageReads);
+          metrics.Record(Op::kRead, 1500, i % 10 == 0);
+        }
+      });
+    }
+    for (std::thread &thread : threads) {
+      thread.join();
+    }
+  }
+  PROVE_CHECK(metrics.Get(Counter::kImageReads) == 8000u);
+  Metrics::OpStats stats = metrics.Get(Op::kRead);
+  PROVE_CHECK(stats.calls == 8000u);
+  PROVE_CHECK(stats.errors == 800u);
+  PROVE_CHECK(stats.total_ns == 8000u * 1500);
+  // 1500ns falls into the bucket below 2048ns.
+  PROVE_CHECK(stats.PercentileNs(0.99) == 2048u);
+}
+
+PROVE_CASE(TestExtentMappedFiles) {
+  const char image[] = "/tmp/ext2fuse_test_extents.img";
+  const uint32_t seed = 7;
+  const size_t block_size = 1024;
+  uint32_t fragmented, sparse;
+  {
+    // Scattered 1K blocks give "fragmented" hundreds of extents, more than
+    // one level of index nodes can hold.
+    ImageBuilder builder(image, 16 << 20, block_size, 512, seed, 0.5, true);
+    fragmented = builder.AddFile(ImageBuilder::kRootInode, "fragmented", 1 << 20);
+    sparse = builder.AddFile(ImageBuilder::kRootInode, "sparse", 1 << 20, true);
+    uint32_t dir = builder.AddDirectory(ImageBuilder::kRootInode, "dir");
+    for (int i = 0; i < 200; ++i) {
+      builder.AddFile(dir, "f" + std::to_string(i), i);
+    }
+    builder.Finish();
+  }
+  Ext2Driver driver(image);
+  driver.Initialize();
+  std::vector<char> buf(1 << 20), expected(block_size);
+  uint64_t fd = driver.Open("/fragmented");
+  PROVE_CHECK(driver.Read(fd, buf.data(), buf.size(), 0) == 1 << 20);
+  for (size_t block = 0; block < buf.size() / block_size; ++block) {
+    ImageBuilder::FillBlock(seed, fragmented, block, expected.data(), block_size);
+    PROVE_CHECK(std::memcmp(buf.data() + block * block_size, expected.data(),
+                            block_size) == 0);
+  }
+  driver.Close(fd);
+  fd = driver.Open("/sparse");
+  PROVE_CHECK(driver.Read(fd, buf.data(), buf.size(), 0) == 1 << 20);
+  size_t first_hole = buf.size();
+  for (size_t block = 0; block < buf.size() / block_size; ++block) {
+    if (ImageBuilder::IsHole(seed, sparse, block)) {
+      std::fill(expected.begin(), expected.end(), 0);
+      first_hole = std::min(first_hole, block * block_size);
+    } else {
+      ImageBuilder::FillBlock(seed, sparse, block, expected.data(), block_size);
+    }
+    PROVE_CHECK(std::memcmp(buf.data() + block * block_size, expected.data(),
+                            block_size) == 0);
+  }
+  PROVE_CHECK(driver.Lseek(fd, 0, SEEK_HOLE) == static_cast<off_t>(first_hole));
+  driver.Close(fd);
+  struct stat st;
+  driver.Getattr("/dir/f199", &st);
+  PROVE_CHECK(st.st_size == 199);
+  unlink(image);
+}
+
+PROVE_CASE(TestReadSegments) {
+  const char image[] = "/tmp/ext2fuse_test_segments.img";
+  const size_t block_size = 1024;
+  {
+    ImageBuilder builder(image, 16 << 20, block_size, 512, 3, 0.2);
+    builder.AddFile(ImageBuilder::kRootInode, "sparse", (1 << 20) + 123, true);
+    builder.Finish();
+  }
+  for (bool use_mmap : {false, true}) {
+    Ext2Driver driver(image);
+    DriverOptions options;
+    options.use_mmap = use_mmap;
+    driver.Initialize(options);
+    uint64_t fd = driver.Open("/sparse");
+    std::vector<char> expected(200 << 10), pieces(200 << 10);
+    const size_t offsets[] = {0, 1, 1023, 4096, 500000, (1 << 20) - 10};
+    size_t image_pieces = 0;
+    for (size_t off : offsets) {
+      size_t len = driver.Read(fd, expected.data(), expected.size(), off);
+      std::vector<ReadSegment> segments =
+          driver.ReadSegments(fd, expected.size(), off);
+      size_t done = 0;
+      for (const ReadSegment &segment : segments) {
+        if (segment.data) {
+          memcpy(pieces.data() + done, segment.data.get(), segment.length);
+        } else if (segment.image_offset == 0) {
+          memset(pieces.data() + done, 0, segment.length);
+        } else {
+          // Image pieces are whole, aligned blocks.
+          image_pieces++;
+          PROVE_CHECK((off + done) % block_size == 0u);
+          PROVE_CHECK(segment.length % block_size == 0u);
+          PROVE_CHECK(pread(driver.ImageFd(), pieces.data() + done,
+                            segment.length, segment.image_offset) ==
+                      static_cast<ssize_t>(segment.length));
+        }
+        done += segment.length;
+      }
+      PROVE_CHECK(done == len);
+      PROVE_CHECK(std::memcmp(pieces.data(), expected.data(), len) == 0);
+    }
+    PROVE_CHECK(image_pieces > 0u);
+    PROVE_CHECK(driver.ReadSegments(fd, 10, (1 << 20) + 123).empty());
+    // Only large aligned reads of a pread image are worth splicing.
+    PROVE_CHECK(driver.ShouldSplice(128 << 10, 4096) == !use_mmap);
+    PROVE_CHECK(!driver.ShouldSplice(128 << 10, 4097));
+    PROVE_CHECK(!driver.ShouldSplice(4096, 4096));
+    driver.Close(fd);
+  }
+  unlink(image);
+}
+
+PROVE_CASE(TestLargeFiles) {
+  const char image[] = "/tmp/ext2fuse_test_large.img";
+  const uint32_t seed = 11;
+  const uint64_t size = (5ULL << 30) + 100;
+  // 1K blocks reach 4 GiB through triply indirect blocks; 4K blocks are
+  // mapped by extents.
+  for (size_t block_size : {1024, 4096}) {
+    const uint64_t boundary = (1ULL << 32) / block_size;
+    const uint64_t last = (size - 1) / block_size;
+    uint32_t huge;
+    {
+      ImageBuilder builder(image, 16 << 20, block_size, 64, seed, 0,
+                           block_size == 4096);
+      huge = builder.AddSparseFile(ImageBuilder::kRootInode, "huge", size,
+                                   {0, boundary - 1, boundary, last});
+      builder.Finish();
+    }
+    Ext2Driver driver(image);
+    driver.Initialize();
+    struct stat st;
+    driver.Getattr("/huge", &st);
+    PROVE_CHECK(static_cast<uint64_t>(st.st_size) == size);
+    uint64_t fd = driver.Open("/huge");
+    std::vector<char> buf(2 * block_size), expected(2 * block_size);
+    // Across the 4 GiB mark.
+    ImageBuilder::FillBlock(seed, huge, boundary - 1, expected.data(),
+                            block_size);
+    ImageBuilder::FillBlock(seed, huge, boundary, expected.data() + block_size,
+                            block_size);
+    PROVE_CHECK(driver.Read(fd, buf.data(), buf.size(),
+                            (boundary - 1) * block_size) ==
+                static_cast<int>(buf.size()));
+    PROVE_CHECK(std::memcmp(buf.data(), expected.data(), buf.size()) == 0);
+    // The tail, past 5 GiB.
+    ImageBuilder::FillBlock(seed, huge, last, expected.data(), block_size);
+    PROVE_CHECK(driver.Read(fd, buf.data(), buf.size(), last * block_size) ==
+                static_cast<int>(size - last * block_size));
+    PROVE_CHECK(std::memcmp(buf.data(), expected.data(),
+                            size - last * block_size) == 0);
+    PROVE_CHECK(driver.Read(fd, buf.data(), buf.size(), size) == 0);
+    // Holes in between.
+    PROVE_CHECK(driver.Read(fd, buf.data(), buf.size(), 3ULL << 30) ==
+                static_cast<int>(buf.size()));
+    PROVE_CHECK(std::count(buf.begin(), buf.end(), 0) ==
+                static_cast<long>(buf.size()));
+    PROVE_CHECK(static_cast<uint64_t>(driver.Lseek(fd, block_size, SEEK_DATA)) ==
+                (boundary - 1) * block_size);
+    PROVE_CHECK(static_cast<uint64_t>(driver.Lseek(
+                    fd, (boundary + 1) * block_size, SEEK_DATA)) ==
+                last * block_size);
+    std::vector<ReadSegment> segments =
+        driver.ReadSegments(fd, block_size, boundary * block_size);
+    PROVE_CHECK(segments.size() == 1u);
+    PROVE_CHECK(segments[0].image_offset != 0u);
+    driver.Close(fd);
+  }
+  unlink(image);
+}
+
+PROVE_CASE(TestUninitializedInodeGroup) {
+  const char image[] = "/tmp/ext2fuse_test_uninit.img";
+  {
+    // Two groups of 32 inodes, everything but the root in the first one.
+    ImageBuilder builder(image, 16 << 20, 1024, 64, 1);
+    builder.AddFile(ImageBuilder::kRootInode, "file", 10);
+    builder.Finish();
+  }
+  // Flag the second group INODE_UNINIT and leave garbage in its bitmap, as
+  // nothing reads it.
+  int image_fd = open(image, O_RDWR);
+  ext2_group_desc gd;
+  const off_t gd_offset = 2 * 1024 + sizeof(gd);
+  PROVE_CHECK(pread(image_fd, &gd, sizeof(gd), gd_offset) ==
+              static_cast<ssize_t>(sizeof(gd)));
+  gd.bg_flags |= EXT2_BG_INODE_UNINIT;
+  PROVE_CHECK(pwrite(image_fd, &gd, sizeof(gd), gd_offset) ==
+              static_cast<ssize_t>(sizeof(gd)));
+  std::vector<char> garbage(1024, '\xff');
+  PROVE_CHECK(pwrite(image_fd, garbage.data(), garbage.size(),
+                     off_t(gd.bg_inode_bitmap) * 1024) == 1024);
+  close(image_fd);
+
+  Ext2Driver driver(image);
+  driver.Initialize();
+  struct stat st;
+  for (size_t inode_idx : {0, 40}) {
+    int error = 0;
+    try {
+      driver.GetattrByInode(inode_idx, &st);
+    } catch (const std::system_error &err) {
+      error = err.code().value();
+    }
+    PROVE_CHECK(error == (inode_idx == 0 ? ENOENT : ESTALE));
+  }
+  driver.Getattr("/file", &st);
+  PROVE_CHECK(st.st_size == 10);
+  unlink(image);
+}
+
+PROVE_CASE(TestScanInodes) {
+  const char image[] = "/tmp/ext2fuse_test_scan.img";
+  ImageSpec spec;
+  spec.size_bytes = 32 << 20;
+  spec.files = 600;
+  spec.fanout = 6;
+  spec.max_file_bytes = 16 << 10;
+  spec.symlink_fraction = 0.1;
+  GenerateImage(image, spec);
+  Ext2Driver driver(image);
+  driver.Initialize();
+  // What a path walk finds: the parent and size of every linked inode.
+  std::map<size_t, std::pair<size_t, off_t>> walked;
+  std::vector<size_t> pending{driver.RootInode()};
+  while (!pending.empty()) {
+    size_t dir = pending.back();
+    pending.pop_back();
+    uint64_t fd = driver.OpendirInode(dir);
+    driver.Readdir(fd, 0, [&](const DirEntry &entry) {
+      if (entry.name == "." || entry.name == "..") {
+        return true;
+      }
+      struct stat st;
+      driver.GetattrByInode(entry.inode_idx, &st);
+      walked[entry.inode_idx] = {dir, st.st_size};
+      if (S_ISDIR(st.st_mode)) {
+        pending.push_back(entry.inode_idx);
+      }
+      return true;
+    });
+    driver.Releasedir(fd);
+  }
+  PROVE_CHECK(walked.size() > spec.files);
+  for (size_t threads : {1, 4}) {
+    std::mutex mutex;
+    std::map<size_t, ext2_inode> scanned;
+    std::unordered_map<size_t, size_t> parents;
+    driver.ScanInodes([&](size_t inode_idx, const ext2_inode &inode) {
+      std::lock_guard<std::mutex> lock(mutex);
+      scanned[inode_idx] = inode;
+    }, threads, &parents);
+    // Besides the linked inodes only the reserved ones below 11 are in use.
+    size_t reserved = 0;
+    for (const auto &entry : scanned) {
+      if (walked.count(entry.first) == 0) {
+        PROVE_CHECK(entry.first < 11u);
+        reserved++;
+      }
+    }
+    PROVE_CHECK(scanned.size() == walked.size() + reserved);
+    PROVE_CHECK(parents.size() == walked.size());
+    for (const auto &entry : walked) {
+      PROVE_CHECK(parents[entry.first] == entry.second.first);
+      PROVE_CHECK(scanned.count(entry.first) == 1u);
+      PROVE_CHECK(scanned[entry.first].i_size == entry.second.second);
+    }
+  }
+  unlink(image);
+}
+
+int RemoveEntry(const char *path, const struct stat *, int, struct FTW *) {
+  return remove(path);
+}
+
+PROVE_CASE(TestExtract) {
+  const char image[] = "/tmp/ext2fuse_test_extract.img";
+  const std::string destination = "/tmp/ext2fuse_test_extract";
+  ImageSpec spec;
+  spec.files = 300;
+  spec.fanout = 8;
+  spec.max_file_bytes = 256 << 10;
+  spec.fragmentation = 0.3;
+  spec.sparse_fraction = 0.2;
+  spec.symlink_fraction = 0.1;
+  GenerateImage(image, spec);
+  Ext2Driver driver(image);
+  DriverOptions driver_options;
+  driver_options.readahead_threads = 0;
+  driver.Initialize(driver_options);
+  ExtractOptions options;
+  options.chunk_bytes = 8 << 10;
+  options.modes = options.times = options.symlinks = true;
+  ExtractStats stats = Extract(driver, destination, options);
+  PROVE_CHECK(stats.files + stats.symlinks == spec.files);
+  // Compare the host tree with the image, entry by entry.
+  size_t compared = 0;
+  std::vector<char> expected(spec.max_file_bytes), actual(spec.max_file_bytes);
+  std::vector<std::string> pending{""};
+  while (!pending.empty()) {
+    std::string dir = pending.back();
+    pending.pop_back();
+    uint64_t fd = driver.Opendir(dir.empty() ? "/" : dir.c_str());
+    std::vector<std::pair<std::string, struct stat>> entries;
+    driver.Readdir(fd, 0, [&](const DirEntry &entry) {
+      if (entry.name != "." && entry.name != "..") {
+        entries.emplace_back(dir + "/" + std::string(entry.name), *entry.attr);
+      }
+      return true;
+    }, true);
+    driver.Releasedir(fd);
+    for (const auto &entry : entries) {
+      const struct stat &attr = entry.second;
+      std::string host = destination + entry.first;
+      struct stat st;
+      PROVE_CHECK(lstat(host.c_str(), &st) == 0);
+      PROVE_CHECK((st.st_mode & S_IFMT) == (attr.st_mode & S_IFMT));
+      PROVE_CHECK(st.st_mtime == attr.st_mtime);
+      if (S_ISDIR(attr.st_mode)) {
+        PROVE_CHECK((st.st_mode & 07777) == (attr.st_mode & 07777));
+        pending.push_back(entry.first);
+      } else if (S_ISLNK(attr.st_mode)) {
+        char target[256];
+        int len = driver.Readlink(entry.first.c_str(), target, sizeof(target));
+        PROVE_CHECK(readlink(host.c_str(), actual.data(), actual.size()) == len);
+        PROVE_CHECK(std::memcmp(actual.data(), target, len) == 0);
+      } else {
+        PROVE_CHECK((st.st_mode & 07777) == (attr.st_mode & 07777));
+        PROVE_CHECK(st.st_size == attr.st_size);
+        uint64_t file = driver.Open(entry.first.c_str());
+        int len = driver.Read(file, expected.data(), expected.size(), 0);
+        driver.Close(file);
+        int host_fd = open(host.c_str(), O_RDONLY);
+        PROVE_CHECK(read(host_fd, actual.data(), actual.size()) == len);
+        close(host_fd);
+        PROVE_CHECK(std::memcmp(actual.data(), expected.data(), len) == 0);
+        compared++;
+      }
+    }
+  }
+  PROVE_CHECK(compared == stats.files);
+  nftw(destination.c_str(), RemoveEntry, 16, FTW_DEPTH | FTW_PHYS);
+  unlink(image);
+}
+
+PROVE_CASE(TestExtractFragmentedUnderFileLimit) {
+  const char image[] = "/tmp/ext2fuse_test_extract_fragmented.img";
+  const std::string destination = "/tmp/ext2fuse_test_extract_fragmented";
+  ImageSpec spec;
+  spec.size_bytes = 32 << 20;
+  spec.files = 1000;
+  spec.min_file_bytes = 8 << 10;
+  spec.max_file_bytes = 16 << 10;
+  spec.fragmentation = 0.9;
+  GenerateImage(image, spec);
+  Ext2Driver driver(image);
+  DriverOptions driver_options;
+  driver_options.readahead_threads = 0;
+  driver.Initialize(driver_options);
+  ExtractOptions options;
+  options.chunk_bytes = 1 << 10;
+  // Far fewer descriptors than files whose chunks interleave.
+  struct rlimit saved, limit;
+  PROVE_CHECK(getrlimit(RLIMIT_NOFILE, &saved) == 0);
+  limit = saved;
+  limit.rlim_cur = 128;
+  PROVE_CHECK(setrlimit(RLIMIT_NOFILE, &limit) == 0);
+  ExtractStats stats;
+  bool extracted = false;
+  try {
+    stats = Extract(driver, destination, options);
+    extracted = true;
+  } catch (const std::system_error &) {
+  }
+  PROVE_CHECK(setrlimit(RLIMIT_NOFILE, &saved) == 0);
+  PROVE_CHECK(extracted);
+  PROVE_CHECK(stats.files == spec.files);
+  // Spot check the last file listed, whose chunks come from all over.
+  uint64_t dir = driver.Opendir("/");
+  std::string name;
+  driver.Readdir(dir, 0, [&name](const DirEntry &entry) {
+    if (entry.type == S_IFREG) {
+      name = entry.name;
+    }
+    return true;
+  });
+  driver.Releasedir(dir);
+  PROVE_CHECK(!name.empty());
+  std::vector<char> expected(spec.max_file_bytes), actual(spec.max_file_bytes);
+  uint64_t fd = driver.Open(("/" + name).c_str());
+  int len = driver.Read(fd, expected.data(), expected.size(), 0);
+  driver.Close(fd);
+  int host_fd = open((destination + "/" + name).c_str(), O_RDONLY);
+  PROVE_CHECK(read(host_fd, actual.data(), actual.size()) == len);
+  close(host_fd);
+  PROVE_CHECK(std::memcmp(actual.data(), expected.data(), len) == 0);
+  nftw(destination.c_str(), RemoveEntry, 16, FTW_DEPTH | FTW_PHYS);
+  unlink(image);
+}
+
+PROVE_CASE(TestExtractSkipsDanglingEntries) {
+  const char image[] = "/tmp/ext2fuse_test_extract_dangling.img";
+  const std::string destination = "/tmp/ext2fuse_test_extract_dangling";
+  uint32_t dir;
+  {
+    ImageBuilder builder(image, 4 << 20, 1024, 64, 1);
+    dir = builder.AddDirectory(ImageBuilder::kRootInode, "dir");
+    builder.AddFile(dir, "a", 10);
+    builder.AddFile(dir, "b", 10);
+    builder.AddFile(dir, "c", 3000);
+    builder.Finish();
+  }
+  std::vector<char> block(1024);
+  int image_fd = open(image, O_RDWR);
+  off_t block_offset = 0;
+  for (; block_offset < (4 << 20); block_offset += 1024) {
+    PROVE_CHECK(pread(image_fd, block.data(), block.size(), block_offset) == 1024);
+    const ext2_dir_entry_2 *dot =
+        reinterpret_cast<const ext2_dir_entry_2 *>(block.data());
+    if (dot->inode == dir && dot->name_len == 1 && dot->name[0] == '.') {
+      break;
+    }
+  }
+  PROVE_CHECK(block_offset < (4 << 20));
+  // "a" names a free inode and "b" one past the end of the table.
+  for (size_t at = 0; at < block.size();) {
+    ext2_dir_entry_2 *dirent =
+        reinterpret_cast<ext2_dir_entry_2 *>(block.data() + at);
+    if (dirent->name_len == 1 && dirent->name[0] == 'a') {
+      dirent->inode = 60;
+    } else if (dirent->name_len == 1 && dirent->name[0] == 'b') {
+      dirent->inode = 1000;
+    }
+    at += dirent->rec_len;
+  }
+  PROVE_CHECK(pwrite(image_fd, block.data(), block.size(), block_offset) == 1024);
+  close(image_fd);
+  Ext2Driver driver(image);
+  driver.Initialize();
+  ExtractStats stats = Extract(driver, destination);
+  // lost+found and "dir".
+  PROVE_CHECK(stats.directories == 2u);
+  PROVE_CHECK(stats.files == 1u);
+  PROVE_CHECK(stats.skipped == 2u);
+  PROVE_CHECK(stats.bytes == 3000u);
+  struct stat st;
+  PROVE_CHECK(stat((destination + "/dir/c").c_str(), &st) == 0);
+  PROVE_CHECK(st.st_size == 3000);
+  PROVE_CHECK(stat((destination + "/dir/a").c_str(), &st) < 0);
+  nftw(destination.c_str(), RemoveEntry, 16, FTW_DEPTH | FTW_PHYS);
+  unlink(image);
+}
+
+uint64_t StatValue(const std::string &text, const std::string &name) {
+  // Every name but the first follows a newline.
+  size_t at = text.find("\n" + name + " ");
+  if (at == std::string::npos) {
+    return 0;
+  }
+  return strtoull(text.c_str() + at + name.size() + 2, nullptr, 10);
+}
+
+PROVE_CASE(TestSnapshot) {
+  const char image[] = "/tmp/ext2fuse_test_snapshot.img";
+  const char snapshot[] = "/tmp/ext2fuse_test_snapshot.idx";
+  ImageSpec spec;
+  spec.files = 300;
+  spec.fanout = 8;
+  spec.max_file_bytes = 64 << 10;
+  spec.fragmentation = 0.3;
+  spec.sparse_fraction = 0.2;
+  spec.symlink_fraction = 0.1;
+  GenerateImage(image, spec);
+  unlink(snapshot);
+  DriverOptions options;
+  options.readahead_threads = 0;
+  options.snapshot_path = snapshot;
+  {
+    // No snapshot yet, and none is written unless asked for.
+    Ext2Driver driver(image);
+    driver.Initialize(options);
+    PROVE_CHECK(StatValue(driver.StatsText(), "snapshot") == 0u);
+    PROVE_CHECK(access(snapshot, F_OK) < 0);
+  }
+  options.write_snapshot = true;
+  {
+    Ext2Driver driver(image);
+    driver.Initialize(options);
+    PROVE_CHECK(StatValue(driver.StatsText(), "snapshot") == 1u);
+  }
+  struct stat written;
+  PROVE_CHECK(stat(snapshot, &written) == 0);
+
+  Ext2Driver reference(image);
+  reference.Initialize();
+  Ext2Driver driver(image);
+  driver.Initialize(options);
+  PROVE_CHECK(StatValue(driver.StatsText(), "snapshot") == 1u);
+  uint64_t image_reads = StatValue(driver.StatsText(), "image_reads");
+  // Walk the tree by lookups, as the kernel would, comparing attributes and
+  // block maps with a driver reading the image.
+  size_t checked = 0;
+  std::vector<size_t> pending{reference.RootInode()};
+  while (!pending.empty()) {
+    size_t dir = pending.back();
+    pending.pop_back();
+    uint64_t fd = reference.OpendirInode(dir);
+    std::vector<std::string> names;
+    reference.Readdir(fd, 0, [&](const DirEntry &entry) {
+      names.emplace_back(entry.name);
+      return true;
+    });
+    reference.Releasedir(fd);
+    for (const std::string &name : names) {
+      size_t inode_idx = reference.Lookup(dir, name);
+      PROVE_CHECK(driver.Lookup(dir, name) == inode_idx);
+      struct stat expected = {}, actual = {};
+      reference.GetattrByInode(inode_idx, &expected);
+      driver.GetattrByInode(inode_idx, &actual);
+      PROVE_CHECK(std::memcmp(&expected, &actual, sizeof(expected)) == 0);
+      if (name == "." || name == "..") {
+        continue;
+      }
+      if (S_ISDIR(expected.st_mode)) {
+        pending.push_back(inode_idx);
+      } else if (S_ISREG(expected.st_mode)) {
+        uint64_t expected_fd = reference.OpenInode(inode_idx);
+        uint64_t actual_fd = driver.OpenInode(inode_idx);
+        std::shared_ptr<const BlockMap> expected_map =
+            reference.FileBlockMap(expected_fd);
+        std::shared_ptr<const BlockMap> actual_map =
+            driver.FileBlockMap(actual_fd);
+        PROVE_CHECK(actual_map->size() == expected_map->size());
+        for (size_t i = 0; i < expected_map->size(); ++i) {
+          PROVE_CHECK((*actual_map)[i].file_block ==
+                      (*expected_map)[i].file_block);
+          PROVE_CHECK((*actual_map)[i].image_block ==
+                      (*expected_map)[i].image_block);
+          PROVE_CHECK((*actual_map)[i].length == (*expected_map)[i].length);
+        }
+        reference.Close(expected_fd);
+        driver.Close(actual_fd);
+        checked++;
+      }
+    }
+    bool fired = false;
+    try {
+      driver.Lookup(dir, "missing");
+    } catch (const std::system_error &err) {
+      PROVE_CHECK(err.code().value() == ENOENT);
+      fired = true;
+    }
+    PROVE_CHECK(fired);
+  }
+  PROVE_CHECK(checked > 0u);
+  std::string text = driver.StatsText();
+  PROVE_CHECK(StatValue(text, "image_reads") == image_reads);
+  PROVE_CHECK(StatValue(text, "snapshot_hits") > 0u);
+
+  // Once the image is written to, the snapshot is stale and replaced.
+  ext2_super_block sb;
+  int image_fd = open(image, O_RDWR);
+  PROVE_CHECK(pread(image_fd, &sb, sizeof(sb), 1024) ==
+              static_cast<ssize_t>(sizeof(sb)));
+  sb.s_wtime++;
+  PROVE_CHECK(pwrite(image_fd, &sb, sizeof(sb), 1024) ==
+              static_cast<ssize_t>(sizeof(sb)));
+  close(image_fd);
+  {
+    Ext2Driver driver(image);
+    driver.Initialize(options);
+    PROVE_CHECK(StatValue(driver.StatsText(), "snapshot") == 1u);
+  }
+  struct stat rewritten;
+  PROVE_CHECK(stat(snapshot, &rewritten) == 0);
+  PROVE_CHECK(rewritten.st_ino != written.st_ino);
+  // Mounts writing the same snapshot at once each write a file of their own.
+  {
+    Ext2Driver first(image), second(image);
+    first.Initialize();
+    second.Initialize();
+    std::thread writer([&first, snapshot] { first.WriteSnapshot(snapshot); });
+    second.WriteSnapshot(snapshot);
+    writer.join();
+    Ext2Driver driver(image);
+    driver.Initialize(options);
+    PROVE_CHECK(StatValue(driver.StatsText(), "snapshot") == 1u);
+    PROVE_CHECK(StatValue(driver.StatsText(), "snapshot_write_errors") == 0u);
+  }
+  // Neither is a damaged one; where none can be written the image is
+  // served without.
+  PROVE_CHECK(truncate(snapshot, 64) == 0);
+  {
+    Ext2Driver driver(image);
+    driver.Initialize(options);
+    PROVE_CHECK(StatValue(driver.StatsText(), "snapshot") == 1u);
+  }
+  PROVE_CHECK(stat(snapshot, &rewritten) == 0);
+  PROVE_CHECK(rewritten.st_size > 64);
+  options.snapshot_path = "/nonexistent/snapshot.idx";
+  {
+    Ext2Driver driver(image);
+    driver.Initialize(options);
+    PROVE_CHECK(StatValue(driver.StatsText(), "snapshot") == 0u);
+    PROVE_CHECK(StatValue(driver.StatsText(), "snapshot_write_errors") == 1u);
+    struct stat st;
+    driver.GetattrByInode(driver.RootInode(), &st);
+    PROVE_CHECK(S_ISDIR(st.st_mode));
+  }
+  unlink(snapshot);
+  unlink(image);
+}
+
+PROVE_CASE(TestSnapshotMissingRecords) {
+  const char image[] = "/tmp/ext2fuse_test_snapshot_records.img";
+  const char snapshot[] = "/tmp/ext2fuse_test_snapshot_records.idx";
+  uint32_t dir, file;
+  {
+    ImageBuilder builder(image, 4 << 20, 1024, 64, 1);
+    dir = builder.AddDirectory(ImageBuilder::kRootInode, "dir");
+    file = builder.AddFile(dir, "a", 10);
+    builder.Finish();
+  }
+  ext2_super_block sb;
+  int image_fd = open(image, O_RDONLY);
+  PROVE_CHECK(pread(image_fd, &sb, sizeof(sb), 1024) ==
+              static_cast<ssize_t>(sizeof(sb)));
+  close(image_fd);
+  DriverOptions options;
+  options.readahead_threads = 0;
+  options.snapshot_path = snapshot;
+  // A snapshot holding only the root, whose entries run past the table.
+  MetadataSnapshot::Contents contents;
+  {
+    Ext2Driver reference(image);
+    reference.Initialize();
+    size_t root_idx = reference.RootInode();
+    reference.ScanInodes([&](size_t inode_idx, const ext2_inode &inode) {
+      if (inode_idx == root_idx) {
+        SnapshotInode root = {};
+        root.inode_idx = inode_idx;
+        root.inode = inode;
+        root.first_entry = 1;
+        root.entry_count = 1;
+        contents.inodes.push_back(root);
+      }
+    });
+  }
+  MetadataSnapshot::Write(snapshot, sb, contents);
+  {
+    Ext2Driver driver(image);
+    driver.Initialize(options);
+    PROVE_CHECK(StatValue(driver.StatsText(), "snapshot") == 1u);
+    // Neither answer is in the snapshot, so both come from the image.
+    PROVE_CHECK(driver.Lookup(driver.RootInode(), "dir") == dir);
+    uint64_t hits = StatValue(driver.StatsText(), "snapshot_hits");
+    PROVE_CHECK(driver.Lookup(dir, "a") == file);
+    PROVE_CHECK(StatValue(driver.StatsText(), "snapshot_hits") == hits);
+  }
+  // Once it has a sound record of the root, the snapshot's word is final.
+  contents.inodes[0].first_entry = 0;
+  contents.entries.push_back({0, 0, 1, 0});
+  contents.names = "b";
+  MetadataSnapshot::Write(snapshot, sb, contents);
+  {
+    Ext2Driver driver(image);
+    driver.Initialize(options);
+    bool fired = false;
+    try {
+      driver.Lookup(driver.RootInode(), "dir");
+    } catch (const std::system_error &err) {
+      PROVE_CHECK(err.code().value() == ENOENT);
+      fired = true;
+    }
+    PROVE_CHECK(fired);
+  }
+  unlink(snapshot);
+  unlink(image);
+}
+
 int main() {
   prove::run();
 }